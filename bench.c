@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "utcp.h"
+
+// Benchmarks UTCP over an emulated link between two instances in the same process.
+// Time is simulated, so results only depend on the scenario and the random seed, except for the CPU time.
+// Usage: bench [scenario [congestion control]]
+// For meaningful CPU numbers build with optimization and without DEBUG, for example: make clean; make CFLAGS=-O2 bench
+
+#define USEC_PER_SEC 1000000
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_SEC 1000000000ULL
+#define MSG_SIZE 1024 // latency is measured from writing a message to receiving all of it
+#define MAX_QUEUE 4096
+#define REORDER_DELAY 3000 // usec a reordered packet is held back
+#define DEADLINE 600 // sec of simulated time a scenario may take
+
+// One direction of the link, both directions use the same parameters
+struct link {
+	uint64_t bandwidth; // bytes per second
+	uint32_t delay; // usec
+	uint32_t jitter; // usec, a random part of it is added to the delay without reordering packets
+	double loss;
+	double reorder;
+	uint32_t queue; // packets the bottleneck buffer holds
+};
+
+struct scenario {
+	const char *name;
+	struct link link;
+	uint32_t messages;
+	uint32_t rate; // messages per second, 0 to send as fast as possible
+};
+
+static const struct scenario scenarios[] = {
+	{"lan", {125000000, 100, 0, 0, 0, 256}, 8192, 0},
+	{"wan", {12500000, 20000, 1000, 0, 0, 256}, 8192, 0},
+	{"lossy", {2500000, 30000, 0, 0.01, 0, 128}, 4096, 0},
+	{"reorder", {6250000, 10000, 2000, 0, 0.02, 256}, 4096, 0},
+	{"bufferbloat", {1250000, 20000, 0, 0, 0, 2048}, 2048, 0},
+	{"satellite", {1250000, 300000, 0, 0.005, 0, 512}, 2048, 0},
+	{"messages", {12500000, 20000, 1000, 0.01, 0, 256}, 2000, 200},
+};
+
+static const char *algorithms[] = {"reno", "cubic", "bbr"};
+
+// Packets in flight, in a min-heap ordered by arrival time
+
+struct packet {
+	uint64_t at;
+	uint64_t id; // keeps packets that arrive at the same time in order
+	struct utcp *to;
+	size_t len;
+	struct packet *next; // in the free list
+	char data[2048];
+};
+
+static struct packet **heap;
+static size_t nheap;
+static size_t heap_size;
+static struct packet *free_packets;
+
+// The sending side of an instance
+struct end {
+	struct utcp *peer;
+	uint64_t busy; // when the link finishes sending the packets queued so far
+	uint64_t last; // arrival time of the last packet that was not reordered
+	uint64_t departs[MAX_QUEUE]; // when the packets in the bottleneck buffer leave it
+	uint32_t qhead;
+	uint32_t nqueued;
+};
+
+static const struct link *path; // of the scenario that is running
+static uint64_t now; // nsec
+static uint64_t next_id;
+static uint64_t prng;
+
+static uint64_t *written; // when message i was written
+static uint64_t *latencies;
+static uint32_t nwritten;
+static uint64_t delivered;
+
+static double uniform(void) {
+	// xorshift64*
+	prng ^= prng >> 12;
+	prng ^= prng << 25;
+	prng ^= prng >> 27;
+	return (prng * 2685821657736338717ULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+static void heap_push(struct packet *pkt) {
+	if(nheap == heap_size) {
+		heap_size = heap_size ? heap_size * 2 : 256;
+		heap = realloc(heap, heap_size * sizeof *heap);
+		if(!heap)
+			abort();
+	}
+
+	size_t i = nheap++;
+	while(i) {
+		size_t parent = (i - 1) / 2;
+		struct packet *p = heap[parent];
+		if(p->at < pkt->at || (p->at == pkt->at && p->id < pkt->id))
+			break;
+		heap[i] = p;
+		i = parent;
+	}
+	heap[i] = pkt;
+}
+
+static struct packet *heap_pop(void) {
+	struct packet *top = heap[0];
+	struct packet *last = heap[--nheap];
+	size_t i = 0;
+	for(;;) {
+		size_t child = 2 * i + 1;
+		if(child >= nheap)
+			break;
+		if(child + 1 < nheap && (heap[child + 1]->at < heap[child]->at || (heap[child + 1]->at == heap[child]->at && heap[child + 1]->id < heap[child]->id)))
+			child++;
+		if(last->at < heap[child]->at || (last->at == heap[child]->at && last->id < heap[child]->id))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if(nheap)
+		heap[i] = last;
+	return top;
+}
+
+static void do_clock(struct utcp *utcp, struct timeval *tv) {
+	tv->tv_sec = now / NSEC_PER_SEC;
+	tv->tv_usec = now % NSEC_PER_SEC / NSEC_PER_USEC;
+}
+
+static ssize_t do_send(struct utcp *utcp, const void *data, size_t len) {
+	struct end *end = utcp->priv;
+	if(len > sizeof free_packets->data)
+		return UTCP_ERROR;
+
+	// the bottleneck buffer drains at the bandwidth of the link, packets that don't fit are dropped
+	while(end->nqueued && end->departs[end->qhead] <= now) {
+		end->qhead = (end->qhead + 1) % MAX_QUEUE;
+		end->nqueued--;
+	}
+	if(end->nqueued >= path->queue)
+		return len;
+
+	if(end->busy < now)
+		end->busy = now;
+	end->busy += len * NSEC_PER_SEC / path->bandwidth;
+	end->departs[(end->qhead + end->nqueued++) % MAX_QUEUE] = end->busy;
+
+	if(uniform() < path->loss)
+		return len;
+
+	uint64_t at = end->busy + (path->delay + (uint64_t)(uniform() * path->jitter)) * NSEC_PER_USEC;
+	if(uniform() < path->reorder) {
+		at += REORDER_DELAY * NSEC_PER_USEC;
+	} else {
+		if(at < end->last)
+			at = end->last;
+		end->last = at;
+	}
+
+	struct packet *pkt = free_packets;
+	if(pkt)
+		free_packets = pkt->next;
+	else if(!(pkt = malloc(sizeof *pkt)))
+		abort();
+	pkt->at = at;
+	pkt->id = next_id++;
+	pkt->to = end->peer;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+	heap_push(pkt);
+	return len;
+}
+
+static void do_recv(struct utcp_connection *c, const void *data, size_t len) {
+	// every message that is complete now has arrived
+	uint64_t end = delivered + len;
+	for(uint64_t i = delivered / MSG_SIZE; (i + 1) * MSG_SIZE <= end; i++)
+		latencies[i] = now - written[i];
+	delivered = end;
+}
+
+static void do_accept(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv, NULL);
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t tv_nsec(struct timeval tv) {
+	return (uint64_t)tv.tv_sec * NSEC_PER_SEC + (uint64_t)tv.tv_usec * NSEC_PER_USEC;
+}
+
+static void run(const struct scenario *s, const char *cc) {
+	static char msg[MSG_SIZE];
+	struct end ea = {0}, eb = {0};
+
+	path = &s->link;
+	now = 1000 * NSEC_PER_SEC;
+	next_id = 0;
+	prng = 0x9e3779b97f4a7c15ULL;
+	nwritten = 0;
+	delivered = 0;
+	written = calloc(s->messages, sizeof *written);
+	latencies = calloc(s->messages, sizeof *latencies);
+	if(!written || !latencies)
+		abort();
+
+	struct utcp *a = utcp_init(NULL, NULL, do_send, &ea);
+	struct utcp *b = utcp_init(do_accept, NULL, do_send, &eb);
+	if(!a || !b)
+		abort();
+	ea.peer = b;
+	eb.peer = a;
+	utcp_set_clock_cb(a, do_clock);
+	utcp_set_clock_cb(b, do_clock);
+	utcp_set_mtu(a, 1300);
+	utcp_set_mtu(b, 1300);
+
+	struct timespec cpu_start, cpu_end;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+	uint64_t start = now;
+	uint64_t deadline = now + DEADLINE * NSEC_PER_SEC;
+	uint64_t total = (uint64_t)s->messages * MSG_SIZE;
+	struct utcp_connection *c = utcp_connect(a, 1, NULL, NULL);
+	if(!c || !utcp_set_congestion_control(c, cc))
+		abort();
+
+	while(delivered < total && now < deadline) {
+		// write whole messages, at the scenario's rate or as long as they fit
+		while(nwritten < s->messages && (!s->rate || now >= start + nwritten * NSEC_PER_SEC / s->rate) && utcp_get_sndbuf_free(c) >= MSG_SIZE) {
+			written[nwritten++] = now;
+			utcp_send(c, msg, MSG_SIZE);
+		}
+
+		while(nheap && heap[0]->at <= now) {
+			struct packet *pkt = heap_pop();
+			utcp_recv(pkt->to, pkt->data, pkt->len);
+			pkt->next = free_packets;
+			free_packets = pkt;
+		}
+
+		// skip ahead to the next thing that happens
+		uint64_t next = now + tv_nsec(utcp_timeout(a));
+		uint64_t next_b = now + tv_nsec(utcp_timeout(b));
+		if(next_b < next)
+			next = next_b;
+		if(nheap && heap[0]->at < next)
+			next = heap[0]->at;
+		if(s->rate && nwritten < s->messages) {
+			uint64_t next_msg = start + nwritten * NSEC_PER_SEC / s->rate;
+			if(next_msg < next)
+				next = next_msg;
+		}
+		now = next > now ? next : now + NSEC_PER_USEC;
+	}
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+	double cpu_ns = (cpu_end.tv_sec - cpu_start.tv_sec) * 1e9 + (cpu_end.tv_nsec - cpu_start.tv_nsec);
+
+	struct utcp_stats stats;
+	utcp_get_connection_stats(c, &stats);
+
+	uint32_t received = delivered / MSG_SIZE;
+	qsort(latencies, received, sizeof *latencies, compare_u64);
+	double elapsed = (now - start) / (double)NSEC_PER_SEC;
+
+	printf("%-12s %-6s %10.2f %9.2f %9.2f %7.2f %9.2f%s\n", s->name, cc,
+	       delivered * 8 / elapsed / 1e6,
+	       received ? latencies[received / 2] / 1e6 : 0,
+	       received ? latencies[received * 99 / 100] / 1e6 : 0,
+	       stats.segments_sent ? stats.retransmits * 100.0 / stats.segments_sent : 0,
+	       delivered ? cpu_ns / delivered : 0,
+	       delivered < total ? " (incomplete)" : "");
+
+	utcp_exit(a);
+	utcp_exit(b);
+	while(nheap) {
+		struct packet *pkt = heap_pop();
+		pkt->next = free_packets;
+		free_packets = pkt;
+	}
+	free(written);
+	free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+	if(argc > 3) {
+		fprintf(stderr, "Usage: %s [scenario [congestion control]]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-12s %-6s %10s %9s %9s %7s %9s\n", "scenario", "cc", "Mbit/s", "p50 ms", "p99 ms", "rtx %", "ns/byte");
+
+	for(size_t i = 0; i < sizeof scenarios / sizeof *scenarios; i++) {
+		if(argc > 1 && strcmp(argv[1], scenarios[i].name))
+			continue;
+		for(size_t j = 0; j < sizeof algorithms / sizeof *algorithms; j++) {
+			if(argc > 2 && strcmp(argv[2], algorithms[j]))
+				continue;
+			run(&scenarios[i], algorithms[j]);
+		}
+	}
+
+	while(free_packets) {
+		struct packet *pkt = free_packets;
+		free_packets = pkt->next;
+		free(pkt);
+	}
+	free(heap);
+	return 0;
+}
@@ -11,6 +11,17 @@
   #include <unistd.h>
   #include <sys/time.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
+#endif
+
+#ifdef _WIN32
+  #ifndef UTCP_HAVE_IOVEC
+    #define UTCP_HAVE_IOVEC
+    struct iovec {
+      void *iov_base;
+      size_t iov_len;
+    };
+  #endif
 #endif
 
 #ifndef PRINT_SIZE_T
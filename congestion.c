@@ -0,0 +1,451 @@
+/*
+    congestion.c -- Congestion control algorithms
+    Copyright (C) 2014 Guus Sliepen <guus@tinc-vpn.org>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "utcp_priv.h"
+
+static int64_t usec_since(const struct timeval *now, const struct timeval *then) {
+    return (int64_t)(now->tv_sec - then->tv_sec) * USEC_PER_SEC + (now->tv_usec - then->tv_usec);
+}
+
+static uint32_t in_flight(const struct utcp_connection *c) {
+    return c->snd.nxt - c->snd.una;
+}
+
+// Reno, RFC 5681
+
+static void reno_init(struct utcp_connection *c) {
+    (void)c;
+}
+
+static void reno_on_ack(struct utcp_connection *c, uint32_t acked, uint32_t rtt, bool recovery, const struct timeval *now) {
+    (void)rtt;
+    (void)now;
+
+    // On retransmit keep cwnd low to leave the receiver time to catch up if busy.
+    if(recovery)
+        return;
+
+    uint32_t mtu = c->mtu;
+
+    if(c->snd.cwnd < c->snd.ssthresh) { // slow start
+        c->snd.cwnd += acked < mtu ? acked : mtu;
+    } else { // congestion avoidance
+        uint32_t increment = mtu * mtu / c->snd.cwnd;
+        c->snd.cwnd += increment ? increment : 1;
+    }
+}
+
+static void reno_reduce(struct utcp_connection *c) {
+    uint32_t mtu = c->mtu;
+
+    c->snd.ssthresh = c->snd.cwnd / 2;
+    if(c->snd.ssthresh < 2 * mtu)
+        c->snd.ssthresh = 2 * mtu;
+}
+
+static void reno_on_loss(struct utcp_connection *c) {
+    reno_reduce(c);
+    c->snd.cwnd = c->snd.ssthresh;
+}
+
+static void reno_on_undo(struct utcp_connection *c) {
+    (void)c;
+}
+
+static void reno_on_rto(struct utcp_connection *c) {
+    reno_reduce(c);
+    c->snd.cwnd = c->mtu;
+}
+
+static uint64_t no_pacing(const struct utcp_connection *c) {
+    (void)c;
+    return 0;
+}
+
+const struct cc_ops cc_reno = {
+    .name = "reno",
+    .init = reno_init,
+    .on_ack = reno_on_ack,
+    .on_loss = reno_on_loss,
+    .on_undo = reno_on_undo,
+    .on_rto = reno_on_rto,
+    .pacing_rate = no_pacing,
+};
+
+// CUBIC, RFC 8312
+// After a reduction cwnd grows back quickly to where the loss happened, carefully probes around it,
+// and then grows faster and faster, independent of the RTT.
+
+#define CUBIC_C 0.4 // segments per second cubed
+#define CUBIC_BETA 0.7 // multiplicative decrease factor
+
+static double cube_root(double x) {
+    if(x <= 0)
+        return 0;
+
+    // Newton's method, the starting point is always above the root
+    double r = x > 1 ? x : 1;
+
+    for(int i = 0; i < 100; i++) {
+        double next = (2 * r + x / (r * r)) / 3;
+        if(next >= r)
+            break;
+        r = next;
+    }
+
+    return r;
+}
+
+static void cubic_init(struct utcp_connection *c) {
+    memset(&c->ccs.cubic, 0, sizeof c->ccs.cubic);
+}
+
+static void cubic_on_ack(struct utcp_connection *c, uint32_t acked, uint32_t rtt, bool recovery, const struct timeval *now) {
+    (void)rtt;
+
+    if(recovery)
+        return;
+
+    struct cubic_state *s = &c->ccs.cubic;
+    uint32_t mtu = c->mtu;
+
+    if(c->snd.cwnd < c->snd.ssthresh) {
+        c->snd.cwnd += acked < mtu ? acked : mtu;
+        return;
+    }
+
+    if(!s->epoch_start.tv_sec) {
+        s->epoch_start = *now;
+        if(c->snd.cwnd < s->w_max) {
+            s->k = cube_root((s->w_max - c->snd.cwnd) / (double)mtu / CUBIC_C);
+            s->origin = s->w_max;
+        } else {
+            s->k = 0;
+            s->origin = c->snd.cwnd;
+        }
+        s->w_est = c->snd.cwnd;
+        s->frac = 0;
+    }
+
+    // Where the cubic function is one RTT from now
+    double cwnd = c->snd.cwnd;
+    double t = (usec_since(now, &s->epoch_start) + c->srtt) / (double)USEC_PER_SEC - s->k;
+    double target = s->origin + CUBIC_C * t * t * t * mtu;
+
+    if(target > 1.5 * cwnd)
+        target = 1.5 * cwnd;
+
+    if(target > cwnd)
+        s->frac += (target - cwnd) * acked / cwnd;
+    else
+        s->frac += 0.01 * mtu * acked / cwnd;
+
+    // Never grow slower than Reno would with the same average window
+    s->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * mtu * acked / cwnd;
+    if(s->w_est > cwnd + s->frac)
+        s->frac = s->w_est - cwnd;
+
+    uint32_t increment = s->frac;
+    s->frac -= increment;
+    c->snd.cwnd += increment;
+}
+
+static void cubic_reduce(struct utcp_connection *c) {
+    struct cubic_state *s = &c->ccs.cubic;
+    uint32_t mtu = c->mtu;
+
+    s->epoch_start.tv_sec = 0;
+    s->prior_w_max = s->w_max;
+
+    // Fast convergence: if cwnd is still below the previous maximum, leave some room for other flows
+    if(c->snd.cwnd < s->w_max)
+        s->w_max = c->snd.cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        s->w_max = c->snd.cwnd;
+
+    c->snd.ssthresh = c->snd.cwnd * CUBIC_BETA;
+    if(c->snd.ssthresh < 2 * mtu)
+        c->snd.ssthresh = 2 * mtu;
+}
+
+static void cubic_on_loss(struct utcp_connection *c) {
+    cubic_reduce(c);
+    c->snd.cwnd = c->snd.ssthresh;
+}
+
+static void cubic_on_undo(struct utcp_connection *c) {
+    // The next epoch starts from the restored cwnd
+    struct cubic_state *s = &c->ccs.cubic;
+    s->w_max = s->prior_w_max;
+    s->epoch_start.tv_sec = 0;
+}
+
+static void cubic_on_rto(struct utcp_connection *c) {
+    cubic_reduce(c);
+    c->snd.cwnd = c->mtu;
+}
+
+const struct cc_ops cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_undo = cubic_on_undo,
+    .on_rto = cubic_on_rto,
+    .pacing_rate = no_pacing,
+};
+
+// BBR-style delivery rate based congestion control
+// The bottleneck bandwidth is the maximum delivery rate seen in the last rounds,
+// and the propagation delay the minimum RTT seen in the last seconds.
+// cwnd is a multiple of their product. As in BBRv2, losing too much in a round sets an upper bound on the data
+// in flight, from what the path held then, which cwnd stays below except when probing for more bandwidth.
+// The bound grows again in rounds without loss, but never limits cwnd to less than the BDP.
+// There is no PROBE_RTT mode, the minimum RTT is replaced when it gets too old.
+
+#define BBR_HIGH_GAIN 289 // percent, 2/ln(2), doubles the delivery rate every round in startup
+#define BBR_DRAIN_GAIN 35 // percent, 1/BBR_HIGH_GAIN
+#define BBR_CWND_GAIN 200 // percent
+#define BBR_MIN_CWND 4 // segments
+#define BBR_MIN_RTT_WINDOW 10 // sec
+#define BBR_FULL_BW_ROUNDS 3 // rounds without 25% growth after which the pipe is full
+#define BBR_LOSS_THRESH 2 // percent of the data in flight that may be lost in a round without bounding it
+#define BBR_STARTUP_LOSSES 8 // segments that have to be lost in a round to end startup
+#define BBR_HEADROOM 85 // percent of inflight_hi to cruise at, leaving room in the queue
+
+static const uint32_t bbr_pacing_gains[] = {125, 75, 100, 100, 100, 100, 100, 100}; // percent
+
+static uint64_t bbr_bdp(const struct utcp_connection *c, uint32_t gain) {
+    return c->bandwidth * c->ccs.bbr.min_rtt / USEC_PER_SEC * gain / 100;
+}
+
+static void bbr_init(struct utcp_connection *c) {
+    memset(&c->ccs.bbr, 0, sizeof c->ccs.bbr);
+    c->ccs.bbr.mode = BBR_STARTUP;
+    c->tlast.tv_sec = 0;
+    c->bandwidth = 0;
+}
+
+// Called once per round with the delivery rate measured in it
+static void bbr_round(struct utcp_connection *c, uint64_t rate, bool app_limited) {
+    struct bbr_state *s = &c->ccs.bbr;
+
+    // A sample taken while there was not enough data to fill the pipe only says the bandwidth is at least this much
+    if(app_limited && rate < c->bandwidth)
+        rate = 0;
+
+    s->bw[s->round++ % BBR_BW_ROUNDS] = rate;
+
+    // Without loss, probe for a higher bound, with steps that double every round
+    if(s->loss_in_round) {
+        s->loss_in_round = false;
+    } else if(s->inflight_hi && !app_limited && in_flight(c) + c->mtu >= c->snd.cwnd) {
+        s->inflight_hi += s->probe_up;
+        if(s->probe_up < s->inflight_hi / 4)
+            s->probe_up *= 2;
+    }
+
+    c->bandwidth = 0;
+    for(int i = 0; i < BBR_BW_ROUNDS; i++)
+        if(s->bw[i] > c->bandwidth)
+            c->bandwidth = s->bw[i];
+
+    switch(s->mode) {
+    case BBR_STARTUP:
+        if(app_limited)
+            break;
+        if(c->bandwidth >= s->full_bw * 5 / 4) {
+            s->full_bw = c->bandwidth;
+            s->full_bw_count = 0;
+        } else if(++s->full_bw_count >= BBR_FULL_BW_ROUNDS) {
+            s->mode = BBR_DRAIN;
+        }
+        break;
+    case BBR_PROBE_BW:
+        s->cycle = (s->cycle + 1) % (sizeof bbr_pacing_gains / sizeof *bbr_pacing_gains);
+        break;
+    default:
+        break;
+    }
+}
+
+// Too much of what is in flight was lost in this round, more than the path holds was sent.
+// Cruise below what it held from now on, and leave startup, the pipe is full.
+// Random losses below BBR_LOSS_THRESH say nothing about the path. Telling how much was lost needs SACK:
+// the peer is missing what lies below the highest byte it has.
+static void bbr_check_loss(struct utcp_connection *c) {
+    struct bbr_state *s = &c->ccs.bbr;
+    uint32_t inflight = in_flight(c);
+    uint32_t lost = range_set_end(&c->scoreboard) - c->scoreboard.bytes;
+
+    if(s->loss_in_round || lost >= inflight || (uint64_t)lost * 100 <= (uint64_t)inflight * BBR_LOSS_THRESH)
+        return;
+    // A single segment, a few in a small window in startup, or a loss without a queue may well be random
+    if(lost < (s->mode == BBR_STARTUP ? BBR_STARTUP_LOSSES : 2) * c->mtu || inflight <= bbr_bdp(c, 100))
+        return;
+
+    s->loss_in_round = true;
+    s->prior_inflight_hi = s->inflight_hi;
+    uint64_t bound = inflight - lost;
+    if(bound < BBR_MIN_CWND * c->mtu)
+        bound = BBR_MIN_CWND * c->mtu;
+    if(!s->inflight_hi || bound < s->inflight_hi)
+        s->inflight_hi = bound;
+    s->probe_up = c->mtu;
+
+    if(s->mode == BBR_STARTUP)
+        s->mode = BBR_DRAIN;
+    if(c->snd.cwnd > s->inflight_hi)
+        c->snd.cwnd = s->inflight_hi;
+}
+
+static void bbr_on_ack(struct utcp_connection *c, uint32_t acked, uint32_t rtt, bool recovery, const struct timeval *now) {
+    (void)recovery;
+
+    struct bbr_state *s = &c->ccs.bbr;
+    uint32_t mtu = c->mtu;
+
+    if(rtt && (!s->min_rtt || rtt <= s->min_rtt || usec_since(now, &s->min_rtt_stamp) > BBR_MIN_RTT_WINDOW * USEC_PER_SEC)) {
+        s->min_rtt = rtt;
+        s->min_rtt_stamp = *now;
+    }
+
+    // Measure the delivery rate over intervals of about one round trip.
+    // SACKed data counts when it arrived, a cumulative ACK that fills a hole doesn't deliver it all at once.
+    if(!c->tlast.tv_sec) {
+        c->tlast = *now;
+        s->delivered = c->delivered;
+    } else {
+        uint32_t round = s->min_rtt ? s->min_rtt : c->srtt;
+        int64_t elapsed = usec_since(now, &c->tlast);
+
+        if(round && elapsed >= round) {
+            bbr_round(c, (c->delivered - s->delivered) * USEC_PER_SEC / elapsed, c->snd.nxt == c->snd.last);
+            c->tlast = *now;
+            s->delivered = c->delivered;
+        }
+    }
+
+    if(c->fast_recovery)
+        bbr_check_loss(c);
+
+    if(!c->bandwidth || !s->min_rtt) {
+        // No estimate yet, grow like slow start
+        c->snd.cwnd += acked;
+        return;
+    }
+
+    if(s->mode == BBR_DRAIN && in_flight(c) <= bbr_bdp(c, 100)) {
+        s->mode = BBR_PROBE_BW;
+        s->cycle = 2;
+    }
+
+    uint64_t target = bbr_bdp(c, s->mode == BBR_PROBE_BW ? BBR_CWND_GAIN : BBR_HIGH_GAIN);
+
+    // Only the phase that probes for more bandwidth may fill inflight_hi
+    if(s->inflight_hi) {
+        uint64_t bound = s->inflight_hi;
+        if(s->mode != BBR_PROBE_BW || bbr_pacing_gains[s->cycle] <= 100)
+            bound = bound * BBR_HEADROOM / 100;
+        uint64_t bdp = bbr_bdp(c, 100);
+        if(bound < bdp)
+            bound = bdp;
+        if(target > bound)
+            target = bound;
+    }
+
+    if(target < BBR_MIN_CWND * mtu)
+        target = BBR_MIN_CWND * mtu;
+
+    if(s->mode == BBR_STARTUP) {
+        if(c->snd.cwnd < target)
+            c->snd.cwnd += acked;
+    } else {
+        c->snd.cwnd = c->snd.cwnd + acked < target ? c->snd.cwnd + acked : target;
+    }
+
+    if(c->snd.cwnd < BBR_MIN_CWND * mtu)
+        c->snd.cwnd = BBR_MIN_CWND * mtu;
+}
+
+static void bbr_on_loss(struct utcp_connection *c) {
+    // The delivery rate already reflects the loss
+    bbr_check_loss(c);
+}
+
+static void bbr_on_undo(struct utcp_connection *c) {
+    struct bbr_state *s = &c->ccs.bbr;
+    s->inflight_hi = s->prior_inflight_hi;
+}
+
+static void bbr_on_rto(struct utcp_connection *c) {
+    // Start over from one segment, on_ack() quickly grows it back to the estimated BDP.
+    // Don't let the interval with the timeout count as a delivery rate sample.
+    bbr_check_loss(c);
+    c->snd.cwnd = c->mtu;
+    c->tlast.tv_sec = 0;
+}
+
+static uint64_t bbr_pacing_rate(const struct utcp_connection *c) {
+    const struct bbr_state *s = &c->ccs.bbr;
+    uint32_t gain;
+
+    switch(s->mode) {
+    case BBR_STARTUP:
+        gain = BBR_HIGH_GAIN;
+        break;
+    case BBR_DRAIN:
+        gain = BBR_DRAIN_GAIN;
+        break;
+    default:
+        gain = bbr_pacing_gains[s->cycle];
+        break;
+    }
+
+    return c->bandwidth * gain / 100;
+}
+
+const struct cc_ops cc_bbr = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .on_undo = bbr_on_undo,
+    .on_rto = bbr_on_rto,
+    .pacing_rate = bbr_pacing_rate,
+};
+
+static const struct cc_ops *const algorithms[] = {
+    &cc_reno,
+    &cc_cubic,
+    &cc_bbr,
+};
+
+const struct cc_ops *cc_find(const char *name) {
+    for(size_t i = 0; i < sizeof algorithms / sizeof *algorithms; i++)
+        if(!strcmp(algorithms[i]->name, name))
+            return algorithms[i];
+
+    return NULL;
+}
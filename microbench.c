@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utcp_priv.h"
+
+// Times the receive and send buffers, out-of-order reception and connection lookup.
+// Prints one line per benchmark: its name, the number of operations and the time per operation in ns,
+// separated by tabs, so results of different builds can be compared with standard tools.
+// Usage: microbench [substring of the benchmarks to run]
+
+#define MIN_TIME 200000000 // ns a benchmark has to run for
+#define SEGMENT 1300
+#define WINDOW 64 // segments that are received out of order at a time
+#define LISTEN_PORT 1
+
+static const char *filter;
+static uint64_t prng = 0x9e3779b97f4a7c15ULL;
+static char data[1 << 16];
+
+static uint64_t xorshift(void) {
+	prng ^= prng >> 12;
+	prng ^= prng << 25;
+	prng ^= prng >> 27;
+	return prng * 2685821657736338717ULL;
+}
+
+// Call fn with a growing number of iterations until it takes long enough, fn returns the number of operations done.
+static void run(const char *name, uint64_t (*fn)(uint64_t n)) {
+	if(filter && !strstr(name, filter))
+		return;
+
+	for(uint64_t n = 1;; n *= 2) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		uint64_t ops = fn(n);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		if(ns >= MIN_TIME || n >= 1U << 30) {
+			printf("%s\t%llu\t%.1f\n", name, (unsigned long long)ops, ns / ops);
+			fflush(stdout);
+			return;
+		}
+	}
+}
+
+// Buffers
+
+static uint64_t buffer_put_get(uint64_t n) {
+	struct buffer buf;
+	buffer_init(&buf, 0, 1 << 20);
+	for(uint64_t i = 0; i < n; i++) {
+		buffer_put_at(&buf, buf.used, data, SEGMENT);
+		if(buf.used >= 64 * SEGMENT)
+			buffer_get(&buf, NULL, 32 * SEGMENT);
+	}
+	buffer_exit(&buf);
+	return n;
+}
+
+// Every other put and get crosses the end of the ring
+static uint64_t buffer_put_get_wrap(uint64_t n) {
+	struct buffer buf;
+	buffer_init(&buf, 3 * SEGMENT / 2, 3 * SEGMENT / 2);
+	for(uint64_t i = 0; i < n; i++) {
+		buffer_put_at(&buf, 0, data, SEGMENT);
+		buffer_get(&buf, NULL, SEGMENT);
+	}
+	buffer_exit(&buf);
+	return n;
+}
+
+static uint64_t buffer_grow(uint64_t n) {
+	uint64_t ops = 0;
+	for(uint64_t i = 0; i < n; i++) {
+		struct buffer buf;
+		buffer_init(&buf, 0, 1 << 23);
+		while(buffer_put_at(&buf, buf.used, data, SEGMENT) > 0)
+			ops++;
+		buffer_exit(&buf);
+	}
+	return ops;
+}
+
+static uint64_t buffer_copy_random(uint64_t n) {
+	static char out[SEGMENT];
+	struct buffer buf;
+	buffer_init(&buf, 0, 1 << 20);
+	// start halfway so the data wraps around the end of the ring
+	buffer_put_at(&buf, 0, data, sizeof data);
+	buffer_get(&buf, NULL, sizeof data);
+	while(buffer_put_at(&buf, buf.used, data, sizeof data) > 0);
+	for(uint64_t i = 0; i < n; i++)
+		buffer_copy(&buf, out, xorshift() % (buf.used - SEGMENT), SEGMENT);
+	buffer_exit(&buf);
+	return n;
+}
+
+// Chunked buffers, as used for the send buffer
+
+static uint64_t chunk_buffer_put_get(uint64_t n) {
+	struct chunk_buffer buf;
+	chunk_buffer_init(&buf, 0, 1 << 20);
+	for(uint64_t i = 0; i < n; i++) {
+		chunk_buffer_put(&buf, data, SEGMENT);
+		if(buf.used >= 64 * SEGMENT)
+			chunk_buffer_get(&buf, NULL, 32 * SEGMENT);
+	}
+	chunk_buffer_exit(&buf);
+	return n;
+}
+
+// The data stays small, so emptied blocks are moved to the end of the ring all the time
+static uint64_t chunk_buffer_put_get_small(uint64_t n) {
+	struct chunk_buffer buf;
+	chunk_buffer_init(&buf, 0, 3 * SEGMENT / 2);
+	for(uint64_t i = 0; i < n; i++) {
+		chunk_buffer_put(&buf, data, SEGMENT);
+		chunk_buffer_get(&buf, NULL, SEGMENT);
+	}
+	chunk_buffer_exit(&buf);
+	return n;
+}
+
+static uint64_t chunk_buffer_grow(uint64_t n) {
+	uint64_t ops = 0;
+	for(uint64_t i = 0; i < n; i++) {
+		struct chunk_buffer buf;
+		chunk_buffer_init(&buf, 0, 1 << 23);
+		while(chunk_buffer_put(&buf, data, SEGMENT) > 0)
+			ops++;
+		chunk_buffer_exit(&buf);
+	}
+	return ops;
+}
+
+static uint64_t chunk_buffer_copy_random(uint64_t n) {
+	static char out[SEGMENT];
+	struct chunk_buffer buf;
+	chunk_buffer_init(&buf, 0, 1 << 20);
+	// start in the middle of a block that is not the first in the ring
+	chunk_buffer_put(&buf, data, sizeof data);
+	chunk_buffer_get(&buf, NULL, sizeof data - SEGMENT / 2);
+	while(chunk_buffer_put(&buf, data, sizeof data) > 0);
+	for(uint64_t i = 0; i < n; i++)
+		chunk_buffer_copy(&buf, out, xorshift() % (buf.used - SEGMENT), SEGMENT);
+	chunk_buffer_exit(&buf);
+	return n;
+}
+
+// Receiving, on connections opened by hand-made SYNs. Whatever the instance sends back is ignored,
+// except for the initial sequence number in the SYNACK.
+
+static struct utcp *server;
+static uint32_t last_iss;
+
+static ssize_t do_send(struct utcp *utcp, const void *pkt, size_t len) {
+	struct hdr hdr;
+	memcpy(&hdr, pkt, sizeof hdr);
+	if(hdr.ctl & SYN)
+		last_iss = hdr.seq;
+	return len;
+}
+
+static void do_recv(struct utcp_connection *c, const void *data, size_t len) {
+}
+
+static void do_accept(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv, NULL);
+	utcp_set_rcvbuf(c, 1 << 22);
+}
+
+static void receive(uint16_t src, uint16_t dst, uint32_t seq, uint32_t ack, uint16_t ctl, size_t len) {
+	static char pkt[sizeof(struct hdr) + SEGMENT];
+	struct hdr hdr = {
+		.src = src,
+		.dst = dst,
+		.seq = seq,
+		.ack = ack,
+		.wnd = 1 << 20,
+		.ctl = ctl,
+		.aux = ctl & SYN ? CAP_SACK : 0,
+	};
+	memcpy(pkt, &hdr, sizeof hdr);
+	utcp_recv(server, pkt, sizeof hdr + len);
+}
+
+// Open a connection from port src, returns the server's initial sequence number
+static uint32_t establish(uint16_t src, uint16_t dst) {
+	receive(src, dst, 0, 0, SYN, 0);
+	uint32_t iss = last_iss;
+	receive(src, dst, 1, iss + 1, ACK, 0);
+	return iss;
+}
+
+static struct utcp_connection *stream;
+static uint32_t stream_iss;
+static uint32_t stream_seq;
+
+static void stream_init(void) {
+	server = utcp_init(do_accept, NULL, do_send, NULL);
+	utcp_set_mtu(server, SEGMENT);
+	stream_iss = establish(1, LISTEN_PORT);
+	stream = server->connections[0];
+	stream_seq = 1;
+}
+
+static void stream_exit(void) {
+	if(stream->rcv.nxt != stream_seq) {
+		fprintf(stderr, "stream not received in full\n");
+		abort();
+	}
+	utcp_exit(server);
+}
+
+static void receive_segment(uint32_t i) {
+	receive(1, LISTEN_PORT, stream_seq + i * SEGMENT, stream_iss + 1, ACK, SEGMENT);
+}
+
+static uint64_t recv_in_order(uint64_t n) {
+	stream_init();
+	for(uint64_t i = 0; i < n; i++) {
+		receive_segment(0);
+		stream_seq += SEGMENT;
+	}
+	stream_exit();
+	return n;
+}
+
+static uint64_t recv_reverse(uint64_t n) {
+	stream_init();
+	for(uint64_t i = 0; i < n; i++) {
+		for(uint32_t j = WINDOW; j--; )
+			receive_segment(j);
+		stream_seq += WINDOW * SEGMENT;
+	}
+	stream_exit();
+	return n * WINDOW;
+}
+
+// Each window arrives in random order, which leaves many islands at a time, then again in order as duplicates
+static uint64_t recv_shuffle(uint64_t n) {
+	uint32_t order[WINDOW];
+	stream_init();
+	for(uint64_t i = 0; i < n; i++) {
+		for(uint32_t j = 0; j < WINDOW; j++)
+			order[j] = j;
+		for(uint32_t j = WINDOW - 1; j; j--) {
+			uint32_t k = xorshift() % (j + 1);
+			uint32_t tmp = order[j];
+			order[j] = order[k];
+			order[k] = tmp;
+		}
+		for(uint32_t j = 0; j < WINDOW; j++)
+			receive_segment(order[j]);
+		for(uint32_t j = 0; j < WINDOW; j++)
+			receive_segment(j);
+		stream_seq += WINDOW * SEGMENT;
+	}
+	stream_exit();
+	return n * WINDOW * 2;
+}
+
+static uint64_t recv_ack(uint64_t n) {
+	stream_init();
+	for(uint64_t i = 0; i < n; i++)
+		receive(1, LISTEN_PORT, stream_seq, stream_iss + 1, ACK, 0);
+	stream_exit();
+	return n;
+}
+
+// Many connections, from every source port to a range of destination ports
+
+static uint32_t nconnections;
+static uint32_t *isss;
+
+static void connections_init(uint32_t count) {
+	server = utcp_init(do_accept, NULL, do_send, NULL);
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t iss = establish(1 + i % UINT16_MAX, LISTEN_PORT + i / UINT16_MAX);
+		if(isss)
+			isss[i] = iss;
+	}
+	if(server->nconnections != count) {
+		fprintf(stderr, "only %d of %u connections established\n", server->nconnections, count);
+		abort();
+	}
+}
+
+static uint64_t accept_connections(uint64_t n) {
+	for(uint64_t i = 0; i < n; i++) {
+		connections_init(nconnections);
+		utcp_exit(server);
+	}
+	return n * nconnections;
+}
+
+// Packets for random connections, so the last connection that got a packet is no help
+static uint64_t lookup_connections(uint64_t n) {
+	for(uint64_t i = 0; i < n; i++) {
+		uint32_t j = xorshift() % nconnections;
+		receive(1 + j % UINT16_MAX, LISTEN_PORT + j / UINT16_MAX, 1, isss[j] + 1, ACK, 0);
+	}
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc > 2) {
+		fprintf(stderr, "Usage: %s [filter]\n", argv[0]);
+		return 1;
+	}
+	filter = argc > 1 ? argv[1] : NULL;
+
+#ifdef UTCP_DEBUG
+	fprintf(stderr, "Warning: built with UTCP_DEBUG, the results include writing the debug output\n");
+#endif
+
+	run("buffer/put_get", buffer_put_get);
+	run("buffer/put_get_wrap", buffer_put_get_wrap);
+	run("buffer/grow", buffer_grow);
+	run("buffer/copy", buffer_copy_random);
+	run("chunk_buffer/put_get", chunk_buffer_put_get);
+	run("chunk_buffer/put_get_small", chunk_buffer_put_get_small);
+	run("chunk_buffer/grow", chunk_buffer_grow);
+	run("chunk_buffer/copy", chunk_buffer_copy_random);
+	run("recv/in_order", recv_in_order);
+	run("recv/reverse", recv_reverse);
+	run("recv/shuffle", recv_shuffle);
+	run("recv/ack", recv_ack);
+
+	static const uint32_t counts[] = {1000, 10000, 100000};
+	for(size_t i = 0; i < sizeof counts / sizeof *counts; i++) {
+		char name[32];
+		nconnections = counts[i];
+		snprintf(name, sizeof name, "accept/%u", nconnections);
+		run(name, accept_connections);
+
+		snprintf(name, sizeof name, "lookup/%u", nconnections);
+		if(filter && !strstr(name, filter))
+			continue;
+		isss = malloc(nconnections * sizeof *isss);
+		if(!isss)
+			return 1;
+		connections_init(nconnections);
+		run(name, lookup_connections);
+		utcp_exit(server);
+		free(isss);
+		isss = NULL;
+	}
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <time.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <poll.h>
 
@@ -27,6 +28,8 @@ double reorder;
 long reorder_dist = 10;
 double dropin;
 double dropout;
+size_t pathmtu;
+size_t pull; // bytes to read each time around the main loop in pull mode
 long total_out;
 long total_in;
 
@@ -49,6 +52,9 @@ void debug(const char *format, ...) {
 #endif
 
 void do_recv(struct utcp_connection *c, const void *data, size_t len) {
+	// in pull mode, the main loop reads the data
+	if(!data && len)
+		return;
 	if(!data || !len) {
 		if(errno) {
 			debug("Error: %s\n", strerror(errno));
@@ -64,8 +70,27 @@ void do_recv(struct utcp_connection *c, const void *data, size_t len) {
 		abort();
 }
 
+void do_recv_iov(struct utcp_connection *c, const struct iovec *iov, size_t iovcnt) {
+	if(!iovcnt) {
+		do_recv(c, NULL, 0);
+		return;
+	}
+	for(size_t i = 0; i < iovcnt; i++)
+		do_recv(c, iov[i].iov_base, iov[i].iov_len);
+}
+
 void do_accept(struct utcp_connection *nc, uint16_t port) {
 	utcp_accept(nc, do_recv, NULL);
+	if(getenv("CONGESTION"))
+		utcp_set_congestion_control(nc, getenv("CONGESTION"));
+	utcp_set_pacing(nc, getenv("PACING"));
+	if(getenv("CORK"))
+		utcp_set_autocork(nc, atoi(getenv("CORK")));
+	if(getenv("DELACK"))
+		utcp_set_delayed_ack(nc, atoi(getenv("DELACK")), 40000);
+	if(getenv("IOV"))
+		utcp_set_recv_iov_cb(nc, do_recv_iov);
+	utcp_set_pull(nc, pull);
 	c = nc;
 	utcp_set_accept_cb(c->utcp, NULL, NULL);
 }
@@ -73,6 +98,10 @@ void do_accept(struct utcp_connection *nc, uint16_t port) {
 ssize_t do_send(struct utcp *utcp, const void *data, size_t len) {
 	int s = *(int *)utcp->priv;
 	outpktno++;
+	if(pathmtu && len > pathmtu) {
+		debug("Dropped outgoing packet larger than the path MTU\n");
+		return len;
+	}
 	if(outpktno >= dropfrom && outpktno < dropto) {
 		if(drand48() < dropout) {
 			debug("Dropped outgoing packet\n");
@@ -107,6 +136,15 @@ ssize_t do_send(struct utcp *utcp, const void *data, size_t len) {
 	return result;
 }
 
+ssize_t do_send_batch(struct utcp *utcp, const struct iovec *pkts, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		ssize_t result = do_send(utcp, pkts[i].iov_base, pkts[i].iov_len);
+		if(result <= 0)
+			return i ? (ssize_t)i : UTCP_WOULDBLOCK;
+	}
+	return n;
+}
+
 int main(int argc, char *argv[]) {
 	srand(time(NULL));
 	srand48(time(NULL));
@@ -116,6 +154,8 @@ int main(int argc, char *argv[]) {
 
 	bool server = argc == 2;
 	bool connected = false;
+	bool batch = getenv("BATCH");
+	bool reserve = getenv("RESERVE");
 
 	if(getenv("DROPIN")) dropin = atof(getenv("DROPIN"));
 	if(getenv("DROPOUT")) dropout = atof(getenv("DROPOUT"));
@@ -123,6 +163,15 @@ int main(int argc, char *argv[]) {
 	if(getenv("DROPTO")) dropto = atoi(getenv("DROPTO"));
 	if(getenv("REORDER")) reorder = atof(getenv("REORDER"));
 	if(getenv("REORDER_DIST")) reorder_dist = atoi(getenv("REORDER_DIST"));
+	if(getenv("PATHMTU")) pathmtu = atoi(getenv("PATHMTU"));
+	if(getenv("PULL")) pull = atoi(getenv("PULL"));
+
+	// send stdin with utcp_send_file() if it is a regular file
+	off_t file_size = -1;
+	uint64_t file_offset = 0;
+	struct stat st;
+	if(getenv("SENDFILE") && !fstat(0, &st) && S_ISREG(st.st_mode))
+		file_size = st.st_size;
 
 	if(dropto < dropfrom)
 		dropto = 1 << 30;
@@ -156,11 +205,32 @@ int main(int argc, char *argv[]) {
 	if(!u)
 		return 1;
 
+	if(batch)
+		utcp_set_send_batch_cb(u, do_send_batch);
+
 	utcp_set_mtu(u, 1300);
 	utcp_set_user_timeout(u, 10);
-
-	if(!server)
+	utcp_set_timestamps(u, getenv("TIMESTAMPS"));
+	utcp_set_fastopen(u, getenv("FASTOPEN"));
+	utcp_set_compact_header(u, getenv("COMPACT"));
+	if(getenv("MEMLIMIT"))
+		utcp_set_mem_limit(u, atoi(getenv("MEMLIMIT")));
+	if(getenv("PROBE"))
+		utcp_set_mtu_probing(u, atoi(getenv("PROBE")));
+
+	if(!server) {
 		c = utcp_connect(u, 1, do_recv, NULL);
+		if(getenv("CONGESTION"))
+			utcp_set_congestion_control(c, getenv("CONGESTION"));
+		utcp_set_pacing(c, getenv("PACING"));
+		if(getenv("CORK"))
+			utcp_set_autocork(c, atoi(getenv("CORK")));
+		if(getenv("DELACK"))
+			utcp_set_delayed_ack(c, atoi(getenv("DELACK")), 40000);
+		if(getenv("IOV"))
+			utcp_set_recv_iov_cb(c, do_recv_iov);
+		utcp_set_pull(c, pull);
+	}
 
 	struct pollfd fds[2] = {
 		{.fd = 0, .events = POLLIN | POLLERR | POLLHUP},
@@ -168,6 +238,8 @@ int main(int argc, char *argv[]) {
 	};
 
 	char buf[102400];
+	static char pkts[32][2048];
+	struct iovec iov[32];
 	struct timeval timeout = utcp_timeout(u);
 
 	while(!connected || utcp_is_active(u)) {
@@ -177,16 +249,46 @@ int main(int argc, char *argv[]) {
 
 		int timeout_ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000 + 1;
 
+		if(pull && c) {
+			// a slow consumer, come back soon if there is more
+			ssize_t len = utcp_read(c, buf, pull < sizeof buf ? pull : sizeof buf);
+			if(len > 0 && write(1, buf, len) != len)
+				abort();
+			if(len > 0)
+				timeout_ms = 1;
+		}
+
 		debug("polling, dir = %d, timeout = %d\n", dir, timeout_ms);
 		if((dir & DIR_READ) && max)
 			poll(fds, 2, timeout_ms);
 		else
 			poll(fds + 1, 1, timeout_ms);
 
-		if(fds[0].revents) {
+		if(fds[0].revents && file_size >= 0 && c) {
+			fds[0].revents = 0;
+			debug("stdin file at %llu\n", (unsigned long long)file_offset);
+			ssize_t sent = utcp_send_file(c, 0, file_offset, file_size - file_offset);
+			if(sent > 0)
+				file_offset += sent;
+			if(file_offset == (uint64_t)file_size) {
+				fds[0].fd = -1;
+				dir &= ~DIR_READ;
+				utcp_shutdown(c, SHUT_WR);
+			}
+		} else if(fds[0].revents) {
 			fds[0].revents = 0;
 			debug("stdin\n");
-			ssize_t len = read(0, buf, max);
+			ssize_t len;
+			bool reserved = false;
+			struct iovec siov[2];
+			ssize_t nsiov = reserve && c ? utcp_send_reserve(c, siov, max) : 0;
+			if(nsiov > 0) {
+				// read straight into the send buffer
+				len = readv(0, siov, nsiov);
+				reserved = true;
+			} else {
+				len = read(0, buf, max);
+			}
 			if(len <= 0) {
 				fds[0].fd = -1;
 				dir &= ~DIR_READ;
@@ -198,7 +300,7 @@ int main(int argc, char *argv[]) {
 					continue;
 			}
 			if(c) {
-				ssize_t sent = utcp_send(c, buf, len);
+				ssize_t sent = reserved ? utcp_send_commit(c, len) : utcp_send(c, buf, len);
 				if(sent != len)
 					debug("PANIEK: " PRINT_SSIZE_T " != " PRINT_SSIZE_T "\n", sent, len);
 			}
@@ -207,6 +309,28 @@ int main(int argc, char *argv[]) {
 		if(fds[1].revents) {
 			fds[1].revents = 0;
 			debug("netin\n");
+			if(batch && connected) {
+				// drain the socket and process it all at once
+				size_t n = 0;
+				while(n < 32) {
+					ssize_t len = recv(s, pkts[n], sizeof pkts[n], MSG_DONTWAIT);
+					if(len <= 0)
+						break;
+					inpktno++;
+					if(inpktno >= dropto || inpktno < dropfrom || drand48() >= dropin) {
+						total_in += len;
+						iov[n].iov_base = pkts[n];
+						iov[n].iov_len = len;
+						n++;
+					} else {
+						debug("Dropped incoming packet\n");
+					}
+				}
+				if(utcp_recv_batch(u, iov, n) != n)
+					debug("Error receiving UTCP packet: %s\n", strerror(errno));
+				timeout = utcp_timeout(u);
+				continue;
+			}
 			struct sockaddr_storage ss;
 			socklen_t sl = sizeof ss;
 			int len = recvfrom(s, buf, sizeof buf, MSG_DONTWAIT, (struct sockaddr *)&ss, &sl);
@@ -230,6 +354,22 @@ int main(int argc, char *argv[]) {
 		timeout = utcp_timeout(u);
 	};
 
+	if(getenv("STATS")) {
+		struct utcp_stats stats;
+		utcp_get_stats(u, &stats);
+		fprintf(stderr, "sent %llu bytes in %llu segments, %llu retransmits, %llu timeouts, %llu dupacks, received %llu bytes in %llu segments\n",
+		        (unsigned long long)stats.bytes_sent, (unsigned long long)stats.segments_sent, (unsigned long long)stats.retransmits,
+		        (unsigned long long)stats.timeouts, (unsigned long long)stats.dupacks,
+		        (unsigned long long)stats.bytes_received, (unsigned long long)stats.segments_received);
+	}
+
+	if(pull && c) {
+		ssize_t len;
+		while((len = utcp_read(c, buf, sizeof buf)) > 0)
+			if(write(1, buf, len) != len)
+				abort();
+	}
+
 	utcp_close(c);
 	utcp_exit(u);
 	free(reorder_data);
@@ -1,7 +1,10 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "utcp_priv.h"
+#include "utcp_group.h"
 #include "minunit.h"
 
 int tests_run = 0;
@@ -390,11 +393,1680 @@ static char *test_buffer_copy_wrap_huge_offset() {
 	mu_assert("data copied incorrect", data[12] == actual[2]);
 	mu_assert("data copied incorrect", data[13] == actual[3]);
 	mu_assert("data copied incorrect", data[14] == actual[4]);
-	mu_assert("data copied incorrect", data[15] == actual[5]);
+	// only the 5 remaining bytes are copied
+	mu_assert("data copied past the end", actual[5] == 0);
 	buffer_exit(&buf);
 	return 0;
 }
 
+static char *test_buffer_peek_wrap() {
+	struct buffer buf;
+	char data[15] = "123456789abcdef";
+	struct iovec iov[2];
+	buffer_init(&buf, 20, 20);
+	buffer_put_at(&buf, 15, data, 5);
+	buffer_get(&buf, NULL, 15);
+	buffer_put_at(&buf, 5, data + 5, 10);
+	size_t n = buffer_peek(&buf, iov, 3, 100);
+	mu_assert("buffer_peek should return two spans", n == 2);
+	mu_assert("first span wrong", iov[0].iov_len == 2 && !memcmp(iov[0].iov_base, "45", 2));
+	mu_assert("second span wrong", iov[1].iov_len == 10 && !memcmp(iov[1].iov_base, data + 5, 10));
+	mu_assert("buffer used changed", buf.used == 15);
+	n = buffer_peek(&buf, iov, 6, 4);
+	mu_assert("buffer_peek should return one span", n == 1);
+	mu_assert("span wrong", iov[0].iov_len == 4 && !memcmp(iov[0].iov_base, data + 6, 4));
+	mu_assert("buffer_peek past the end", buffer_peek(&buf, iov, 15, 1) == 0);
+	buffer_exit(&buf);
+	return 0;
+}
+
+static char *test_buffer_reserve_wrap() {
+	struct buffer buf;
+	struct iovec iov[2];
+	char actual[10];
+	buffer_init(&buf, 10, 10);
+	buffer_put(&buf, "12345678", 8);
+	buffer_get(&buf, NULL, 6);
+	ssize_t n = buffer_reserve(&buf, iov, 100);
+	mu_assert("buffer_reserve should return two spans", n == 2);
+	mu_assert("first span wrong", iov[0].iov_base == buf.data + 8 && iov[0].iov_len == 2);
+	mu_assert("second span wrong", iov[1].iov_base == buf.data && iov[1].iov_len == 6);
+	mu_assert("buffer used changed", buf.used == 2);
+	memcpy(iov[0].iov_base, "ab", 2);
+	memcpy(iov[1].iov_base, "cd", 2);
+	mu_assert("wrong amount committed", buffer_commit(&buf, 4) == 4);
+	mu_assert("buffer used wrong", buf.used == 6);
+	buffer_copy(&buf, actual, 0, 6);
+	mu_assert("data committed incorrect", !memcmp(actual, "78abcd", 6));
+	buffer_exit(&buf);
+	return 0;
+}
+
+static char *test_buffer_reserve_grow() {
+	struct buffer buf;
+	struct iovec iov[2];
+	buffer_init(&buf, 4, 20);
+	ssize_t n = buffer_reserve(&buf, iov, 12);
+	mu_assert("buffer_reserve should return one span", n == 1);
+	mu_assert("buffer not grown", buf.size >= 12 && iov[0].iov_len == 12);
+	buffer_commit(&buf, 12);
+	n = buffer_reserve(&buf, iov, 100);
+	mu_assert("reservation not limited to maxsize", n == 1 && iov[0].iov_len == 8);
+	buffer_commit(&buf, 8);
+	mu_assert("full buffer should not reserve", buffer_reserve(&buf, iov, 1) == 0);
+	buffer_exit(&buf);
+	return 0;
+}
+
+static char *test_chunk_buffer_put_get() {
+	struct chunk_buffer buf;
+	static char data[3 * CHUNK_SIZE], actual[3 * CHUNK_SIZE];
+	for(size_t i = 0; i < sizeof data; i++)
+		data[i] = i * 7;
+	chunk_buffer_init(&buf, 0, 2 * CHUNK_SIZE + 100);
+	mu_assert("buffer not empty", buf.nchunks == 0 && buf.used == 0);
+	mu_assert("put not limited to maxsize", chunk_buffer_put(&buf, data, sizeof data) == 2 * CHUNK_SIZE + 100);
+	mu_assert("wrong number of blocks", buf.nchunks == 3 && buf.size == 3 * CHUNK_SIZE);
+	// copies span block boundaries
+	mu_assert("copy failed", chunk_buffer_copy(&buf, actual, CHUNK_SIZE - 10, 20) == 20);
+	mu_assert("data copied incorrect", !memcmp(actual, data + CHUNK_SIZE - 10, 20));
+	mu_assert("get failed", chunk_buffer_get(&buf, actual, CHUNK_SIZE + 10) == CHUNK_SIZE + 10);
+	mu_assert("data get incorrect", !memcmp(actual, data, CHUNK_SIZE + 10));
+	// the emptied block is reused for new data instead of allocating another one
+	char **chunks = buf.chunks;
+	mu_assert("put failed", chunk_buffer_put(&buf, data, CHUNK_SIZE) == CHUNK_SIZE);
+	mu_assert("block not reused", buf.nchunks == 3 && buf.chunks == chunks);
+	mu_assert("get failed", chunk_buffer_get(&buf, actual, buf.used) == 2 * CHUNK_SIZE + 90);
+	mu_assert("data get incorrect", !memcmp(actual, data + CHUNK_SIZE + 10, CHUNK_SIZE + 90));
+	mu_assert("wrapped data get incorrect", !memcmp(actual + CHUNK_SIZE + 90, data, CHUNK_SIZE));
+	chunk_buffer_release(&buf);
+	mu_assert("blocks not freed", buf.nchunks == 0 && buf.size == 0);
+	chunk_buffer_exit(&buf);
+	return 0;
+}
+
+static char *test_chunk_buffer_reserve() {
+	struct chunk_buffer buf;
+	struct iovec iov[2];
+	chunk_buffer_init(&buf, CHUNK_SIZE, 4 * CHUNK_SIZE);
+	chunk_buffer_put(&buf, "data", 4);
+	ssize_t n = chunk_buffer_reserve(&buf, iov, 3 * CHUNK_SIZE);
+	mu_assert("reservation should span two blocks", n == 2);
+	mu_assert("reservation not limited to two blocks", iov[0].iov_len == CHUNK_SIZE - 4 && iov[1].iov_len == CHUNK_SIZE);
+	mu_assert("reservation not after the data", iov[0].iov_base == buf.chunks[0] + 4 && iov[1].iov_base == buf.chunks[1]);
+	mu_assert("commit failed", chunk_buffer_commit(&buf, 3 * CHUNK_SIZE) == 2 * CHUNK_SIZE - 4);
+	mu_assert("buffer used wrong", buf.used == 2 * CHUNK_SIZE);
+	chunk_buffer_exit(&buf);
+	return 0;
+}
+
+static char *test_range_set() {
+	struct mem_account mem = {0};
+	struct range_set set;
+	struct sack ranges[16];
+	range_set_init(&set, &mem);
+	// more islands than fit in the array
+	for(uint32_t i = 0; i < 8; i++)
+		mu_assert("range not added", range_set_add(&set, 10 * i, 2));
+	mu_assert("wrong number of ranges", set.count == 8);
+	mu_assert("ranges not moved to a tree", set.root && mem.used);
+	mu_assert("ranges not returned", range_set_get(&set, ranges, 16) == 8);
+	for(uint32_t i = 0; i < 8; i++)
+		mu_assert("ranges out of order", ranges[i].offset == 10 * i && ranges[i].len == 2);
+	// filling a gap merges the ranges on both sides, touching ones are merged too
+	range_set_add(&set, 2, 8);
+	range_set_add(&set, 22, 8);
+	mu_assert("ranges not merged", set.count == 6);
+	range_set_get(&set, ranges, 2);
+	mu_assert("wrong merged ranges", ranges[0].offset == 0 && ranges[0].len == 12 && ranges[1].offset == 20 && ranges[1].len == 12);
+	// consuming trims the first range and drops those before the new base
+	range_set_consume(&set, 5);
+	range_set_get(&set, ranges, 1);
+	mu_assert("first range not trimmed", ranges[0].offset == 0 && ranges[0].len == 7);
+	range_set_consume(&set, 55);
+	mu_assert("ranges not consumed", set.count == 2);
+	mu_assert("tree not turned back into an array", !set.root && !mem.used);
+	range_set_get(&set, ranges, 2);
+	mu_assert("wrong ranges after consuming", ranges[0].offset == 0 && ranges[0].len == 2 && ranges[1].offset == 10 && ranges[1].len == 2);
+	range_set_exit(&set);
+
+	// random operations, checked against a bitmap of the bytes the set should hold
+	static bool bytes[4096];
+	uint32_t prng = 1;
+	memset(bytes, 0, sizeof bytes);
+	range_set_init(&set, &mem);
+	for(int round = 0; round < 20000; round++) {
+		prng = prng * 1103515245 + 12345;
+		uint32_t r = prng >> 8;
+		if(r % 16) {
+			uint32_t offset = r / 16 % 2000;
+			uint32_t len = 1 + r / 32768 % 8;
+			range_set_add(&set, offset, len);
+			memset(bytes + offset, 1, len);
+		} else {
+			uint32_t len = r / 16 % 64;
+			range_set_consume(&set, len);
+			memmove(bytes, bytes + len, sizeof bytes - len);
+			memset(bytes + sizeof bytes - len, 0, len);
+		}
+		static struct sack all[MAX_OOO_RANGES];
+		size_t n = range_set_get(&set, all, MAX_OOO_RANGES);
+		mu_assert("wrong number of ranges returned", n == set.count);
+		uint32_t pos = 0;
+		for(size_t i = 0; i < n; i++) {
+			mu_assert("ranges overlap or touch", i == 0 ? all[i].offset >= pos : all[i].offset > pos);
+			for(; pos < all[i].offset; pos++)
+				mu_assert("byte missing from the set", !bytes[pos]);
+			for(; pos < all[i].offset + all[i].len; pos++)
+				mu_assert("byte in the set not added", bytes[pos]);
+		}
+		for(; pos < sizeof bytes; pos++)
+			mu_assert("byte missing from the set", !bytes[pos]);
+	}
+	range_set_exit(&set);
+	mu_assert("tree nodes not freed", mem.used == 0);
+	return 0;
+}
+
+static ssize_t do_send(struct utcp *utcp, const void *data, size_t len) {
+	return len;
+}
+
+static char *test_pkt_pool_reuse() {
+	struct utcp *utcp = utcp_init(NULL, NULL, do_send, NULL);
+	struct pkt_t *pkt = pkt_pool_get(utcp);
+	mu_assert("no packet allocated", pkt != NULL);
+	mu_assert("pool not empty", utcp->npool == 0);
+	pkt_pool_put(utcp, pkt);
+	mu_assert("packet not returned to the pool", utcp->npool == 1);
+	// the same buffer should be handed out again
+	mu_assert("packet not reused", pkt_pool_get(utcp) == pkt);
+	mu_assert("pool not empty after reuse", utcp->npool == 0);
+	pkt_pool_put(utcp, pkt);
+	utcp_exit(utcp);
+	return 0;
+}
+
+static char *test_pkt_pool_mtu() {
+	struct utcp *utcp = utcp_init(NULL, NULL, do_send, NULL);
+	struct pkt_t *small = pkt_pool_get(utcp);
+	struct pkt_t *pooled = pkt_pool_get(utcp);
+	pkt_pool_put(utcp, pooled);
+	mu_assert("packet not returned to the pool", utcp->npool == 1);
+	// growing the mtu drops buffers that are too small
+	utcp_set_mtu(utcp, utcp_get_mtu(utcp) * 2);
+	mu_assert("small buffer kept in the pool", utcp->npool == 0);
+	pkt_pool_put(utcp, small);
+	mu_assert("small buffer returned to the pool", utcp->npool == 0);
+	// shrinking it keeps them
+	struct pkt_t *large = pkt_pool_get(utcp);
+	utcp_set_mtu(utcp, utcp_get_mtu(utcp) / 2);
+	pkt_pool_put(utcp, large);
+	mu_assert("large buffer not returned to the pool", utcp->npool == 1);
+	utcp_exit(utcp);
+	return 0;
+}
+
+static ssize_t would_block = 0;
+
+static ssize_t do_send_blocking(struct utcp *utcp, const void *data, size_t len) {
+	return would_block ? UTCP_WOULDBLOCK : (ssize_t)len;
+}
+
+static char *test_pending_queue() {
+	struct utcp *utcp = utcp_init(NULL, NULL, do_send_blocking, NULL);
+	would_block = 1;
+	struct utcp_connection *c = utcp_connect(utcp, 1, NULL, NULL);
+	mu_assert("connection not allocated", c != NULL);
+	mu_assert("SYN not queued", c->pending_to_send.count == 1);
+	mu_assert("queue limit wrong", utcp_get_max_pending(c) == DEFAULT_MAX_PENDING);
+	utcp_set_max_pending(c, 0);
+	mu_assert("queue limit not set", utcp_get_max_pending(c) == 0);
+	// the queued SYN is sent once the socket no longer blocks
+	would_block = 0;
+	utcp_timeout(utcp);
+	mu_assert("queue not drained", c->pending_to_send.count == 0);
+	mu_assert("queue head not cleared", c->pending_to_send.head == NULL);
+	mu_assert("queue tail not cleared", c->pending_to_send.tail == NULL);
+	mu_assert("packet not returned to the pool", utcp->npool == 1);
+	utcp_exit(utcp);
+	return 0;
+}
+
+static struct utcp *peer_a;
+static struct utcp *peer_b;
+static int batches;
+static size_t batched_pkts;
+static size_t received;
+
+// packets in flight between peer_a and peer_b, delivered by pump()
+static struct wire_pkt {
+	struct utcp *to;
+	size_t len;
+	char data[1100];
+} wire[64];
+static int wire_count;
+static size_t path_mtu; // larger packets are silently dropped, if set
+
+static ssize_t do_send_peer(struct utcp *utcp, const void *data, size_t len) {
+	if(wire_count >= 64 || len > sizeof wire[0].data)
+		return UTCP_WOULDBLOCK;
+	if(path_mtu && len > path_mtu)
+		return len;
+	wire[wire_count].to = utcp == peer_a ? peer_b : peer_a;
+	wire[wire_count].len = len;
+	memcpy(wire[wire_count].data, data, len);
+	wire_count++;
+	return len;
+}
+
+static ssize_t do_send_batch(struct utcp *utcp, const struct iovec *pkts, size_t n) {
+	batches++;
+	batched_pkts += n;
+	for(size_t i = 0; i < n; i++)
+		do_send_peer(utcp, pkts[i].iov_base, pkts[i].iov_len);
+	return n;
+}
+
+static void pump() {
+	for(int i = 0; i < wire_count; i++)
+		utcp_recv(wire[i].to, wire[i].data, wire[i].len);
+	wire_count = 0;
+}
+
+// deliver only what is on the wire now, the packets sent in response stay on it
+static void pump_once() {
+	static struct wire_pkt flight[64];
+	int n = wire_count;
+	memcpy(flight, wire, n * sizeof *wire);
+	wire_count = 0;
+	for(int i = 0; i < n; i++)
+		utcp_recv(flight[i].to, flight[i].data, flight[i].len);
+}
+
+static void do_recv_count(struct utcp_connection *c, const void *data, size_t len) {
+	received += len;
+}
+
+static void do_accept(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv_count, NULL);
+}
+
+static char *test_send_batch() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	utcp_set_send_batch_cb(peer_b, do_send_batch);
+	// open the congestion window so all segments go out in one train
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	batches = 0;
+	batched_pkts = 0;
+	received = 0;
+	mu_assert("data not buffered", utcp_send(c, data, sizeof data) == sizeof data);
+	mu_assert("segments not sent in one batch", batches == 1);
+	mu_assert("wrong number of segments batched", batched_pkts == 5);
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_recv_batch() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	received = 0;
+	mu_assert("data not buffered", utcp_send(c, data, sizeof data) == sizeof data);
+	mu_assert("wrong number of segments sent", wire_count == 5);
+	// take the packets off the wire, the ACK is sent before the data is delivered
+	static char pkts[5][1100];
+	struct iovec iov[5];
+	for(int i = 0; i < 5; i++) {
+		memcpy(pkts[i], wire[i].data, wire[i].len);
+		iov[i].iov_base = pkts[i];
+		iov[i].iov_len = wire[i].len;
+	}
+	wire_count = 0;
+	mu_assert("not all packets processed", utcp_recv_batch(peer_a, iov, 5) == 5);
+	mu_assert("ACKs not coalesced", wire_count == 1);
+	mu_assert("data not received", received == sizeof data);
+	pump();
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_send_reserve() {
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	struct iovec iov[2];
+	mu_assert("reserve should work before connecting", utcp_send_reserve(c, iov, 10) == 1 && iov[0].iov_len == 10);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	received = 0;
+	ssize_t n = utcp_send_reserve(c, iov, 3000);
+	mu_assert("nothing reserved", n > 0);
+	mu_assert("wrong amount reserved", iov[0].iov_len + (n > 1 ? iov[1].iov_len : 0) == 3000);
+	memset(iov[0].iov_base, 'x', iov[0].iov_len);
+	mu_assert("commit more than reserved should fail", utcp_send_commit(c, 3001) == UTCP_ERROR);
+	mu_assert("commit failed", utcp_send_commit(c, 1000) == 1000);
+	mu_assert("commit should only work once", utcp_send_commit(c, 1000) == UTCP_ERROR);
+	pump();
+	mu_assert("data not received", received == 1000);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_connection_table() {
+	struct utcp *u = utcp_init(NULL, NULL, do_send, NULL);
+	static struct utcp_connection *conns[3000];
+	for(int i = 0; i < 3000; i++) {
+		conns[i] = utcp_connect(u, 1 + i % 3, NULL, NULL);
+		mu_assert("connect failed", conns[i]);
+		mu_assert("local port should have the high bit set", conns[i]->src & 0x8000);
+	}
+	mu_assert("wrong number of connections", u->nconnections == 3000);
+	for(int i = 0; i < 3000; i += 2)
+		utcp_abort(conns[i]);
+	utcp_timeout(u);
+	mu_assert("connections not reaped", u->nconnections == 1500);
+	for(int i = 0; i < 3000; i += 2)
+		conns[i] = utcp_connect(u, 1 + i % 3, NULL, NULL);
+	// every connection is where the dense array and the hash table say it is
+	int found = 0;
+	for(int i = 0; i < 3000; i++) {
+		mu_assert("dense array index wrong", u->connections[conns[i]->index] == conns[i]);
+		for(uint32_t j = 0; j < u->table_size; j++)
+			if(u->table[j] == conns[i])
+				found++;
+		for(int j = 0; j < i; j++)
+			mu_assert("duplicate port pair", conns[j]->src != conns[i]->src || conns[j]->dst != conns[i]->dst);
+	}
+	mu_assert("not all connections in the hash table", found == 3000);
+	utcp_exit(u);
+	return 0;
+}
+
+static char *test_timer_heap() {
+	struct utcp *u = utcp_init(NULL, NULL, do_send, NULL);
+	static struct utcp_connection *conns[100];
+	for(int i = 0; i < 100; i++)
+		conns[i] = utcp_connect(u, 1, NULL, NULL);
+	mu_assert("not all timers in the heap", u->ntimers == 100);
+	// every connection attempt has a connection timer, and nothing else needs to be done
+	mu_assert("idle connections on the ready list", u->nready == 0);
+	struct timeval next = utcp_timeout(u);
+	mu_assert("next timeout should be the connection timer", next.tv_sec >= 58 && next.tv_sec <= 60);
+	for(int i = 0; i < 100; i += 3)
+		utcp_abort(conns[i]);
+	mu_assert("aborted connections not ready to be reaped", u->nready == 34);
+	utcp_timeout(u);
+	mu_assert("connections not reaped", u->nconnections == 66 && u->nready == 0);
+	mu_assert("timers of reaped connections still in the heap", u->ntimers == 66);
+	for(uint32_t i = 1; i < u->ntimers; i++) {
+		struct utcp_connection *c = u->timers[i], *parent = u->timers[(i - 1) / 2];
+		mu_assert("heap position wrong", c->heap_pos == i + 1);
+		bool before = c->conn_timeout.tv_sec < parent->conn_timeout.tv_sec || (c->conn_timeout.tv_sec == parent->conn_timeout.tv_sec && c->conn_timeout.tv_usec < parent->conn_timeout.tv_usec);
+		mu_assert("heap out of order", !before);
+	}
+	utcp_exit(u);
+	return 0;
+}
+
+static char *test_rto_per_connection() {
+	char data[100] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c1 = utcp_connect(peer_b, 1, NULL, NULL);
+	struct utcp_connection *c2 = utcp_connect(peer_b, 2, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connections not established", c1->state == ESTABLISHED && c2->state == ESTABLISHED);
+	uint32_t rto1, rto2;
+	mu_assert("utcp_get_rtt failed", utcp_get_rtt(c2, NULL, NULL, &rto2));
+	utcp_send(c1, data, sizeof data);
+	// lose the data segment and let the retransmit timer expire
+	wire_count = 0;
+	mu_assert("only c1 should have a timer running", peer_b->ntimers == 1);
+	c1->rtrx_timeout.tv_sec = 1;
+	c1->rtrx_timeout.tv_usec = 0;
+	utcp_timeout(peer_b);
+	mu_assert("segment not retransmitted", wire_count == 1);
+	utcp_get_rtt(c1, NULL, NULL, &rto1);
+	mu_assert("c1 did not back off", rto1 == 2 * rto2 || rto1 == MAX_RTO);
+	uint32_t rto;
+	utcp_get_rtt(c2, NULL, NULL, &rto);
+	mu_assert("c2 should not back off", rto == rto2);
+	mu_assert("new connections should not back off", peer_b->rto == rto2);
+	wire_count = 0;
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_sack_retransmit() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	mu_assert("SACK not negotiated", c->caps & CAP_SACK);
+	mu_assert("SACK not negotiated by the listener", peer_a->connections[0]->caps & CAP_SACK);
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	received = 0;
+	utcp_send(c, data, sizeof data);
+	mu_assert("wrong number of segments sent", wire_count == 5);
+	// lose the second segment
+	uint32_t hole = ((struct pkt_t *)wire[1].data)->hdr.seq;
+	memmove(&wire[1], &wire[2], 3 * sizeof wire[0]);
+	wire_count = 4;
+	static char pkts[4][1100];
+	size_t lens[4];
+	for(int i = 0; i < 4; i++) {
+		memcpy(pkts[i], wire[i].data, wire[i].len);
+		lens[i] = wire[i].len;
+	}
+	wire_count = 0;
+	for(int i = 0; i < 4; i++)
+		utcp_recv(peer_a, pkts[i], lens[i]);
+	mu_assert("wrong number of ACKs", wire_count == 4);
+	struct pkt_t *last_ack = (struct pkt_t *)wire[3].data;
+	mu_assert("ACK without SACK option", last_ack->hdr.aux == 2 + 2 * sizeof(uint32_t));
+	// the duplicate ACKs trigger a fast retransmit of only the missing segment
+	int n = wire_count;
+	for(int i = 0; i < n; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	wire_count = 0;
+	for(int i = 0; i < n; i++)
+		utcp_recv(peer_b, pkts[i], lens[i]);
+	mu_assert("scoreboard not filled", c->scoreboard.count == 1);
+	mu_assert("not only the hole retransmitted", wire_count == 1);
+	struct pkt_t *rtx = (struct pkt_t *)wire[0].data;
+	mu_assert("wrong segment retransmitted", rtx->hdr.seq == hole && wire[0].len == sizeof rtx->hdr + utcp_get_mtu(peer_b));
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+// Several segments of a window are lost, more than one ACK can report, all of them are sent again within one RTT
+static char *test_sack_recovery() {
+	static char data[20 * 1100];
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	c->snd.cwnd = 30 * mtu;
+	received = 0;
+	utcp_send(c, data, 20 * mtu);
+	mu_assert("wrong number of segments sent", wire_count == 20);
+	mu_assert("no RTT measurement", c->rtt_start.tv_sec);
+	// lose every third segment, starting with the first, which leaves seven islands
+	static struct wire_pkt flight[20];
+	memcpy(flight, wire, sizeof flight);
+	wire_count = 0;
+	uint32_t holes[7];
+	int nholes = 0;
+	for(int i = 0; i < 20; i++) {
+		if(i % 3)
+			utcp_recv(peer_a, flight[i].data, flight[i].len);
+		else
+			holes[nholes++] = ((struct pkt_t *)flight[i].data)->hdr.seq;
+	}
+	mu_assert("data received before the first segment", received == 0);
+	// the duplicate ACKs for that one flight resend all holes, and only those
+	static struct wire_pkt acks[20];
+	int n = wire_count;
+	memcpy(acks, wire, n * sizeof *wire);
+	wire_count = 0;
+	for(int i = 0; i < n; i++)
+		utcp_recv(peer_b, acks[i].data, acks[i].len);
+	mu_assert("not in fast recovery", c->fast_recovery);
+	mu_assert("scoreboard does not hold all islands", c->scoreboard.count == 7);
+	mu_assert("RTT measured over a retransmission", !c->rtt_start.tv_sec);
+	mu_assert("not all holes retransmitted", wire_count == nholes);
+	for(int i = 0; i < nholes; i++)
+		mu_assert("wrong segment retransmitted", ((struct pkt_t *)wire[i].data)->hdr.seq == holes[i]);
+	pump();
+	pump();
+	mu_assert("data not received", received == 20 * mtu);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	mu_assert("still in fast recovery", !c->fast_recovery);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+// More segments arrive out of order than the SACK option can report, none of them may be dropped
+static char *test_reorder_islands() {
+	static char data[16 * 1100];
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	c->snd.cwnd = 20 * utcp_get_mtu(peer_b);
+	received = 0;
+	size_t len = 12 * utcp_get_mtu(peer_b);
+	utcp_send(c, data, len);
+	mu_assert("wrong number of segments sent", wire_count == 12);
+	static struct wire_pkt flight[12];
+	memcpy(flight, wire, sizeof flight);
+	wire_count = 0;
+	// every other segment first, which leaves six islands
+	for(int i = 1; i < 12; i += 2)
+		utcp_recv(peer_a, flight[i].data, flight[i].len);
+	struct utcp_connection *s = peer_a->connections[0];
+	mu_assert("out-of-order segments not all kept", s->sacks.count == 6);
+	mu_assert("data received before the first segment", received == 0);
+	for(int i = 0; i < 12; i += 2)
+		utcp_recv(peer_a, flight[i].data, flight[i].len);
+	mu_assert("data not received without retransmissions", received == len);
+	mu_assert("SACK entries left", s->sacks.count == 0);
+	pump();
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_congestion_control() {
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	wire_count = 0;
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	mu_assert("wrong default algorithm", !strcmp(utcp_get_congestion_control(c), "reno"));
+	mu_assert("unknown algorithm accepted", !utcp_set_congestion_control(c, "vegas"));
+	// Reno halves cwnd on loss
+	c->snd.cwnd = 100 * mtu;
+	c->cc->on_loss(c);
+	mu_assert("reno cwnd not halved", c->snd.cwnd == 50 * mtu);
+	// CUBIC backs off less, and grows back to the previous maximum in about 4 seconds
+	mu_assert("cubic not set", utcp_set_congestion_control(c, "cubic"));
+	mu_assert("cubic not selected", !strcmp(utcp_get_congestion_control(c), "cubic"));
+	c->snd.cwnd = 100 * mtu;
+	c->cc->on_loss(c);
+	mu_assert("cubic cwnd not reduced to 70%", c->snd.cwnd == 70 * mtu);
+	struct timeval now;
+	for(int ms = 0; ms <= 5000; ms += 10) {
+		now.tv_sec = 1000 + ms / 1000;
+		now.tv_usec = (ms % 1000) * 1000;
+		c->cc->on_ack(c, mtu, 0, false, &now);
+		if(ms == 2000)
+			mu_assert("cubic not concave before the previous maximum", c->snd.cwnd > 80 * mtu && c->snd.cwnd < 100 * mtu);
+	}
+	mu_assert("cubic did not return to the previous maximum", c->snd.cwnd > 95 * mtu && c->snd.cwnd < 102 * mtu);
+	// BBR measures 1000 bytes per ms with a 10 ms RTT, so the BDP is 10 kB
+	mu_assert("bbr not set", utcp_set_congestion_control(c, "bbr"));
+	c->snd.last = c->snd.nxt + 1000000;
+	for(int ms = 0; ms <= 300; ms++) {
+		now.tv_sec = 2000 + ms / 1000;
+		now.tv_usec = (ms % 1000) * 1000;
+		c->delivered += mtu;
+		c->cc->on_ack(c, mtu, ms ? 0 : 10000, false, &now);
+	}
+	mu_assert("wrong bandwidth estimate", c->bandwidth > 900000 && c->bandwidth < 1100000);
+	mu_assert("bbr did not leave startup", c->ccs.bbr.mode == BBR_PROBE_BW);
+	mu_assert("wrong bbr cwnd", c->snd.cwnd == 20000);
+	// losing a single segment of what is in flight may well be random
+	c->snd.nxt = c->snd.una + 20000;
+	range_set_add(&c->scoreboard, mtu, 20000 - mtu);
+	c->cc->on_loss(c);
+	mu_assert("bbr reduced cwnd on loss", c->snd.cwnd == 20000 && !c->ccs.bbr.inflight_hi);
+	c->snd.una += 20000;
+	range_set_consume(&c->scoreboard, 20000);
+	// losing several while more than the BDP is in flight bounds it to what the path held
+	c->snd.nxt = c->snd.una + 20000;
+	range_set_add(&c->scoreboard, 6000, 14000);
+	c->cc->on_loss(c);
+	mu_assert("bbr did not bound inflight", c->ccs.bbr.inflight_hi == 14000 && c->snd.cwnd == 14000);
+	// cruising stays below the bound, but not below the BDP
+	c->cc->on_ack(c, mtu, 0, false, &now);
+	mu_assert("bbr cwnd above the bound", c->snd.cwnd <= 14000 * 85 / 100 + mtu && c->snd.cwnd >= 10000);
+	c->cc->on_undo(c);
+	mu_assert("bbr bound not undone", !c->ccs.bbr.inflight_hi);
+	uint64_t rate = c->cc->pacing_rate(c);
+	mu_assert("wrong pacing rate", rate >= c->bandwidth * 3 / 4 && rate <= c->bandwidth * 5 / 4);
+	utcp_exit(peer_b);
+	wire_count = 0;
+	return 0;
+}
+
+static void busy_wait(long usec) {
+	struct timeval start, now;
+	gettimeofday(&start, NULL);
+	do
+		gettimeofday(&now, NULL);
+	while((now.tv_sec - start.tv_sec) * 1000000 + now.tv_usec - start.tv_usec < usec);
+}
+
+static char *test_pacing() {
+	char data[10000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	// 10 segments per 10 ms, twice as fast in slow start: 2 segments per ms
+	utcp_set_pacing(c, true);
+	mu_assert("pacing not enabled", utcp_get_pacing(c));
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	c->srtt = 10000;
+	wire_count = 0;
+	utcp_send(c, data, sizeof data);
+	mu_assert("burst not paced", wire_count == 2);
+	struct timeval timeout = utcp_timeout(peer_b);
+	mu_assert("pacing deadline not returned", !timeout.tv_sec && timeout.tv_usec <= 1000);
+	mu_assert("sent before the pacing deadline", wire_count == 2);
+	busy_wait(1100);
+	utcp_timeout(peer_b);
+	mu_assert("next burst not sent", wire_count == 4);
+	// turning pacing off sends the rest of cwnd right away
+	utcp_set_pacing(c, false);
+	utcp_timeout(peer_b);
+	mu_assert("rest of cwnd not sent", wire_count == 10);
+	wire_count = 0;
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_fast_recovery() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	// without SACK, duplicate ACKs inflate cwnd
+	c->caps = 0;
+	peer_a->connections[0]->caps = 0;
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	c->snd.cwnd = 10 * mtu;
+	received = 0;
+	utcp_send(c, data, sizeof data);
+	mu_assert("wrong number of segments sent", wire_count == 5);
+	uint32_t nxt = c->snd.nxt;
+	// lose the second segment
+	uint32_t hole = ((struct pkt_t *)wire[1].data)->hdr.seq;
+	memmove(&wire[1], &wire[2], 3 * sizeof wire[0]);
+	wire_count = 4;
+	static char pkts[4][1100];
+	size_t lens[4];
+	for(int i = 0; i < 4; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	wire_count = 0;
+	for(int i = 0; i < 4; i++)
+		utcp_recv(peer_a, pkts[i], lens[i]);
+	mu_assert("wrong number of ACKs", wire_count == 4);
+	for(int i = 0; i < 4; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	wire_count = 0;
+	for(int i = 0; i < 4; i++)
+		utcp_recv(peer_b, pkts[i], lens[i]);
+	// the third duplicate ACK resends only the missing segment, and sets cwnd to half plus three segments
+	mu_assert("not in fast recovery", c->fast_recovery);
+	mu_assert("not only the hole retransmitted", wire_count == 1 && ((struct pkt_t *)wire[0].data)->hdr.seq == hole);
+	mu_assert("snd.nxt went back", c->snd.nxt == nxt);
+	// the first segment was acknowledged in slow start, so cwnd was 11 segments
+	mu_assert("wrong cwnd in fast recovery", c->recover_cwnd == 11 * mtu / 2 && c->snd.cwnd == c->recover_cwnd + 3 * mtu);
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	mu_assert("fast recovery not finished", !c->fast_recovery);
+	mu_assert("cwnd not deflated", c->snd.cwnd == 11 * mtu / 2);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static struct timeval fake_now;
+
+static void do_clock(struct utcp *utcp, struct timeval *now) {
+	*now = fake_now;
+}
+
+// Send five segments and hold back the second, the others make the peer send duplicate ACKs
+static uint32_t send_reordered(struct utcp_connection *c, const char *data, size_t seglen, char *held, size_t *held_len) {
+	static char pkts[4][1100];
+	size_t lens[4];
+	wire_count = 0;
+	utcp_send(c, data, 5 * seglen);
+	uint32_t hole = ((struct pkt_t *)wire[1].data)->hdr.seq;
+	memcpy(held, wire[1].data, *held_len = wire[1].len);
+	memmove(&wire[1], &wire[2], 3 * sizeof wire[0]);
+	for(int i = 0; i < 4; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	wire_count = 0;
+	for(int i = 0; i < 4; i++)
+		utcp_recv(peer_a, pkts[i], lens[i]);
+	for(int i = 0; i < wire_count; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	int acks = wire_count;
+	wire_count = 0;
+	fake_now.tv_usec += 1000;
+	for(int i = 0; i < acks; i++)
+		utcp_recv(peer_b, pkts[i], lens[i]);
+	return hole;
+}
+
+static char *test_spurious_recovery() {
+	static char data[5000];
+	static char held[1100];
+	size_t held_len;
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	fake_now.tv_sec = 1000;
+	fake_now.tv_usec = 0;
+	utcp_set_clock_cb(peer_a, do_clock);
+	utcp_set_clock_cb(peer_b, do_clock);
+	utcp_set_timestamps(peer_a, true);
+	utcp_set_timestamps(peer_b, true);
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	// the timestamp option takes room from the payload
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	size_t seglen = mtu - TS_OPTION_LEN;
+	c->snd.cwnd = 10 * mtu;
+	// three duplicate ACKs start fast recovery
+	uint32_t hole = send_reordered(c, data, seglen, held, &held_len);
+	mu_assert("not in fast recovery", c->fast_recovery && wire_count == 1 && ((struct pkt_t *)wire[0].data)->hdr.seq == hole);
+	uint32_t cwnd = c->undo_cwnd;
+	mu_assert("cwnd not reduced", c->snd.cwnd < cwnd);
+	// the original arrives before the retransmission, the ACK for it echoes its older timestamp
+	wire_count = 0;
+	fake_now.tv_usec += 1000;
+	utcp_recv(peer_a, held, held_len);
+	pump();
+	mu_assert("data not received", received == 5 * seglen);
+	mu_assert("fast recovery not undone", !c->fast_recovery && c->snd.cwnd >= cwnd);
+	mu_assert("reordering not learned", c->reordering == 4);
+	// the same reordering no longer starts fast recovery
+	send_reordered(c, data, seglen, held, &held_len);
+	mu_assert("fast recovery for reordering", !c->fast_recovery && wire_count == 0);
+	utcp_recv(peer_a, held, held_len);
+	pump();
+	mu_assert("data not received", received == 10 * seglen);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_delayed_ack() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	struct utcp_connection *s = peer_a->connections[0];
+	mu_assert("zero delay accepted", !utcp_set_delayed_ack(s, 2, 0));
+	mu_assert("delayed ACK not set", utcp_set_delayed_ack(s, 2, 10000));
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	received = 0;
+	utcp_send(c, data, 4000);
+	mu_assert("wrong number of segments sent", wire_count == 4);
+	static char pkts[4][1100];
+	size_t lens[4];
+	for(int i = 0; i < 4; i++)
+		memcpy(pkts[i], wire[i].data, lens[i] = wire[i].len);
+	wire_count = 0;
+	for(int i = 0; i < 4; i++)
+		utcp_recv(peer_a, pkts[i], lens[i]);
+	mu_assert("not every second segment acknowledged", wire_count == 2);
+	pump();
+	// a single segment is acknowledged when the timer expires
+	utcp_send(c, data + 4000, 1000);
+	mu_assert("segment not sent", wire_count == 1);
+	memcpy(pkts[0], wire[0].data, lens[0] = wire[0].len);
+	wire_count = 0;
+	utcp_recv(peer_a, pkts[0], lens[0]);
+	mu_assert("ACK not delayed", wire_count == 0);
+	struct timeval timeout = utcp_timeout(peer_a);
+	mu_assert("delayed ACK deadline not returned", !timeout.tv_sec && timeout.tv_usec <= 10000);
+	busy_wait(11000);
+	utcp_timeout(peer_a);
+	mu_assert("delayed ACK not sent", wire_count == 1);
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_nagle() {
+	char data[10] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	received = 0;
+	wire_count = 0;
+	// the first small segment goes out right away, the next ones wait for its ACK
+	utcp_send(c, data, sizeof data);
+	utcp_send(c, data, sizeof data);
+	utcp_send(c, data, sizeof data);
+	mu_assert("small segments not held back", wire_count == 1);
+	static char ackpkt[100];
+	utcp_recv(peer_a, wire[0].data, wire[0].len);
+	mu_assert("small segment not acknowledged", wire_count == 2);
+	size_t acklen = wire[1].len;
+	memcpy(ackpkt, wire[1].data, acklen);
+	wire_count = 0;
+	utcp_recv(peer_b, ackpkt, acklen);
+	mu_assert("held back data not sent in one segment", wire_count == 1 && wire[0].len == sizeof(struct hdr) + 2 * sizeof data);
+	pump();
+	// without Nagle, every call sends a segment
+	utcp_set_nodelay(c, true);
+	utcp_send(c, data, sizeof data);
+	utcp_send(c, data, sizeof data);
+	mu_assert("nodelay held back data", wire_count == 2);
+	pump();
+	// autocork holds back small segments even when nothing is in flight
+	utcp_set_nodelay(c, false);
+	utcp_set_autocork(c, 2000);
+	mu_assert("autocork not set", utcp_get_autocork(c) == 2000);
+	utcp_send(c, data, sizeof data);
+	utcp_send(c, data, sizeof data);
+	mu_assert("autocork did not hold back data", wire_count == 0);
+	struct timeval timeout = utcp_timeout(peer_b);
+	mu_assert("cork deadline not returned", !timeout.tv_sec && timeout.tv_usec <= 2000);
+	busy_wait(2100);
+	utcp_timeout(peer_b);
+	mu_assert("corked data not sent in one segment", wire_count == 1 && wire[0].len == sizeof(struct hdr) + 2 * sizeof data);
+	pump();
+	mu_assert("data not received", received == 7 * sizeof data);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_autotune() {
+	char data[5000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	struct utcp_connection *s = peer_a->connections[0];
+	received = 0;
+	// the send buffer grows along with the congestion window
+	c->snd.cwnd = 100000;
+	utcp_send(c, data, 1000);
+	pump();
+	mu_assert("sndbuf not grown", utcp_get_sndbuf(c) == 2 * c->snd.cwnd);
+	utcp_set_sndbuf(c, 150000);
+	c->snd.cwnd = 100000;
+	utcp_send(c, data, 1000);
+	pump();
+	mu_assert("locked sndbuf changed", utcp_get_sndbuf(c) == 150000);
+	// the sender does not exceed the receive window, which grows when it is filled within a round trip
+	s->rcvbuf.maxsize = s->rcv.wnd = 4000;
+	s->rcv_rtt_time = s->rcv_space_time = (struct timeval){0};
+	utcp_send(c, data, 1000);
+	pump();
+	mu_assert("window not advertised", c->snd.wnd == 4000);
+	c->snd.cwnd = 10 * utcp_get_mtu(peer_b);
+	busy_wait(1000);
+	wire_count = 0;
+	utcp_send(c, data, 5000);
+	mu_assert("receive window exceeded", wire_count == 4);
+	pump();
+	mu_assert("rcvbuf not grown", utcp_get_rcvbuf(s) == 8000);
+	mu_assert("grown window not advertised", c->snd.wnd == 8000);
+	mu_assert("data not received", received == 8000);
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static size_t waiting; // bytes the last notification in pull mode reported
+
+static void do_recv_pull(struct utcp_connection *c, const void *data, size_t len) {
+	if(!data)
+		waiting = len;
+}
+
+static char *test_pull() {
+	static char data[6000];
+	static char buf[6000];
+	for(size_t i = 0; i < sizeof data; i++)
+		data[i] = i * 7;
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	struct utcp_connection *s = peer_a->connections[0];
+	mu_assert("read outside pull mode", utcp_read(s, buf, sizeof buf) == -1 && errno == EINVAL);
+	mu_assert("pull mode not set", utcp_set_pull(s, true) && utcp_get_pull(s));
+	mu_assert("read with nothing waiting", utcp_read(s, buf, sizeof buf) == -1 && errno == EAGAIN);
+	utcp_set_recv_cb(s, do_recv_pull);
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	utcp_set_rcvbuf(s, 4 * mtu);
+	// received data waits, and the window shrinks by it
+	utcp_send(c, data, mtu);
+	pump();
+	mu_assert("no notification", waiting == mtu);
+	mu_assert("window not shrunk", c->snd.wnd == 3 * mtu);
+	mu_assert("pull mode turned off with data waiting", !utcp_set_pull(s, false));
+	// the sender stops at the closed window, a segment sent to probe it is not taken
+	c->snd.cwnd = 10 * mtu;
+	utcp_send(c, data + mtu, sizeof data - mtu);
+	pump();
+	mu_assert("window not closed", c->snd.wnd == 0 && waiting == 4 * mtu);
+	mu_assert("data beyond the window taken", s->rcv_ready == 4 * mtu);
+	// no window update until a quarter of the buffer is free
+	mu_assert("wrong amount read", utcp_read(s, buf, mtu / 2) == mtu / 2);
+	mu_assert("window update sent too early", wire_count == 0);
+	mu_assert("wrong amount read", utcp_read(s, buf + mtu / 2, mtu) == mtu);
+	mu_assert("no window update", wire_count == 1);
+	pump();
+	mu_assert("window update not received", c->snd.wnd >= mtu);
+	size_t total = 3 * mtu / 2;
+	for(int i = 0; i < 20 && total < sizeof data; i++) {
+		ssize_t len = utcp_read(s, buf + total, sizeof buf - total);
+		if(len > 0)
+			total += len;
+		pump();
+		// the probe that was not taken is only sent again after a timeout
+		if(utcp_get_outq(c)) {
+			c->rtrx_timeout = (struct timeval){1, 0};
+			utcp_timeout(peer_b);
+			pump();
+		}
+	}
+	mu_assert("data not read", total == sizeof data && !memcmp(buf, data, sizeof data));
+	mu_assert("data not acknowledged", utcp_get_outq(c) == 0);
+	utcp_close(c);
+	pump();
+	mu_assert("end of stream not read", utcp_read(s, buf, sizeof buf) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char source[8000];
+static size_t source_read; // bytes read from the source, retransmissions included
+static char sunk[9000];
+static size_t sunk_len;
+static int sunk_error = -1;
+
+static ssize_t read_source(struct utcp_connection *c, void *data, size_t len, uint64_t offset) {
+	if(offset + len > sizeof source) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(data, source + offset, len);
+	source_read += len;
+	return len;
+}
+
+static void do_recv_sink(struct utcp_connection *c, const void *data, size_t len) {
+	if(!len) {
+		sunk_error = errno;
+		return;
+	}
+	if(sunk_len + len <= sizeof sunk)
+		memcpy(sunk + sunk_len, data, len);
+	sunk_len += len;
+}
+
+static void do_accept_sink(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv_sink, NULL);
+}
+
+static char *test_send_source() {
+	char prefix[100] = "prefix";
+	for(size_t i = 0; i < sizeof source; i++)
+		source[i] = i * 13;
+	peer_a = utcp_init(do_accept_sink, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, do_recv_sink, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	uint32_t mtu = utcp_get_mtu(peer_b);
+	c->snd.cwnd = 20 * mtu;
+	sunk_len = 0;
+	source_read = 0;
+	// the source follows the buffered data, and only that is held in the send buffer
+	mu_assert("prefix not buffered", utcp_buffer(c, prefix, sizeof prefix) == sizeof prefix);
+	mu_assert("source not added", utcp_send_source(c, read_source, 0, sizeof source) == sizeof source);
+	mu_assert("source held in the send buffer", c->sndbuf.used == sizeof prefix);
+	mu_assert("data added after the source", utcp_send(c, prefix, sizeof prefix) == UTCP_WOULDBLOCK && !utcp_get_sndbuf_free(c));
+	mu_assert("second source added", utcp_send_source(c, read_source, 0, sizeof source) == UTCP_WOULDBLOCK);
+	int n = wire_count;
+	mu_assert("wrong number of segments sent", n == 9);
+	mu_assert("source not read once", source_read == sizeof source);
+	// lose the second segment, its retransmission reads the source again
+	memmove(&wire[1], &wire[2], (n - 2) * sizeof wire[0]);
+	wire_count = n - 1;
+	for(int i = 0; i < 10 && utcp_get_outq(c); i++) {
+		pump();
+		if(!wire_count && utcp_get_outq(c)) {
+			c->rtrx_timeout = (struct timeval){1, 0};
+			utcp_timeout(peer_b);
+		}
+	}
+	mu_assert("data not received", sunk_len == sizeof prefix + sizeof source);
+	mu_assert("wrong data received", !memcmp(sunk, prefix, sizeof prefix) && !memcmp(sunk + sizeof prefix, source, sizeof source));
+	mu_assert("lost segment not read again", source_read == sizeof source + mtu);
+	// once acked, the source is released and data can follow it again
+	mu_assert("source not released", !c->read_at && utcp_get_sndbuf_free(c));
+	mu_assert("data not added after the source", utcp_send(c, prefix, sizeof prefix) == sizeof prefix);
+	pump();
+	pump();
+	mu_assert("data after the source not received", sunk_len == 2 * sizeof prefix + sizeof source);
+	// a source that cannot be read resets the connection
+	mu_assert("file not added", utcp_send_file(c, -1, 0, 1000) == 1000);
+	utcp_timeout(peer_b);
+	mu_assert("connection not closed", c->state == CLOSED && sunk_error == EBADF);
+	pump();
+	mu_assert("peer not reset", peer_a->connections[0]->state == CLOSED && sunk_error == ECONNRESET);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_mem_budget() {
+	char data[10000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	size_t used = utcp_get_mem_usage(peer_b);
+	mu_assert("memory not accounted", used >= DEFAULT_SNDBUFSIZE);
+	// a tight budget frees the empty send buffer, and limits what can be buffered
+	utcp_set_mem_limit(peer_b, used + 1000);
+	mu_assert("limit not set", utcp_get_mem_limit(peer_b) == used + 1000);
+	mu_assert("idle buffer not freed", utcp_get_mem_usage(peer_b) == used - DEFAULT_SNDBUFSIZE);
+	size_t avail = (utcp_get_mem_limit(peer_b) - utcp_get_mem_usage(peer_b)) / CHUNK_SIZE * CHUNK_SIZE;
+	mu_assert("free space not limited", utcp_get_sndbuf_free(c) == avail);
+	received = 0;
+	mu_assert("budget exceeded", utcp_send(c, data, sizeof data) == (ssize_t)avail);
+	pump();
+	mu_assert("data not received", received == avail);
+	mu_assert("memory not freed", utcp_get_mem_usage(peer_b) <= utcp_get_mem_limit(peer_b));
+	// the receiver shrinks its window to what it can still buffer
+	utcp_set_mem_limit(peer_a, utcp_get_mem_usage(peer_a) + 3000);
+	utcp_set_mem_limit(peer_b, 0);
+	utcp_send(c, data, 1000);
+	pump();
+	mu_assert("window not shrunk", c->snd.wnd <= 3000 && c->snd.wnd >= utcp_get_mtu(peer_a));
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_timestamps() {
+	char data[DEFAULT_MTU - TS_OPTION_LEN] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_timestamps(peer_a, true);
+	utcp_set_timestamps(peer_b, true);
+	mu_assert("timestamps not enabled", utcp_get_timestamps(peer_b));
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	mu_assert("timestamps not negotiated", (c->caps & CAP_TS) && (peer_a->connections[0]->caps & CAP_TS));
+	received = 0;
+	wire_count = 0;
+	utcp_send(c, data, sizeof data);
+	mu_assert("segment not sent", wire_count == 1);
+	static char old[1100];
+	size_t oldlen = wire[0].len;
+	memcpy(old, wire[0].data, oldlen);
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	// the retransmission of a lost segment still gives an RTT sample
+	utcp_send(c, data, sizeof data);
+	wire_count = 0;
+	c->srtt = 0;
+	c->rtrx_timeout.tv_sec = 1;
+	c->rtrx_timeout.tv_usec = 0;
+	utcp_timeout(peer_b);
+	mu_assert("segment not retransmitted", wire_count == 1);
+	busy_wait(2000);
+	pump();
+	mu_assert("retransmission not received", received == 2 * sizeof data);
+	mu_assert("no RTT sample from the retransmission", c->srtt >= 2000);
+	// an old packet whose sequence number wrapped around to the expected one is dropped
+	struct hdr hdr;
+	memcpy(&hdr, old, sizeof hdr);
+	hdr.seq = peer_a->connections[0]->rcv.nxt;
+	memcpy(old, &hdr, sizeof hdr);
+	utcp_recv(peer_a, old, oldlen);
+	pump();
+	mu_assert("old duplicate accepted", received == 2 * sizeof data);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static int sends_allowed;
+static int sent_from[2];
+
+// lets sends_allowed packets through, and counts them per connection
+static ssize_t do_send_counting(struct utcp *utcp, const void *data, size_t len) {
+	if(!sends_allowed)
+		return UTCP_WOULDBLOCK;
+	sends_allowed--;
+	struct hdr hdr;
+	memcpy(&hdr, data, sizeof hdr);
+	sent_from[hdr.dst - 1]++;
+	return len;
+}
+
+static char *test_priority() {
+	static char data[20000] = "data";
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	struct utcp_connection *c1 = utcp_connect(peer_b, 1, NULL, NULL);
+	struct utcp_connection *c2 = utcp_connect(peer_b, 2, NULL, NULL);
+	pump();
+	pump();
+	pump();
+	mu_assert("connections not established", c1->state == ESTABLISHED && c2->state == ESTABLISHED);
+	mu_assert("wrong default priority", utcp_get_priority(c1) == 1);
+	mu_assert("priority 0 accepted", !utcp_set_priority(c2, 0));
+	mu_assert("priority not set", utcp_set_priority(c2, 3) && utcp_get_priority(c2) == 3);
+	c1->snd.cwnd = c2->snd.cwnd = 20 * utcp_get_mtu(peer_b);
+	// both connections have data when the socket is full, once it drains they share it 1:3
+	peer_b->send = do_send_counting;
+	sends_allowed = 0;
+	utcp_send(c1, data, sizeof data);
+	utcp_send(c2, data, sizeof data);
+	sends_allowed = 8;
+	sent_from[0] = sent_from[1] = 0;
+	utcp_timeout(peer_b);
+	mu_assert("socket not filled", sends_allowed == 0);
+	mu_assert("bandwidth not shared by priority", sent_from[0] == 2 && sent_from[1] == 6);
+	peer_b->send = do_send_peer;
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char fastopen_in[100];
+static size_t fastopen_in_len;
+static int fastopen_eofs;
+
+static void do_recv_append(struct utcp_connection *c, const void *data, size_t len) {
+	if(!len) {
+		fastopen_eofs++;
+		return;
+	}
+	memcpy(fastopen_in + fastopen_in_len, data, len);
+	fastopen_in_len += len;
+}
+
+// answers as soon as the whole request is in
+static void do_recv_request(struct utcp_connection *c, const void *data, size_t len) {
+	do_recv_append(c, data, len);
+	if(!len) {
+		utcp_send(c, "response", 8);
+		utcp_close(c);
+	}
+}
+
+static void do_accept_request(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv_request, NULL);
+}
+
+static char *test_fastopen() {
+	peer_a = utcp_init(do_accept_request, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_fastopen(peer_a, true);
+	utcp_set_fastopen(peer_b, true);
+	wire_count = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, do_recv_append, NULL);
+	mu_assert("SYN sent before the data", wire_count == 0);
+	utcp_buffer(c, "request", 7);
+	utcp_shutdown(c, UTCP_SHUT_WR);
+	struct hdr hdr;
+	memcpy(&hdr, wire[0].data, sizeof hdr);
+	mu_assert("request not on the SYN", wire_count == 1 && hdr.ctl == (SYN | FIN) && wire[0].len == sizeof hdr + 7);
+	utcp_recv(peer_a, wire[0].data, wire[0].len);
+	mu_assert("request not delivered", fastopen_in_len == 7 && !memcmp(fastopen_in, "request", 7) && fastopen_eofs == 1);
+	memcpy(&hdr, wire[1].data, sizeof hdr);
+	mu_assert("response not on the SYNACK", wire_count == 2 && hdr.ctl == (SYN | ACK | FIN) && wire[1].len == sizeof hdr + 8);
+	fastopen_in_len = fastopen_eofs = 0;
+	utcp_recv(peer_b, wire[1].data, wire[1].len);
+	mu_assert("response not delivered after one round trip", fastopen_in_len == 8 && !memcmp(fastopen_in, "response", 8) && fastopen_eofs == 1);
+	mu_assert("client not closed", c->state == TIME_WAIT);
+	for(int i = 2; i < wire_count; i++)
+		utcp_recv(wire[i].to, wire[i].data, wire[i].len);
+	wire_count = 0;
+	struct utcp_connection *s = peer_a->connections[0];
+	mu_assert("response not acknowledged", s->snd.una == s->snd.last && !s->synack_unacked);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static void do_accept_pull(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv_pull, NULL);
+	utcp_set_pull(c, true);
+}
+
+static char *test_fastopen_pull() {
+	// the data on the SYN waits in the receive buffer like any other
+	peer_a = utcp_init(do_accept_pull, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_fastopen(peer_a, true);
+	utcp_set_fastopen(peer_b, true);
+	wire_count = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	utcp_buffer(c, "request", 7);
+	utcp_shutdown(c, UTCP_SHUT_WR);
+	pump();
+	struct utcp_connection *s = peer_a->connections[0];
+	mu_assert("request not buffered", s->rcv_ready == 7 && s->state == CLOSE_WAIT);
+	char buf[16];
+	mu_assert("request not read", utcp_read(s, buf, sizeof buf) == 7 && !memcmp(buf, "request", 7));
+	mu_assert("end of stream not read", utcp_read(s, buf, sizeof buf) == 0);
+	pump();
+	mu_assert("request not acknowledged", utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_fastopen_fallback() {
+	// the listening side ignores data on the SYN, it is sent again once the connection is established
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_fastopen(peer_b, true);
+	wire_count = 0;
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	mu_assert("data not accepted before connecting", utcp_send(c, "request", 7) == 7);
+	mu_assert("SYN not sent with the data", wire_count == 1 && wire[0].len == sizeof(struct hdr) + 7);
+	pump();
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	mu_assert("data not sent again", received == 7 && utcp_get_outq(c) == 0);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static bool is_compact(int i) {
+	return wire[i].len >= 2 && !wire[i].data[0] && !wire[i].data[1];
+}
+
+static char *test_compact_header() {
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_compact_header(peer_a, true);
+	utcp_set_compact_header(peer_b, true);
+	wire_count = 0;
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, do_recv_count, NULL);
+	mu_assert("SYN not sent with the full header", wire_count == 1 && !is_compact(0) && wire[0].len == sizeof(struct hdr));
+	utcp_recv(peer_a, wire[0].data, wire[0].len);
+	mu_assert("SYNACK not sent with the full header", wire_count == 2 && !is_compact(1));
+	utcp_recv(peer_b, wire[1].data, wire[1].len);
+	mu_assert("connection not established", c->state == ESTABLISHED && (c->caps & CAP_COMPACT));
+	mu_assert("ACK not compact", wire_count == 3 && is_compact(2));
+	utcp_recv(peer_a, wire[2].data, wire[2].len);
+	mu_assert("compact ACK not accepted", peer_a->connections[0]->state == ESTABLISHED);
+	wire_count = 0;
+
+	utcp_send(c, "hello", 5);
+	mu_assert("data not sent with a compact header", wire_count == 1 && is_compact(0) && wire[0].len < sizeof(struct hdr) + 5);
+	utcp_recv(peer_a, wire[0].data, wire[0].len);
+	mu_assert("data not received", received == 5);
+	mu_assert("pure ACK not compact", wire_count == 2 && is_compact(1) && wire[1].len <= 12);
+	utcp_recv(peer_b, wire[1].data, wire[1].len);
+	mu_assert("data not acknowledged", c->snd.una == c->snd.last);
+	wire_count = 0;
+
+	// a peer that lost the connection answers in kind, with a RST the client accepts
+	utcp_exit(peer_a);
+	peer_a = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_send(c, "again", 5);
+	utcp_recv(peer_a, wire[0].data, wire[0].len);
+	mu_assert("RST not compact", wire_count == 2 && is_compact(1));
+	utcp_recv(peer_b, wire[1].data, wire[1].len);
+	mu_assert("connection not reset", c->state == CLOSED);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_mtu_probing() {
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_mtu(peer_a, 300);
+	utcp_set_mtu(peer_b, 300);
+	utcp_set_mtu_probing(peer_b, 1000);
+	path_mtu = 724;
+	wire_count = 0;
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	mu_assert("connection does not start at the mtu", utcp_get_connection_mtu(c) == 300);
+	utcp_set_cwnd_max(c, 8000); // keep the wire from filling up
+
+	// probes that don't fit are sent again in smaller segments, the search ends just below the path mtu
+	static char data[300000];
+	size_t sent = 0;
+	for(int i = 0; i < 10000 && received < sizeof data; i++) {
+		ssize_t len = utcp_send(c, data + sent, sizeof data - sent);
+		if(len > 0)
+			sent += len;
+		pump_once();
+	}
+	mu_assert("data not received", received == sizeof data);
+	uint16_t mtu = utcp_get_connection_mtu(c);
+	mu_assert("mtu not raised", mtu + sizeof(struct hdr) <= path_mtu && mtu + sizeof(struct hdr) + PMTU_SEARCH_STEP > path_mtu);
+	mu_assert("lost probes taken as congestion", !c->fast_recovery && c->snd.ssthresh == 1 << 30);
+
+	// when large segments stop getting through, repeated timeouts fall back to the mtu
+	path_mtu = 400;
+	utcp_send(c, data, 10000);
+	wire_count = 0;
+	for(int i = 0; i < PMTU_BLACK_HOLE; i++) {
+		c->rtrx_timeout.tv_sec = 1;
+		c->rtrx_timeout.tv_usec = 0;
+		utcp_timeout(peer_b);
+	}
+	mu_assert("mtu not lowered", utcp_get_connection_mtu(c) == 300);
+	path_mtu = 0;
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static int traced[UTCP_TRACE_RTT + 1];
+static uint32_t traced_seq;
+
+static void do_trace(struct utcp *utcp, struct utcp_connection *c, const struct utcp_trace *trace) {
+	traced[trace->event]++;
+	if(trace->event == UTCP_TRACE_RETRANSMIT)
+		traced_seq = trace->seq;
+}
+
+static char *test_stats() {
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	utcp_set_compact_header(peer_a, true);
+	utcp_set_compact_header(peer_b, true);
+	utcp_set_trace_cb(peer_b, do_trace);
+	memset(traced, 0, sizeof traced);
+	wire_count = 0;
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+	mu_assert("state changes not traced", traced[UTCP_TRACE_STATE] == 2);
+
+	static char data[3000];
+	utcp_send(c, data, sizeof data);
+	pump();
+	mu_assert("data not received", received == sizeof data);
+	struct utcp_stats stats;
+	mu_assert("no connection stats", utcp_get_connection_stats(c, &stats));
+	mu_assert("bytes sent not counted", stats.bytes_sent == sizeof data && !stats.retransmits);
+	mu_assert("segments sent not counted", stats.segments_sent == traced[UTCP_TRACE_SEND] && stats.segments_sent >= 4);
+	mu_assert("segments received not counted", stats.segments_received == traced[UTCP_TRACE_RECV] && stats.segments_received >= 4);
+	mu_assert("state not filled in", stats.cwnd == c->snd.cwnd && stats.srtt == c->srtt && stats.sndbuf == c->sndbuf.maxsize);
+	mu_assert("no peer stats", utcp_get_connection_stats(peer_a->connections[0], &stats));
+	mu_assert("bytes received not counted", stats.bytes_received == sizeof data);
+
+	// a timeout sends the lost segment again, the trace gets the absolute sequence number despite the compact header
+	uint32_t seq = c->snd.nxt;
+	utcp_send(c, data, 100);
+	wire_count = 0;
+	c->rtrx_timeout.tv_sec = 1;
+	c->rtrx_timeout.tv_usec = 0;
+	utcp_timeout(peer_b);
+	mu_assert("timeout not traced", traced[UTCP_TRACE_TIMEOUT] == 1);
+	mu_assert("retransmission not traced", traced[UTCP_TRACE_RETRANSMIT] == 1 && traced_seq == seq);
+	pump();
+	mu_assert("data not received", received == sizeof data + 100);
+
+	// the instance adds up all connections, packets without one included
+	mu_assert("no instance stats", utcp_get_stats(peer_b, &stats));
+	mu_assert("instance counters wrong", stats.bytes_sent == sizeof data + 200 && stats.retransmits == 1 && stats.timeouts == 1);
+	mu_assert("instance state wrong", stats.connections == 1 && stats.cwnd == c->snd.cwnd && !stats.pending);
+	mu_assert("stats of NULL", !utcp_get_stats(NULL, &stats) && !utcp_get_connection_stats(NULL, &stats));
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+static char *test_clock() {
+	peer_a = utcp_init(do_accept, NULL, do_send_peer, NULL);
+	peer_b = utcp_init(NULL, NULL, do_send_peer, NULL);
+	fake_now.tv_sec = 1000;
+	fake_now.tv_usec = 0;
+	utcp_set_clock_cb(peer_a, do_clock);
+	utcp_set_clock_cb(peer_b, do_clock);
+	wire_count = 0;
+	received = 0;
+	struct utcp_connection *c = utcp_connect(peer_b, 1, NULL, NULL);
+	mu_assert("timer not set from the clock", c->conn_timeout.tv_sec == 1000 + utcp_get_user_timeout(peer_b));
+	pump();
+	mu_assert("connection not established", c->state == ESTABLISHED);
+
+	// a lost segment is sent again once the clock passes the retransmit timeout, not before
+	utcp_send(c, "lost", 4);
+	wire_count = 0;
+	struct timeval timeout = utcp_timeout(peer_b);
+	mu_assert("no retransmit timeout", timeout.tv_sec < 3600 && wire_count == 0);
+	fake_now.tv_sec += timeout.tv_sec;
+	fake_now.tv_usec += timeout.tv_usec + 1;
+	if(fake_now.tv_usec >= 1000000) {
+		fake_now.tv_usec -= 1000000;
+		fake_now.tv_sec++;
+	}
+	utcp_timeout(peer_b);
+	mu_assert("segment not sent again", wire_count == 1);
+	pump();
+	mu_assert("data not received", received == 4);
+	utcp_exit(peer_a);
+	utcp_exit(peer_b);
+	return 0;
+}
+
+#define PRODUCERS 4
+#define POSTS 20000
+
+static struct utcp_group_member *inbox_member;
+static uint32_t inbox_next[PRODUCERS];
+static uint32_t inbox_handled;
+static uint32_t inbox_misordered;
+static bool inbox_removed;
+
+static void count_call(struct utcp *utcp, void *arg) {
+	uintptr_t id = (uintptr_t)arg >> 24;
+	uint32_t seq = (uintptr_t)arg & 0xffffff;
+	if(seq != inbox_next[id]++)
+		inbox_misordered++;
+	inbox_handled++;
+}
+
+static void *post_calls(void *arg) {
+	uintptr_t id = (uintptr_t)arg;
+	for(uintptr_t seq = 0; seq < POSTS; seq++)
+		utcp_group_call(inbox_member, count_call, (void *)(id << 24 | seq));
+	return NULL;
+}
+
+static void set_removed(struct utcp *utcp, void *arg) {
+	__atomic_store_n(&inbox_removed, true, __ATOMIC_RELEASE);
+}
+
+static char *test_group_inbox() {
+	struct utcp_group *group = utcp_group_init(1);
+	mu_assert("group not created", group);
+	struct utcp *u = utcp_init(NULL, NULL, do_send, NULL);
+	inbox_member = utcp_group_add(group, u);
+	pthread_t producers[PRODUCERS];
+	for(uintptr_t i = 0; i < PRODUCERS; i++)
+		pthread_create(&producers[i], NULL, post_calls, (void *)i);
+	for(int i = 0; i < PRODUCERS; i++)
+		pthread_join(producers[i], NULL);
+	utcp_group_remove(inbox_member, set_removed, NULL);
+	for(int i = 0; i < 5000 && !__atomic_load_n(&inbox_removed, __ATOMIC_ACQUIRE); i++)
+		busy_wait(1000);
+	mu_assert("member not removed", inbox_removed);
+	utcp_group_exit(group);
+	mu_assert("calls lost", inbox_handled == PRODUCERS * POSTS);
+	mu_assert("calls from one thread reordered", !inbox_misordered);
+	utcp_exit(u);
+	return 0;
+}
+
+static bool late_posted;
+static uint32_t late_handled;
+
+// Keep the member from being freed until the main thread posted to it
+static void wait_late_posts(struct utcp *utcp, void *arg) {
+	for(int i = 0; i < 5000 && !__atomic_load_n(&late_posted, __ATOMIC_ACQUIRE); i++)
+		busy_wait(1000);
+	__atomic_store_n(&inbox_removed, true, __ATOMIC_RELEASE);
+}
+
+static void count_late(struct utcp *utcp, void *arg) {
+	late_handled++;
+}
+
+static char *test_group_remove() {
+	struct utcp_group *group = utcp_group_init(1);
+	struct utcp *u = utcp_init(NULL, NULL, do_send, NULL);
+	struct utcp_group_member *member = utcp_group_add(group, u);
+	inbox_removed = false;
+	utcp_group_remove(member, wait_late_posts, NULL);
+	// posts racing with the removal are dropped, and must not touch a freed member
+	utcp_group_call(member, count_late, NULL);
+	utcp_group_recv(member, "late", 4);
+	__atomic_store_n(&late_posted, true, __ATOMIC_RELEASE);
+	for(int i = 0; i < 5000 && !__atomic_load_n(&inbox_removed, __ATOMIC_ACQUIRE); i++)
+		busy_wait(1000);
+	mu_assert("member not removed", inbox_removed);
+	utcp_group_exit(group);
+	mu_assert("call to a removed member handled", !late_handled);
+	utcp_exit(u);
+	return 0;
+}
+
+static struct utcp_group_member *group_a;
+static struct utcp_group_member *group_b;
+static size_t group_sent;
+static size_t group_received;
+
+// packets go to the peer's shard, the peer is in the priv pointer
+static ssize_t do_send_group(struct utcp *utcp, const void *data, size_t len) {
+	struct utcp_group_member **peer = utcp->priv;
+	if(*peer)
+		utcp_group_recv(*peer, data, len);
+	return len;
+}
+
+static void do_recv_group(struct utcp_connection *c, const void *data, size_t len) {
+	__atomic_add_fetch(&group_received, len, __ATOMIC_RELEASE);
+}
+
+static void do_accept_group(struct utcp_connection *c, uint16_t port) {
+	utcp_accept(c, do_recv_group, NULL);
+}
+
+// the sender streams from its shard whenever the send buffer has room
+static int fill_sndbuf(struct utcp_connection *c, size_t len) {
+	static char data[50000] = "data";
+	if(len > sizeof data - group_sent)
+		len = sizeof data - group_sent;
+	if(len) {
+		ssize_t sent = utcp_send(c, data + group_sent, len);
+		if(sent > 0)
+			group_sent += sent;
+	}
+	return 0;
+}
+
+static void connect_and_send(struct utcp *utcp, void *arg) {
+	struct utcp_connection *c = utcp_connect(utcp, 1, NULL, NULL);
+	utcp_set_poll_cb(c, fill_sndbuf);
+}
+
+static char *test_group_transfer() {
+	struct utcp_group *group = utcp_group_init(2);
+	struct utcp *a = utcp_init(do_accept_group, NULL, do_send_group, &group_b);
+	struct utcp *b = utcp_init(NULL, NULL, do_send_group, &group_a);
+	group_a = utcp_group_add(group, a);
+	group_b = utcp_group_add(group, b);
+	mu_assert("instances not spread over shards", utcp_group_get_shard(group_a) != utcp_group_get_shard(group_b));
+	utcp_group_call(group_b, connect_and_send, NULL);
+	for(int i = 0; i < 5000 && __atomic_load_n(&group_received, __ATOMIC_ACQUIRE) < 50000; i++)
+		busy_wait(1000);
+	utcp_group_exit(group);
+	group_a = group_b = NULL;
+	mu_assert("data not sent", group_sent == 50000);
+	mu_assert("data not received across shards", group_received == 50000);
+	utcp_exit(a);
+	utcp_exit(b);
+	return 0;
+}
+
 static char *all_tests() {
 	mu_run_test(test_buffer_init);
 	mu_run_test(test_buffer_free);
@@ -413,6 +2085,46 @@ static char *all_tests() {
 	mu_run_test(test_buffer_copy_offset);
 	mu_run_test(test_buffer_get_wrap);
 	mu_run_test(test_buffer_copy_wrap_huge_offset);
+	mu_run_test(test_buffer_peek_wrap);
+	mu_run_test(test_buffer_reserve_wrap);
+	mu_run_test(test_buffer_reserve_grow);
+	mu_run_test(test_chunk_buffer_put_get);
+	mu_run_test(test_chunk_buffer_reserve);
+	mu_run_test(test_range_set);
+	mu_run_test(test_pkt_pool_reuse);
+	mu_run_test(test_pkt_pool_mtu);
+	mu_run_test(test_pending_queue);
+	mu_run_test(test_send_batch);
+	mu_run_test(test_recv_batch);
+	mu_run_test(test_send_reserve);
+	mu_run_test(test_connection_table);
+	mu_run_test(test_timer_heap);
+	mu_run_test(test_rto_per_connection);
+	mu_run_test(test_sack_retransmit);
+	mu_run_test(test_sack_recovery);
+	mu_run_test(test_reorder_islands);
+	mu_run_test(test_congestion_control);
+	mu_run_test(test_pacing);
+	mu_run_test(test_fast_recovery);
+	mu_run_test(test_spurious_recovery);
+	mu_run_test(test_delayed_ack);
+	mu_run_test(test_nagle);
+	mu_run_test(test_autotune);
+	mu_run_test(test_pull);
+	mu_run_test(test_send_source);
+	mu_run_test(test_mem_budget);
+	mu_run_test(test_timestamps);
+	mu_run_test(test_priority);
+	mu_run_test(test_fastopen);
+	mu_run_test(test_fastopen_pull);
+	mu_run_test(test_fastopen_fallback);
+	mu_run_test(test_compact_header);
+	mu_run_test(test_mtu_probing);
+	mu_run_test(test_stats);
+	mu_run_test(test_clock);
+	mu_run_test(test_group_inbox);
+	mu_run_test(test_group_remove);
+	mu_run_test(test_group_transfer);
 	return 0;
 }
 
@@ -29,7 +29,6 @@
 #include <sys/time.h>
 
 #include "utcp_priv.h"
-#include "list.h"
 
 #ifndef EBADMSG
 #define EBADMSG         104
@@ -66,6 +65,113 @@ static inline size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
+// Compact header encoding, see CAP_COMPACT
+
+enum hdr_format {
+    HDR_FULL,
+    HDR_COMPACT, // seq and ack are relative to the ISNs
+    HDR_COMPACT_NO_SEQ, // the same, and seq was left out
+};
+
+static uint8_t *put_varint(uint8_t *p, uint32_t value) {
+    while(value >= 0x80) {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for(int shift = 0; p < end && shift < 35; shift += 7) {
+        *value |= (uint32_t)(*p & 0x7f) << shift;
+        if(!(*p++ & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+// Write a compact header to buf, which must hold MAX_COMPACT_HDR bytes.
+// iss and irs are the ISNs of the sender and the receiver, replies to unknown connections pass 0 for both.
+// @return its length, or 0 if it would not be shorter than the full header
+static size_t write_compact_hdr(uint8_t *buf, const struct hdr *hdr, uint32_t iss, uint32_t irs, bool omit_seq) {
+    uint8_t ctl = hdr->ctl;
+    if(!omit_seq)
+        ctl |= C_SEQ;
+    if(hdr->trs || hdr->tra)
+        ctl |= C_TRS;
+    if(hdr->aux)
+        ctl |= C_AUX;
+
+    uint8_t *p = buf;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = ctl;
+    memcpy(p, &hdr->src, sizeof hdr->src);
+    p += sizeof hdr->src;
+    memcpy(p, &hdr->dst, sizeof hdr->dst);
+    p += sizeof hdr->dst;
+    if(ctl & C_SEQ)
+        p = put_varint(p, hdr->seq - iss);
+    if(ctl & ACK)
+        p = put_varint(p, hdr->ack - irs);
+    p = put_varint(p, hdr->wnd >> COMPACT_WND_SHIFT);
+    if(ctl & C_TRS) {
+        p = put_varint(p, hdr->trs);
+        p = put_varint(p, hdr->tra);
+    }
+    if(ctl & C_AUX)
+        p = put_varint(p, hdr->aux);
+
+    size_t len = p - buf;
+    return len < sizeof *hdr ? len : 0;
+}
+
+// Read the header of a packet in either format.
+// Compact headers leave seq and ack relative to the ISNs, for the caller to complete.
+// @return the length of the header, or 0 if it is malformed
+static size_t read_hdr(const void *data, size_t len, struct hdr *hdr, enum hdr_format *format) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+
+    if(len < 7 || p[0] || p[1]) {
+        if(len < sizeof *hdr)
+            return 0;
+        memcpy(hdr, data, sizeof *hdr);
+        *format = HDR_FULL;
+        return sizeof *hdr;
+    }
+
+    uint8_t ctl = p[2];
+    memset(hdr, 0, sizeof *hdr);
+    hdr->ctl = ctl & ~(C_SEQ | C_TRS | C_AUX);
+    memcpy(&hdr->src, p + 3, sizeof hdr->src);
+    memcpy(&hdr->dst, p + 5, sizeof hdr->dst);
+    p += 7;
+
+    uint32_t wnd, trs = 0, tra = 0, aux = 0;
+    if((ctl & C_SEQ) && !(p = get_varint(p, end, &hdr->seq)))
+        return 0;
+    if((ctl & ACK) && !(p = get_varint(p, end, &hdr->ack)))
+        return 0;
+    if(!(p = get_varint(p, end, &wnd)))
+        return 0;
+    if((ctl & C_TRS) && (!(p = get_varint(p, end, &trs)) || !(p = get_varint(p, end, &tra))))
+        return 0;
+    if((ctl & C_AUX) && !(p = get_varint(p, end, &aux)))
+        return 0;
+    if(trs > UINT16_MAX || tra > UINT16_MAX || aux > UINT16_MAX)
+        return 0;
+
+    hdr->wnd = wnd > UINT32_MAX >> COMPACT_WND_SHIFT ? UINT32_MAX : wnd << COMPACT_WND_SHIFT;
+    hdr->trs = trs;
+    hdr->tra = tra;
+    hdr->aux = aux;
+    *format = ctl & C_SEQ ? HDR_COMPACT : HDR_COMPACT_NO_SEQ;
+    return p - (const uint8_t *)data;
+}
+
 #ifdef UTCP_DEBUG
 #include <stdarg.h>
 
@@ -76,6 +182,7 @@ static void debug(const char *format, ...) {
     va_end(ap);
 }
 
+#ifdef UTCP_DEBUG_PACKETDATA
 // write data to hex string
 // @require assure available str buffer length >= 2 * data length
 static uint32_t binTohex(char *str, uint32_t strglen, const void *vdata, uint32_t datalen) {
@@ -99,17 +206,29 @@ static uint32_t binTohex(char *str, uint32_t strglen, const void *vdata, uint32_
     }
     return pos;
 }
+#endif // UTCP_DEBUG_PACKETDATA
 
 static void print_packet(struct utcp *utcp, const char *dir, const void *pkt, size_t len) {
     struct hdr hdr;
-    if(len < sizeof hdr) {
+    enum hdr_format format;
+    size_t hlen = read_hdr(pkt, len, &hdr, &format);
+    if(!hlen) {
         debug("%p %s: short packet (" PRINT_SIZE_T " bytes)\n", utcp, dir, len);
         return;
     }
 
-    memcpy(&hdr, pkt, sizeof hdr);
-    fprintf (stderr, "%p %s: len=" PRINT_SIZE_T ", src=%u dst=%u seq=%u ack=%u trs=%u tra=%u wnd=%u ctl=",
-        utcp, dir, len, hdr.src, hdr.dst, hdr.seq, hdr.ack, hdr.trs, hdr.tra, hdr.wnd);
+    if(format == HDR_FULL) {
+        debug("%p %s: len=" PRINT_SIZE_T ", src=%u dst=%u seq=%u ack=%u trs=%u tra=%u wnd=%u ctl=",
+            utcp, dir, len, hdr.src, hdr.dst, hdr.seq, hdr.ack, hdr.trs, hdr.tra, hdr.wnd);
+    } else {
+        // without the connection only the offsets from the ISNs are known
+        debug("%p %s: len=" PRINT_SIZE_T ", compact, src=%u dst=%u seq=", utcp, dir, len, hdr.src, hdr.dst);
+        if(format == HDR_COMPACT)
+            debug("+%u", hdr.seq);
+        else
+            debug("rcv.nxt");
+        debug(" ack=+%u trs=%u tra=%u wnd=%u ctl=", hdr.ack, hdr.trs, hdr.tra, hdr.wnd);
+    }
 
     if(hdr.ctl & SYN)
         debug("SYN");
@@ -123,22 +242,21 @@ static void print_packet(struct utcp *utcp, const char *dir, const void *pkt, si
         debug("RTR");
 
 #ifdef UTCP_DEBUG_PACKETDATA
-    if(len > sizeof hdr) {
-        uint32_t datalen = len - sizeof hdr;
-        const uint8_t *data = (const uint8_t*)pkt + sizeof hdr;
-        uint32_t strglen = (datalen << 1) + 7;
-        char *str = malloc(strglen + 1);
-        if(!str) {
-            debug("print_packet: out of memory");
-            return;
+    if(len > hlen) {
+        // convert a chunk at a time, instead of allocating a string for the whole packet
+        const uint8_t *data = (const uint8_t *)pkt + hlen;
+        size_t datalen = len - hlen;
+        char str[2 * 64 + 1];
+        debug(" data=");
+
+        while(datalen) {
+            uint32_t chunk = datalen < 64 ? datalen : 64;
+            binTohex(str, sizeof str - 1, data, chunk);
+            str[2 * chunk] = 0;
+            debug("%s", str);
+            data += chunk;
+            datalen -= chunk;
         }
-        memcpy(str, " data=", 6);
-
-        binTohex(str + 6, strglen - 7, data, datalen);
-        str[strglen-1] = 0;
-
-        debug(str);
-        free(str);
     }
 #endif // UTCP_DEBUG_PACKETDATA
 
@@ -149,45 +267,301 @@ static void print_packet(struct utcp *utcp, const char *dir, const void *pkt, si
 #define print_packet(...)
 #endif // UTCP_DEBUG
 
-static void free_pkt_entry(struct pkt_entry_t *entry) {
-    if(entry) {
-        if(entry->pkt)
-            free(entry->pkt);
-        free(entry);
+// Tracepoints and statistics
+
+#ifndef UTCP_NO_TRACE
+static void trace_packet(struct utcp *utcp, struct utcp_connection *c, enum utcp_trace_event event, const struct hdr *hdr, uint32_t len) {
+    struct utcp_trace trace = {
+        .event = event,
+        .seq = hdr->seq,
+        .ack = hdr->ack,
+        .wnd = hdr->wnd,
+        .len = len,
+        .ctl = hdr->ctl,
+    };
+    utcp->trace(utcp, c, &trace);
+}
+
+static void trace_event(struct utcp_connection *c, enum utcp_trace_event event, uint32_t value) {
+    if(!c->utcp->trace)
+        return;
+    struct utcp_trace trace = {
+        .event = event,
+        .value = value,
+        .state = strstate[c->state],
+    };
+    c->utcp->trace(c->utcp, c, &trace);
+}
+#else
+#define trace_event(...)
+#endif // UTCP_NO_TRACE
+
+// Count a packet that is handed to the datagram layer, c may be NULL. Retransmissions are segments sent again.
+// datalen is the payload in it, the header is only decoded again for a trace.
+static void packet_sent(struct utcp *utcp, struct utcp_connection *c, const void *pkt, size_t len, uint32_t datalen, bool retransmit) {
+    utcp->stats.segments_sent++;
+    utcp->stats.bytes_sent += datalen;
+    utcp->stats.retransmits += retransmit;
+    if(c) {
+        c->stats.segments_sent++;
+        c->stats.bytes_sent += datalen;
+        c->stats.retransmits += retransmit;
+    }
+
+#ifndef UTCP_NO_TRACE
+    if(utcp->trace) {
+        struct hdr hdr;
+        enum hdr_format format;
+        if(!read_hdr(pkt, len, &hdr, &format))
+            return;
+        // seq is only left out when it is snd.nxt
+        if(c && format != HDR_FULL) {
+            hdr.seq = format == HDR_COMPACT ? hdr.seq + c->snd.iss : c->snd.nxt;
+            hdr.ack += c->rcv.irs;
+        }
+        trace_packet(utcp, c, retransmit ? UTCP_TRACE_RETRANSMIT : UTCP_TRACE_SEND, &hdr, datalen);
+    }
+#else
+    (void)pkt;
+    (void)len;
+#endif
+}
+
+// Connections with a running timer are kept in a binary min-heap ordered by their earliest deadline,
+// so utcp_timeout() only has to look at the top to find the ones that expired.
+// heap_pos is the position of a connection in utcp->timers plus one, or zero if no timer is running.
+
+static const struct timeval *earliest_timer(const struct utcp_connection *c) {
+    const struct timeval *timers[] = {&c->conn_timeout, &c->rtrx_timeout, &c->pace_timeout, &c->delack_timeout, &c->cork_timeout};
+    const struct timeval *earliest = NULL;
+
+    for(size_t i = 0; i < sizeof timers / sizeof *timers; i++)
+        if(timerisset(timers[i]) && (!earliest || timercmp(timers[i], earliest, <)))
+            earliest = timers[i];
+
+    return earliest;
+}
+
+static bool timer_before(const struct utcp_connection *a, const struct utcp_connection *b) {
+    return timercmp(earliest_timer(a), earliest_timer(b), <);
+}
+
+static void heap_set(struct utcp *utcp, uint32_t i, struct utcp_connection *c) {
+    utcp->timers[i] = c;
+    c->heap_pos = i + 1;
+}
+
+static void heap_sift(struct utcp *utcp, uint32_t i) {
+    struct utcp_connection *c = utcp->timers[i];
+
+    while(i > 0 && timer_before(c, utcp->timers[(i - 1) / 2])) {
+        heap_set(utcp, i, utcp->timers[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    for(uint32_t child; (child = 2 * i + 1) < utcp->ntimers; i = child) {
+        if(child + 1 < utcp->ntimers && timer_before(utcp->timers[child + 1], utcp->timers[child]))
+            child++;
+        if(!timer_before(utcp->timers[child], c))
+            break;
+        heap_set(utcp, i, utcp->timers[child]);
+    }
+
+    heap_set(utcp, i, c);
+}
+
+static void heap_remove(struct utcp *utcp, struct utcp_connection *c) {
+    uint32_t i = c->heap_pos - 1;
+    c->heap_pos = 0;
+
+    struct utcp_connection *last = utcp->timers[--utcp->ntimers];
+    if(last != c) {
+        utcp->timers[i] = last;
+        heap_sift(utcp, i);
+    }
+}
+
+// Call whenever one of the timers in earliest_timer() changed.
+static void update_timer(struct utcp_connection *c) {
+    struct utcp *utcp = c->utcp;
+
+    if(!earliest_timer(c)) {
+        if(c->heap_pos)
+            heap_remove(utcp, c);
+        return;
+    }
+
+    if(!c->heap_pos) {
+        // there is always room, since the heap is allocated along with the connections array
+        utcp->timers[utcp->ntimers] = c;
+        c->heap_pos = ++utcp->ntimers;
     }
+
+    heap_sift(utcp, c->heap_pos - 1);
+}
+
+// Connections that have work to do besides waiting for a timer are kept on the ready list,
+// for example when they have packets queued or want to be polled for more data.
+
+static void mark_ready(struct utcp_connection *c) {
+    struct utcp *utcp = c->utcp;
+
+    if(c->ready)
+        return;
+
+    c->ready = true;
+    c->ready_next = NULL;
+    c->ready_prev = utcp->ready_tail;
+    if(utcp->ready_tail)
+        utcp->ready_tail->ready_next = c;
+    else
+        utcp->ready_head = c;
+    utcp->ready_tail = c;
+    utcp->nready++;
+}
+
+static void unmark_ready(struct utcp_connection *c) {
+    struct utcp *utcp = c->utcp;
+
+    if(!c->ready)
+        return;
+
+    if(c->ready_prev)
+        c->ready_prev->ready_next = c->ready_next;
+    else
+        utcp->ready_head = c->ready_next;
+    if(c->ready_next)
+        c->ready_next->ready_prev = c->ready_prev;
+    else
+        utcp->ready_tail = c->ready_prev;
+    c->ready = false;
+    utcp->nready--;
+}
+
+// put a connection back at the start of the ready list, so it is the first to be handled next time
+static void mark_ready_first(struct utcp_connection *c) {
+    struct utcp *utcp = c->utcp;
+
+    unmark_ready(c);
+    c->ready = true;
+    c->ready_prev = NULL;
+    c->ready_next = utcp->ready_head;
+    if(utcp->ready_head)
+        utcp->ready_head->ready_prev = c;
+    else
+        utcp->ready_tail = c;
+    utcp->ready_head = c;
+    utcp->nready++;
+}
+
+// The current time, from the clock callback if there is one
+static void get_time(const struct utcp *utcp, struct timeval *now) {
+    if(utcp->clock)
+        utcp->clock((struct utcp *)utcp, now);
+    else
+        gettimeofday(now, NULL);
 }
 
 static void start_connection_timer(struct utcp_connection *c) {
-    gettimeofday(&c->conn_timeout, NULL);
+    get_time(c->utcp, &c->conn_timeout);
     c->conn_timeout.tv_sec += c->utcp->timeout;
+    update_timer(c);
     debug("connection timeout set to %lu.%06lu\n", c->conn_timeout.tv_sec, c->conn_timeout.tv_usec);
 }
 
 static void stop_connection_timer(struct utcp_connection *c) {
     timerclear(&c->conn_timeout);
+    update_timer(c);
     debug("connection timeout cleared\n");
 }
 
 static void start_retransmit_timer_in(struct utcp_connection *c, uint32_t usec) {
-    gettimeofday(&c->rtrx_timeout, NULL);
+    get_time(c->utcp, &c->rtrx_timeout);
     c->rtrx_timeout.tv_usec += usec;
     while(c->rtrx_timeout.tv_usec >= USEC_PER_SEC) {
         c->rtrx_timeout.tv_usec -= USEC_PER_SEC;
         c->rtrx_timeout.tv_sec++;
     }
-    debug("retransmit timeout set to %lu.%06lu (%u)\n", c->rtrx_timeout.tv_sec, c->rtrx_timeout.tv_usec, c->utcp->rto);
+    update_timer(c);
+    debug("retransmit timeout set to %lu.%06lu (%u)\n", c->rtrx_timeout.tv_sec, c->rtrx_timeout.tv_usec, c->rto);
 }
 
 static void start_retransmit_timer(struct utcp_connection *c) {
-    start_retransmit_timer_in(c, c->utcp->rto + c->rtrx_tolerance);
+    start_retransmit_timer_in(c, c->rto + c->rtrx_tolerance);
+}
+
+static void start_pacing_timer(struct utcp_connection *c) {
+    c->pace_timeout = c->pace_next;
+    update_timer(c);
+    debug("pacing timeout set to %lu.%06lu\n", c->pace_timeout.tv_sec, c->pace_timeout.tv_usec);
+}
+
+static void stop_pacing_timer(struct utcp_connection *c) {
+    timerclear(&c->pace_timeout);
+    update_timer(c);
+}
+
+static void start_delack_timer(struct utcp_connection *c) {
+    get_time(c->utcp, &c->delack_timeout);
+    c->delack_timeout.tv_usec += c->ack_delay;
+    while(c->delack_timeout.tv_usec >= USEC_PER_SEC) {
+        c->delack_timeout.tv_usec -= USEC_PER_SEC;
+        c->delack_timeout.tv_sec++;
+    }
+    update_timer(c);
+}
+
+static void stop_delack_timer(struct utcp_connection *c) {
+    timerclear(&c->delack_timeout);
+    update_timer(c);
+}
+
+// Every packet we send acknowledges everything received so far
+static void ack_sent(struct utcp_connection *c) {
+    c->ts_last_ack = c->rcv.nxt;
+    c->delack_count = 0;
+    if(timerisset(&c->delack_timeout))
+        stop_delack_timer(c);
+}
+
+static void start_cork_timer(struct utcp_connection *c) {
+    get_time(c->utcp, &c->cork_timeout);
+    c->cork_timeout.tv_usec += c->cork_delay;
+    while(c->cork_timeout.tv_usec >= USEC_PER_SEC) {
+        c->cork_timeout.tv_usec -= USEC_PER_SEC;
+        c->cork_timeout.tv_sec++;
+    }
+    update_timer(c);
+}
+
+static void stop_cork_timer(struct utcp_connection *c) {
+    timerclear(&c->cork_timeout);
+    update_timer(c);
 }
 
 static void stop_retransmit_timer(struct utcp_connection *c) {
     timerclear(&c->rtrx_timeout);
+    update_timer(c);
     debug("retransmit timeout cleared\n");
 }
 
-// Update RTT variables. See RFC 6298.
+// Feed an RTT sample into a set of RTT variables. See RFC 6298.
+static void rtt_sample(uint32_t *srtt, uint32_t *rttvar, uint32_t *rto, uint32_t rtt) {
+    if(!*srtt) {
+        *srtt = rtt;
+        *rttvar = rtt / 2;
+        *rto = rtt + max(2 * rtt, CLOCK_GRANULARITY);
+    } else {
+        *rttvar = (*rttvar * 3 + abs(*srtt - rtt)) / 4;
+        *srtt = (*srtt * 7 + rtt) / 8;
+        *rto = *srtt + max(4 * *rttvar, CLOCK_GRANULARITY);
+    }
+
+    if(*rto > MAX_RTO)
+        *rto = MAX_RTO;
+}
+
+// Update RTT variables of the connection, and the estimate new connections start with.
 static void update_rtt(struct utcp_connection *c, uint32_t rtt) {
     if(!rtt) {
         debug("invalid rtt\n");
@@ -196,33 +570,31 @@ static void update_rtt(struct utcp_connection *c, uint32_t rtt) {
 
     struct utcp *utcp = c->utcp;
 
-    if(!utcp->srtt) {
-        utcp->srtt = rtt;
-        utcp->rttvar = rtt / 2;
-        utcp->rto = rtt + max(2 * rtt, CLOCK_GRANULARITY);
-    } else {
-        utcp->rttvar = (utcp->rttvar * 3 + abs(utcp->srtt - rtt)) / 4;
-        utcp->srtt = (utcp->srtt * 7 + rtt) / 8;
-        utcp->rto = utcp->srtt + max(4 * utcp->rttvar, CLOCK_GRANULARITY);
-    }
+    rtt_sample(&c->srtt, &c->rttvar, &c->rto, rtt);
+    rtt_sample(&utcp->srtt, &utcp->rttvar, &utcp->rto, rtt);
+    if(!c->rtt_min || rtt < c->rtt_min)
+        c->rtt_min = rtt;
 
-    if(utcp->rto > MAX_RTO)
-        utcp->rto = MAX_RTO;
-
-    debug("rtt %u srtt %u rttvar %u rto %u\n", rtt, utcp->srtt, utcp->rttvar, utcp->rto);
+    debug("rtt %u srtt %u rttvar %u rto %u\n", rtt, c->srtt, c->rttvar, c->rto);
+    trace_event(c, UTCP_TRACE_RTT, rtt);
 }
 
 static void set_state(struct utcp_connection *c, enum state state) {
     c->state = state;
     if(state == ESTABLISHED)
         stop_connection_timer(c);
+    // let utcp_timeout() reap it
+    if(state == CLOSED && c->reapable)
+        mark_ready(c);
     debug("%p new state: %s\n", c->utcp, strstate[state]);
+    trace_event(c, UTCP_TRACE_STATE, state);
 }
 
-static bool fin_wanted(struct utcp_connection *c, uint32_t seq) {
-    if(seq != c->snd.last)
-        return false;
+// Whether our FIN is at snd.last, a fast open connection can queue it before the SYNACK arrives.
+static bool fin_queued(const struct utcp_connection *c) {
     switch(c->state) {
+    case SYN_SENT:
+        return c->syn_fin;
     case FIN_WAIT_1:
     case CLOSING:
     case LAST_ACK:
@@ -232,6 +604,15 @@ static bool fin_wanted(struct utcp_connection *c, uint32_t seq) {
     }
 }
 
+static bool fin_wanted(struct utcp_connection *c, uint32_t seq) {
+    return seq == c->snd.last && fin_queued(c);
+}
+
+// Whether our SYN still takes up snd.una, before the first byte in the send buffer.
+static bool syn_unacked(const struct utcp_connection *c) {
+    return c->state == SYN_SENT || c->state == SYN_RECEIVED || c->synack_unacked;
+}
+
 static inline void list_connections(struct utcp *utcp) {
     debug("%p has %d connections:\n", utcp, utcp->nconnections);
     for(int i = 0; i < utcp->nconnections; i++)
@@ -242,11 +623,248 @@ static int32_t seqdiff(uint32_t a, uint32_t b) {
     return a - b;
 }
 
+// SACK functions
+
+// Length of the SACK option to send, 0 if there are no out-of-order ranges to report.
+static size_t sack_option_len(const struct utcp_connection *c) {
+    if(!(c->caps & CAP_SACK))
+        return 0;
+
+    size_t n = min(c->sacks.count, min(NSACKS, MAX_SACK_BLOCKS));
+    return n ? 2 + n * 2 * sizeof(uint32_t) : 0;
+}
+
+// The range with the most recently received data goes first, then the lowest ones, see RFC 2018.
+static void write_sack_option(const struct utcp_connection *c, char *opt, size_t len) {
+    struct sack sacks[MAX_SACK_BLOCKS];
+    struct sack lowest[MAX_SACK_BLOCKS];
+    size_t n = (len - 2) / (2 * sizeof(uint32_t));
+    size_t count = 0;
+
+    int32_t recent = seqdiff(c->rcv_recent, c->rcv.nxt);
+    if(recent > 0 && range_set_find(&c->sacks, recent, &sacks[0]) && sacks[0].offset <= (uint32_t)recent)
+        count = 1;
+
+    size_t nlowest = range_set_get(&c->sacks, lowest, n);
+    for(size_t i = 0; i < nlowest && count < n; i++)
+        if(!count || lowest[i].offset != sacks[0].offset)
+            sacks[count++] = lowest[i];
+
+    opt[0] = OPT_SACK;
+    opt[1] = len;
+    for(size_t i = 0, pos = 2; pos < len; i++, pos += 2 * sizeof(uint32_t)) {
+        memcpy(opt + pos, &sacks[i].offset, sizeof(uint32_t));
+        memcpy(opt + pos + sizeof(uint32_t), &sacks[i].len, sizeof(uint32_t));
+    }
+}
+
+// Timestamp functions
+
+// The timestamp clock counts microseconds, it wraps around every 71 minutes. 0 means no timestamp.
+static uint32_t timestamp(const struct timeval *tv) {
+    uint32_t ts = tv->tv_sec * USEC_PER_SEC + tv->tv_usec;
+    return ts ? ts : 1;
+}
+
+static size_t ts_option_len(const struct utcp_connection *c) {
+    return c->caps & CAP_TS ? TS_OPTION_LEN : 0;
+}
+
+static void write_ts_option(const struct utcp_connection *c, char *opt) {
+    struct timeval now;
+    get_time(c->utcp, &now);
+    uint32_t ts_val = timestamp(&now);
+    uint32_t ts_ecr = timerisset(&c->ts_recent_age) ? c->ts_recent : 0;
+
+    opt[0] = OPT_TS;
+    opt[1] = TS_OPTION_LEN;
+    memcpy(opt + 2, &ts_val, sizeof(uint32_t));
+    memcpy(opt + 2 + sizeof(uint32_t), &ts_ecr, sizeof(uint32_t));
+}
+
+// Protection against wrapped sequence numbers (PAWS), RFC 7323 section 5.
+// A packet with a timestamp older than the last one is an old duplicate, unless the connection was idle for so long
+// that the timestamps can no longer be compared.
+static bool paws_reject(const struct utcp_connection *c, const struct options *opts, const struct timeval *now) {
+    if(!opts->ts || !timerisset(&c->ts_recent_age) || seqdiff(opts->ts_val, c->ts_recent) >= 0)
+        return false;
+    return now->tv_sec - c->ts_recent_age.tv_sec < PAWS_IDLE;
+}
+
+// Parse the options in front of the data of an incoming packet. Unknown options are ignored.
+static bool parse_options(const char *opt, size_t len, struct options *opts) {
+    while(len) {
+        if(len < 2 || (uint8_t)opt[1] < 2 || (uint8_t)opt[1] > len)
+            return false;
+
+        size_t optlen = (uint8_t)opt[1];
+
+        switch(opt[0]) {
+        case OPT_SACK:
+            for(size_t pos = 2; pos + 2 * sizeof(uint32_t) <= optlen && opts->nsacks < MAX_SACK_BLOCKS; pos += 2 * sizeof(uint32_t)) {
+                memcpy(&opts->sacks[opts->nsacks].offset, opt + pos, sizeof(uint32_t));
+                memcpy(&opts->sacks[opts->nsacks].len, opt + pos + sizeof(uint32_t), sizeof(uint32_t));
+                opts->nsacks++;
+            }
+            break;
+        case OPT_TS:
+            if(optlen < TS_OPTION_LEN)
+                return false;
+            memcpy(&opts->ts_val, opt + 2, sizeof(uint32_t));
+            memcpy(&opts->ts_ecr, opt + 2 + sizeof(uint32_t), sizeof(uint32_t));
+            opts->ts = true;
+            break;
+        default:
+            break;
+        }
+
+        opt += optlen;
+        len -= optlen;
+    }
+
+    return true;
+}
+
+// Forget the ranges of the scoreboard that snd.una has passed.
+static void advance_scoreboard(struct utcp_connection *c) {
+    if(c->scoreboard.count)
+        range_set_consume(&c->scoreboard, seqdiff(c->snd.una, c->scoreboard.base));
+    c->scoreboard.base = c->snd.una;
+}
+
+// Add the SACK blocks of an ACK to the scoreboard. The peer reports the range it got data for last first,
+// so over a number of ACKs the scoreboard learns about all ranges, see RFC 2018.
+// Blocks are relative to the acknowledged sequence number, which must not be older than snd.una.
+static void update_scoreboard(struct utcp_connection *c, uint32_t ack, const struct options *opts) {
+    advance_scoreboard(c);
+    uint32_t sacked = c->scoreboard.bytes;
+
+    for(uint32_t i = 0; i < opts->nsacks; i++) {
+        uint32_t start = ack + opts->sacks[i].offset;
+        uint32_t end = start + opts->sacks[i].len;
+
+        // ignore blocks that are empty or out of range
+        if(!opts->sacks[i].len || seqdiff(start, c->snd.una) <= 0 || seqdiff(end, c->snd.last) > 0)
+            continue;
+
+        if(!range_set_add(&c->scoreboard, seqdiff(start, c->snd.una), opts->sacks[i].len))
+            debug("%p scoreboard full\n", c);
+    }
+
+    c->delivered += c->scoreboard.bytes - sacked;
+}
+
+// Skip over data the peer already has.
+static uint32_t skip_sacked(const struct utcp_connection *c, uint32_t seq) {
+    uint32_t offset = seqdiff(seq, c->scoreboard.base);
+    struct sack range;
+    if(range_set_find(&c->scoreboard, offset, &range) && range.offset <= offset)
+        seq += range.offset + range.len - offset;
+    return seq;
+}
+
+// Number of bytes from seq up to the next range the peer already has.
+static uint32_t unsacked_len(const struct utcp_connection *c, uint32_t seq) {
+    uint32_t offset = seqdiff(seq, c->scoreboard.base);
+    struct sack range;
+    if(!range_set_find(&c->scoreboard, offset, &range))
+        return UINT32_MAX;
+    if(range.offset <= offset && !range_set_find(&c->scoreboard, range.offset + range.len, &range))
+        return UINT32_MAX;
+    return range.offset - offset;
+}
+
+// Number of bytes between snd.una and snd.nxt the peer already has, they no longer count as in flight.
+static uint32_t sacked_in_flight(const struct utcp_connection *c) {
+    uint32_t sacked = c->scoreboard.bytes;
+    uint32_t inflight = seqdiff(c->snd.nxt, c->scoreboard.base);
+
+    // after a timeout snd.nxt can be behind ranges the peer has
+    struct sack range;
+    for(uint32_t offset = inflight; range_set_find(&c->scoreboard, offset, &range); offset = range.offset + range.len)
+        sacked -= range.offset + range.len - max(range.offset, inflight);
+
+    return sacked;
+}
+
+// The end of the highest range the peer reported to have, or snd.una if none.
+static uint32_t sacked_high(const struct utcp_connection *c) {
+    return c->scoreboard.base + range_set_end(&c->scoreboard);
+}
+
+// Bytes in flight during fast recovery with SACK, see RFC 6675.
+// Holes below the highest SACKed byte are taken as lost until they have been sent again.
+static int32_t recovery_pipe(const struct utcp_connection *c) {
+    int32_t pipe = seqdiff(c->snd.nxt, c->snd.una) - (int32_t)sacked_in_flight(c);
+    uint32_t high = sacked_high(c);
+    uint32_t seq = skip_sacked(c, seqdiff(c->rtx_next, c->snd.una) > 0 ? c->rtx_next : c->snd.una);
+
+    while(seqdiff(seq, high) < 0) {
+        uint32_t hole = min(unsacked_len(c, seq), seqdiff(high, seq));
+        pipe -= hole;
+        seq = skip_sacked(c, seq + hole);
+    }
+
+    return pipe;
+}
+
 // Buffer functions
 
+// Make sure the buffer has room for required bytes, keeping the data in order.
+static bool buffer_grow(struct buffer *buf, size_t required) {
+    if(required <= buf->size)
+        return true;
+
+    size_t newsize = buf->size;
+    if(!newsize) {
+        newsize = required;
+    } else {
+        do {
+            newsize *= 2;
+        } while(newsize < required);
+    }
+    if(newsize > buf->maxsize) {
+        newsize = buf->maxsize;
+    }
+    // stay within the memory budget, growing only as much as required if need be
+    struct mem_account *mem = buf->mem;
+    if(mem && mem->limit && mem->used + (newsize - buf->size) > mem->limit) {
+        newsize = required;
+        if(mem->used + (newsize - buf->size) > mem->limit) {
+            debug("Memory budget exceeded, %lu of %lu bytes used\n", (unsigned long)mem->used, (unsigned long)mem->limit);
+            return false;
+        }
+    }
+    char *newdata = realloc(buf->data, newsize);
+    if(!newdata)
+        return false;
+    buf->data = newdata;
+    if(mem)
+        mem->used += newsize - buf->size;
+    // if data wrapped around the ring, move the applicable parts to the end of the buffer
+    if(buf->start + buf->used > buf->size) {
+        size_t available = newsize - buf->size;
+        size_t wrapped = buf->used - (buf->size - buf->start);
+        size_t move_to_end = 0;
+        size_t realign_to_begin = 0;
+        if(wrapped > available) {
+            move_to_end = available;
+            realign_to_begin = wrapped - available;
+        } else {
+            move_to_end = wrapped;
+            realign_to_begin = 0;
+        }
+        memmove(buf->data + buf->size, buf->data, move_to_end);
+        memmove(buf->data, buf->data + move_to_end, realign_to_begin);
+    }
+    buf->size = newsize;
+    return true;
+}
+
 // Store data into the buffer
 ssize_t buffer_put_at(struct buffer *buf, size_t offset, const void *data, size_t len) {
-    if(buf->maxsize <= buf->used)
+    // a full buffer may still have holes to fill
+    if(offset >= buf->maxsize)
         return 0;
 
     debug("buffer_put_at start:%lu used:%lu offset:%lu len:%lu size: %lu max:%lu\n", (unsigned long)buf->start, (unsigned long)buf->used, (unsigned long)offset, (unsigned long)len, (unsigned long)buf->size, (unsigned long)buf->maxsize);
@@ -260,40 +878,8 @@ ssize_t buffer_put_at(struct buffer *buf, size_t offset, const void *data, size_
         required = buf->maxsize;
     }
 
-    if(required > buf->size) {
-        size_t newsize = buf->size;
-        if(!newsize) {
-            newsize = required;
-        } else {
-            do {
-                newsize *= 2;
-            } while(newsize < required);
-        }
-        if(newsize > buf->maxsize) {
-            newsize = buf->maxsize;
-        }
-        char *newdata = realloc(buf->data, newsize);
-        if(!newdata)
-            return -1;
-        buf->data = newdata;
-        // if data wrapped around the ring, move the applicable parts to the end of the buffer
-        if(buf->start + buf->used > buf->size) {
-            size_t available = newsize - buf->size;
-            size_t wrapped = buf->used - (buf->size - buf->start);
-            size_t move_to_end = 0;
-            size_t realign_to_begin = 0;
-            if(wrapped > available) {
-                move_to_end = available;
-                realign_to_begin = wrapped - available;
-            } else {
-                move_to_end = wrapped;
-                realign_to_begin = 0;
-            }
-            memmove(buf->data + buf->size, buf->data, move_to_end);
-            memmove(buf->data, buf->data + move_to_end, realign_to_begin);
-        }
-        buf->size = newsize;
-    }
+    if(!buffer_grow(buf, required))
+        return -1;
 
     size_t append = 0;
     size_t append_offset = 0;
@@ -373,6 +959,64 @@ ssize_t buffer_copy(struct buffer *buf, void *data, size_t offset, size_t len) {
     return len;
 }
 
+// Get pointers to data in the buffer without copying it.
+// Returns the number of contiguous spans, at most two when the data wraps around the ring.
+size_t buffer_peek(const struct buffer *buf, struct iovec *iov, size_t offset, size_t len) {
+    if(offset >= buf->used || !len)
+        return 0;
+    if(offset + len > buf->used)
+        len = buf->used - offset;
+
+    size_t pos = buf->start + offset;
+    if(pos >= buf->size)
+        pos -= buf->size;
+
+    size_t first = min(len, buf->size - pos);
+    iov[0].iov_base = buf->data + pos;
+    iov[0].iov_len = first;
+    if(first == len)
+        return 1;
+
+    iov[1].iov_base = buf->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// Get pointers to free space after the data in the buffer, growing it if necessary.
+// Returns the number of spans, or -1 if the buffer could not be grown.
+ssize_t buffer_reserve(struct buffer *buf, struct iovec *iov, size_t len) {
+    if(buf->maxsize <= buf->used)
+        return 0;
+    if(len > buf->maxsize - buf->used)
+        len = buf->maxsize - buf->used;
+    if(!len)
+        return 0;
+    if(!buffer_grow(buf, buf->used + len))
+        return -1;
+
+    size_t pos = buf->start + buf->used;
+    if(pos >= buf->size)
+        pos -= buf->size;
+
+    size_t first = min(len, buf->size - pos);
+    iov[0].iov_base = buf->data + pos;
+    iov[0].iov_len = first;
+    if(first == len)
+        return 1;
+
+    iov[1].iov_base = buf->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// Add data written into space returned by buffer_reserve() to the buffer.
+size_t buffer_commit(struct buffer *buf, size_t len) {
+    if(len > buf->size - buf->used)
+        len = buf->size - buf->used;
+    buf->used += len;
+    return len;
+}
+
 bool buffer_init(struct buffer *buf, uint32_t len, uint32_t maxlen) {
     memset(buf, 0, sizeof *buf);
     if(len) {
@@ -388,56 +1032,789 @@ bool buffer_init(struct buffer *buf, uint32_t len, uint32_t maxlen) {
 }
 
 void buffer_exit(struct buffer *buf) {
+    if(buf->mem)
+        buf->mem->used -= buf->size;
     free(buf->data);
     memset(buf, 0, sizeof *buf);
 }
 
+// Charge the buffer's allocation, and all later changes to it, to mem.
+void buffer_account(struct buffer *buf, struct mem_account *mem) {
+    buf->mem = mem;
+    mem->used += buf->size;
+}
+
+// Free the memory of an empty buffer, it is allocated again when data is put into it.
+void buffer_release(struct buffer *buf) {
+    if(buf->used || !buf->size)
+        return;
+    if(buf->mem)
+        buf->mem->used -= buf->size;
+    free(buf->data);
+    buf->data = NULL;
+    buf->start = 0;
+    buf->size = 0;
+}
+
 uint32_t buffer_free(const struct buffer *buf) {
     return buf->maxsize - buf->used;
 }
 
-static void utcp_log_send_error(const struct pkt_t *pkt, size_t len, ssize_t sent, bool drop) {
-    if(sent != len) {
-        if(sent > len) {
-            debug("Error: sent packet %u and ack %u but with a larger size than it should, %u of %u bytes sent", pkt->hdr.seq, pkt->hdr.ack, sent, len);
-        }
-        else if(sent >= 0) {
-            // we do not handle split packets
-            debug("Warning: failed to send packet %u and ack %u with only %u of %u bytes packet size sent, %s", pkt->hdr.seq, pkt->hdr.ack, sent, len, drop? "dropping the packet" : "retrying it later");
+// Chunked buffer functions
+
+// Address of the byte at pos, counted from the beginning of the first block.
+static char *chunk_at(const struct chunk_buffer *buf, size_t pos) {
+    uint32_t i = buf->head + pos / CHUNK_SIZE;
+    if(i >= buf->cap)
+        i -= buf->cap;
+    return buf->chunks[i] + pos % CHUNK_SIZE;
+}
+
+// Make sure there are enough blocks for required bytes of data. Only the array of block pointers is ever moved.
+static bool chunk_buffer_grow(struct chunk_buffer *buf, size_t required) {
+    size_t needed = (buf->start + required + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    if(needed > buf->cap) {
+        uint32_t newcap = buf->cap ? buf->cap : 4;
+        while(newcap < needed)
+            newcap *= 2;
+        char **newchunks = malloc(newcap * sizeof *newchunks);
+        if(!newchunks)
+            return false;
+        for(uint32_t i = 0; i < buf->nchunks; i++)
+            newchunks[i] = buf->chunks[(buf->head + i) % buf->cap];
+        free(buf->chunks);
+        buf->chunks = newchunks;
+        buf->cap = newcap;
+        buf->head = 0;
+    }
+
+    while(buf->nchunks < needed) {
+        struct mem_account *mem = buf->mem;
+        if(mem && mem->limit && mem->used + CHUNK_SIZE > mem->limit) {
+            debug("Memory budget exceeded, %lu of %lu bytes used\n", (unsigned long)mem->used, (unsigned long)mem->limit);
+            return false;
         }
-        else if(sent == UTCP_WOULDBLOCK) {
-            debug("Debug: failed to send packet %u and ack %u with UTCP_WOULDBLOCK, %s", pkt->hdr.seq, pkt->hdr.ack, drop? "dropping the packet" : "retrying it later");
+        char *chunk = malloc(CHUNK_SIZE);
+        if(!chunk)
+            return false;
+        uint32_t i = buf->head + buf->nchunks;
+        if(i >= buf->cap)
+            i -= buf->cap;
+        buf->chunks[i] = chunk;
+        buf->nchunks++;
+        buf->size += CHUNK_SIZE;
+        if(mem)
+            mem->used += CHUNK_SIZE;
+    }
+
+    return true;
+}
+
+static void chunk_buffer_write(struct chunk_buffer *buf, size_t offset, const char *data, size_t len) {
+    for(size_t pos = buf->start + offset, n; len; pos += n, data += n, len -= n) {
+        n = min(len, CHUNK_SIZE - pos % CHUNK_SIZE);
+        memcpy(chunk_at(buf, pos), data, n);
+    }
+}
+
+static void chunk_buffer_read(const struct chunk_buffer *buf, size_t offset, char *data, size_t len) {
+    for(size_t pos = buf->start + offset, n; len; pos += n, data += n, len -= n) {
+        n = min(len, CHUNK_SIZE - pos % CHUNK_SIZE);
+        memcpy(data, chunk_at(buf, pos), n);
+    }
+}
+
+// Append data to the buffer
+ssize_t chunk_buffer_put(struct chunk_buffer *buf, const void *data, size_t len) {
+    if(buf->maxsize <= buf->used)
+        return 0;
+    if(len > buf->maxsize - buf->used)
+        len = buf->maxsize - buf->used;
+    if(!len)
+        return 0;
+    if(!chunk_buffer_grow(buf, buf->used + len))
+        return -1;
+
+    chunk_buffer_write(buf, buf->used, data, len);
+    buf->used += len;
+    return len;
+}
+
+// Get data from the buffer. data can be NULL.
+ssize_t chunk_buffer_get(struct chunk_buffer *buf, void *data, size_t len) {
+    if(len > buf->used)
+        len = buf->used;
+    if(data)
+        chunk_buffer_read(buf, 0, data, len);
+    buf->start += len;
+    buf->used -= len;
+
+    // move blocks that were emptied to the end of the ring
+    while(buf->start >= CHUNK_SIZE) {
+        uint32_t tail = buf->head + buf->nchunks;
+        if(tail >= buf->cap)
+            tail -= buf->cap;
+        buf->chunks[tail] = buf->chunks[buf->head];
+        if(++buf->head == buf->cap)
+            buf->head = 0;
+        buf->start -= CHUNK_SIZE;
+    }
+
+    if(!buf->used)
+        buf->start = 0;
+    return len;
+}
+
+// Copy data from the buffer without removing it.
+ssize_t chunk_buffer_copy(const struct chunk_buffer *buf, void *data, size_t offset, size_t len) {
+    if(offset >= buf->used)
+        return 0;
+    if(offset + len > buf->used)
+        len = buf->used - offset;
+
+    chunk_buffer_read(buf, offset, data, len);
+    return len;
+}
+
+// Get pointers to free space after the data in the buffer, growing it if necessary.
+// At most the rest of the last block and the one after it are handed out.
+// Returns the number of spans, or -1 if the buffer could not be grown.
+ssize_t chunk_buffer_reserve(struct chunk_buffer *buf, struct iovec *iov, size_t len) {
+    if(buf->maxsize <= buf->used)
+        return 0;
+    if(len > buf->maxsize - buf->used)
+        len = buf->maxsize - buf->used;
+
+    size_t pos = buf->start + buf->used;
+    size_t first = CHUNK_SIZE - pos % CHUNK_SIZE;
+    if(len > first + CHUNK_SIZE)
+        len = first + CHUNK_SIZE;
+    if(!len)
+        return 0;
+    if(!chunk_buffer_grow(buf, buf->used + len))
+        return -1;
+
+    iov[0].iov_base = chunk_at(buf, pos);
+    iov[0].iov_len = min(len, first);
+    if(first >= len)
+        return 1;
+
+    iov[1].iov_base = chunk_at(buf, pos + first);
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+// Add data written into space returned by chunk_buffer_reserve() to the buffer.
+size_t chunk_buffer_commit(struct chunk_buffer *buf, size_t len) {
+    if(len > buf->size - buf->start - buf->used)
+        len = buf->size - buf->start - buf->used;
+    buf->used += len;
+    return len;
+}
+
+bool chunk_buffer_init(struct chunk_buffer *buf, uint32_t len, uint32_t maxlen) {
+    memset(buf, 0, sizeof *buf);
+    buf->maxsize = maxlen;
+    return !len || chunk_buffer_grow(buf, len);
+}
+
+// Free all blocks of an empty buffer, they are allocated again when data is put into it.
+void chunk_buffer_release(struct chunk_buffer *buf) {
+    if(buf->used)
+        return;
+    for(uint32_t i = 0; i < buf->nchunks; i++)
+        free(buf->chunks[(buf->head + i) % buf->cap]);
+    if(buf->mem)
+        buf->mem->used -= buf->size;
+    free(buf->chunks);
+    buf->chunks = NULL;
+    buf->cap = buf->head = buf->nchunks = 0;
+    buf->start = buf->size = 0;
+}
+
+void chunk_buffer_exit(struct chunk_buffer *buf) {
+    buf->used = 0;
+    chunk_buffer_release(buf);
+    memset(buf, 0, sizeof *buf);
+}
+
+// Charge the blocks of the buffer, and all later changes to them, to mem.
+void chunk_buffer_account(struct chunk_buffer *buf, struct mem_account *mem) {
+    buf->mem = mem;
+    mem->used += buf->size;
+}
+
+uint32_t chunk_buffer_free(const struct chunk_buffer *buf) {
+    return buf->maxsize - buf->used;
+}
+
+// Range set functions
+
+static uint32_t range_offset(const struct range_set *set, uint32_t pos) {
+    return pos - set->base;
+}
+
+static int range_height(const struct range_node *n) {
+    return n ? n->height : 0;
+}
+
+static void range_update(struct range_node *n) {
+    n->height = max(range_height(n->left), range_height(n->right)) + 1;
+}
+
+static struct range_node *range_rotate_left(struct range_node *n) {
+    struct range_node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    range_update(n);
+    range_update(r);
+    return r;
+}
+
+static struct range_node *range_rotate_right(struct range_node *n) {
+    struct range_node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    range_update(n);
+    range_update(l);
+    return l;
+}
+
+// Restore the AVL property of a subtree whose children differ in height by at most two
+static struct range_node *range_balance(struct range_node *n) {
+    int hl = range_height(n->left);
+    int hr = range_height(n->right);
+
+    if(hl > hr + 1) {
+        if(range_height(n->left->left) < range_height(n->left->right))
+            n->left = range_rotate_left(n->left);
+        return range_rotate_right(n);
+    }
+
+    if(hr > hl + 1) {
+        if(range_height(n->right->right) < range_height(n->right->left))
+            n->right = range_rotate_right(n->right);
+        return range_rotate_left(n);
+    }
+
+    range_update(n);
+    return n;
+}
+
+static struct range_node *range_insert(const struct range_set *set, struct range_node *n, struct range_node *node) {
+    if(!n)
+        return node;
+
+    if(range_offset(set, node->range.start) < range_offset(set, n->range.start))
+        n->left = range_insert(set, n->left, node);
+    else
+        n->right = range_insert(set, n->right, node);
+
+    return range_balance(n);
+}
+
+static struct range_node *range_remove_min(struct range_node *n, struct range_node **first) {
+    if(!n->left) {
+        *first = n;
+        return n->right;
+    }
+
+    n->left = range_remove_min(n->left, first);
+    return range_balance(n);
+}
+
+// Unlink node from the subtree, the caller owns it afterwards
+static struct range_node *range_remove(const struct range_set *set, struct range_node *n, const struct range_node *node) {
+    if(n == node) {
+        if(!n->left)
+            return n->right;
+        if(!n->right)
+            return n->left;
+
+        struct range_node *next;
+        struct range_node *right = range_remove_min(n->right, &next);
+        next->left = n->left;
+        next->right = right;
+        return range_balance(next);
+    }
+
+    if(range_offset(set, node->range.start) < range_offset(set, n->range.start))
+        n->left = range_remove(set, n->left, node);
+    else
+        n->right = range_remove(set, n->right, node);
+
+    return range_balance(n);
+}
+
+// The range with the highest start at or before offset
+static struct range_node *range_floor(const struct range_set *set, uint32_t offset) {
+    struct range_node *found = NULL;
+
+    for(struct range_node *n = set->root; n;) {
+        if(range_offset(set, n->range.start) <= offset) {
+            found = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
+    }
+
+    return found;
+}
+
+static struct range_node *range_node_new(struct range_set *set) {
+    struct range_node *node = malloc(sizeof *node);
+
+    if(node && set->mem)
+        set->mem->used += sizeof *node;
+
+    return node;
+}
+
+static void range_node_free(struct range_set *set, struct range_node *node) {
+    if(set->mem)
+        set->mem->used -= sizeof *node;
+
+    free(node);
+}
+
+static void range_free_tree(struct range_set *set, struct range_node *n) {
+    while(n) {
+        range_free_tree(set, n->left);
+        struct range_node *right = n->right;
+        range_node_free(set, n);
+        n = right;
+    }
+}
+
+// Move the ranges from the array into a tree, returns false if out of memory
+static bool range_set_to_tree(struct range_set *set) {
+    struct range_node *nodes[NSACKS];
+
+    for(uint32_t i = 0; i < set->count; i++) {
+        if(!(nodes[i] = range_node_new(set))) {
+            while(i--)
+                range_node_free(set, nodes[i]);
+            return false;
+        }
+    }
+
+    for(uint32_t i = 0; i < set->count; i++) {
+        nodes[i]->range = set->ranges[i];
+        nodes[i]->left = nodes[i]->right = NULL;
+        nodes[i]->height = 1;
+        set->root = range_insert(set, set->root, nodes[i]);
+    }
+
+    return true;
+}
+
+static void range_set_to_array(struct range_set *set) {
+    struct sack ranges[NSACKS];
+    size_t n = range_set_get(set, ranges, NSACKS);
+
+    for(size_t i = 0; i < n; i++) {
+        set->ranges[i].start = set->base + ranges[i].offset;
+        set->ranges[i].end = set->ranges[i].start + ranges[i].len;
+    }
+
+    range_free_tree(set, set->root);
+    set->root = NULL;
+}
+
+static bool range_tree_add(struct range_set *set, uint32_t start, uint32_t end) {
+    // Take out all ranges that overlap or touch the new one, reusing one of their nodes
+    struct range_node *node = NULL;
+    struct range_node *n;
+
+    uint32_t merged = 0;
+
+    while((n = range_floor(set, end)) && range_offset(set, n->range.end) >= start) {
+        start = min(start, range_offset(set, n->range.start));
+        end = max(end, range_offset(set, n->range.end));
+        merged += n->range.end - n->range.start;
+        set->root = range_remove(set, set->root, n);
+        set->count--;
+
+        if(node)
+            range_node_free(set, node);
+
+        node = n;
+    }
+
+    if(!node) {
+        if(set->count >= MAX_OOO_RANGES || !(node = range_node_new(set)))
+            return false;
+    }
+
+    set->bytes += end - start - merged;
+
+    node->range.start = set->base + start;
+    node->range.end = set->base + end;
+    node->left = node->right = NULL;
+    node->height = 1;
+    set->root = range_insert(set, set->root, node);
+    set->count++;
+    return true;
+}
+
+void range_set_init(struct range_set *set, struct mem_account *mem) {
+    memset(set, 0, sizeof *set);
+    set->mem = mem;
+}
+
+void range_set_exit(struct range_set *set) {
+    range_free_tree(set, set->root);
+    memset(set, 0, sizeof *set);
+}
+
+// Add the range of len bytes at offset, merging it with all ranges it overlaps or touches.
+// Returns false if it could not be added because the set is full or out of memory.
+bool range_set_add(struct range_set *set, uint32_t offset, uint32_t len) {
+    uint32_t start = offset;
+    uint32_t end = offset + len;
+
+    if(!len)
+        return true;
+
+    if(set->root)
+        return range_tree_add(set, start, end);
+
+    uint32_t i = 0;
+
+    while(i < set->count && range_offset(set, set->ranges[i].end) < start)
+        i++;
+
+    uint32_t j = i;
+    uint32_t merged = 0;
+
+    for(; j < set->count && range_offset(set, set->ranges[j].start) <= end; j++) {
+        start = min(start, range_offset(set, set->ranges[j].start));
+        end = max(end, range_offset(set, set->ranges[j].end));
+        merged += set->ranges[j].end - set->ranges[j].start;
+    }
+
+    if(j == i) {
+        if(set->count == NSACKS)
+            return range_set_to_tree(set) && range_tree_add(set, start, end);
+
+        memmove(&set->ranges[i + 1], &set->ranges[i], (set->count - i) * sizeof set->ranges[i]);
+        set->count++;
+    } else if(j > i + 1) {
+        memmove(&set->ranges[i + 1], &set->ranges[j], (set->count - j) * sizeof set->ranges[i]);
+        set->count -= j - i - 1;
+    }
+
+    set->ranges[i].start = set->base + start;
+    set->ranges[i].end = set->base + end;
+    set->bytes += end - start - merged;
+    return true;
+}
+
+// Move the base forward by len bytes, dropping what comes before it.
+void range_set_consume(struct range_set *set, uint32_t len) {
+    if(set->root) {
+        while(set->root) {
+            struct range_node *first = set->root;
+
+            while(first->left)
+                first = first->left;
+
+            if(range_offset(set, first->range.end) > len) {
+                if(range_offset(set, first->range.start) < len) {
+                    set->bytes -= len - range_offset(set, first->range.start);
+                    first->range.start = set->base + len;
+                }
+
+                break;
+            }
+
+            set->bytes -= first->range.end - first->range.start;
+            set->root = range_remove_min(set->root, &first);
+            range_node_free(set, first);
+            set->count--;
+        }
+
+        set->base += len;
+
+        // go back to the array when there is room to spare, so a few reordered packets don't switch back and forth
+        if(set->count <= NSACKS / 2)
+            range_set_to_array(set);
+
+        return;
+    }
+
+    uint32_t i = 0;
+
+    while(i < set->count && range_offset(set, set->ranges[i].end) <= len) {
+        set->bytes -= set->ranges[i].end - set->ranges[i].start;
+        i++;
+    }
+
+    memmove(&set->ranges[0], &set->ranges[i], (set->count - i) * sizeof set->ranges[0]);
+    set->count -= i;
+
+    if(set->count && range_offset(set, set->ranges[0].start) < len) {
+        set->bytes -= len - range_offset(set, set->ranges[0].start);
+        set->ranges[0].start = set->base + len;
+    }
+
+    set->base += len;
+}
+
+// Get the first n ranges, as offsets from the base. Returns the number of ranges stored.
+size_t range_set_get(const struct range_set *set, struct sack *ranges, size_t n) {
+    size_t count = 0;
+
+    if(!set->root) {
+        for(; count < n && count < set->count; count++) {
+            ranges[count].offset = range_offset(set, set->ranges[count].start);
+            ranges[count].len = set->ranges[count].end - set->ranges[count].start;
+        }
+
+        return count;
+    }
+
+    // In-order walk, the height of an AVL tree is at most 1.44 log2(count)
+    const struct range_node *stack[32];
+    size_t depth = 0;
+    const struct range_node *node = set->root;
+
+    while(count < n && (node || depth)) {
+        while(node) {
+            stack[depth++] = node;
+            node = node->left;
+        }
+
+        node = stack[--depth];
+        ranges[count].offset = range_offset(set, node->range.start);
+        ranges[count].len = node->range.end - node->range.start;
+        count++;
+        node = node->right;
+    }
+
+    return count;
+}
+
+// Find the first range that ends after offset, so it either holds offset or starts after it.
+// Returns false if there is none.
+bool range_set_find(const struct range_set *set, uint32_t offset, struct sack *range) {
+    const struct sack_block *found = NULL;
+
+    if(!set->root) {
+        for(uint32_t i = 0; i < set->count && !found; i++)
+            if(range_offset(set, set->ranges[i].end) > offset)
+                found = &set->ranges[i];
+    } else {
+        for(const struct range_node *n = set->root; n;) {
+            if(range_offset(set, n->range.end) > offset) {
+                found = &n->range;
+                n = n->left;
+            } else {
+                n = n->right;
+            }
+        }
+    }
+
+    if(!found)
+        return false;
+
+    range->offset = range_offset(set, found->start);
+    range->len = found->end - found->start;
+    return true;
+}
+
+// The offset just after the last range, or 0 if there is none.
+uint32_t range_set_end(const struct range_set *set) {
+    if(!set->root)
+        return set->count ? range_offset(set, set->ranges[set->count - 1].end) : 0;
+
+    const struct range_node *n = set->root;
+    while(n->right)
+        n = n->right;
+    return range_offset(set, n->range.end);
+}
+
+// Packet pool functions
+
+static size_t pkt_buf_size(uint32_t mtu) {
+    return sizeof(struct pkt_buf) + sizeof(struct hdr) + mtu;
+}
+
+// Buffers have to hold the largest segment any connection may send, which includes MTU probes
+static uint16_t pool_mtu(const struct utcp *utcp) {
+    return utcp->mtu_max > utcp->mtu ? utcp->mtu_max : utcp->mtu;
+}
+
+static void pkt_buf_free(struct utcp *utcp, struct pkt_buf *buf) {
+    utcp->mem.used -= pkt_buf_size(buf->size);
+    free(buf);
+}
+
+// Get a packet buffer with room for the header and pool_mtu() bytes of data.
+// Buffers are taken from the pool if possible, so in the steady state no memory is allocated.
+struct pkt_t *pkt_pool_get(struct utcp *utcp) {
+    struct pkt_buf *buf = utcp->pool;
+    if(buf) {
+        utcp->pool = buf->next;
+        utcp->npool--;
+    } else {
+        buf = malloc(pkt_buf_size(pool_mtu(utcp)));
+        if(!buf) {
+            debug("Error: out of memory");
+            return NULL;
+        }
+        buf->size = pool_mtu(utcp);
+        utcp->mem.used += pkt_buf_size(buf->size);
+    }
+    buf->next = NULL;
+    return (struct pkt_t *)(buf + 1);
+}
+
+// Return a packet buffer to the pool. Buffers that are too small for the current mtu are freed.
+void pkt_pool_put(struct utcp *utcp, struct pkt_t *pkt) {
+    if(!pkt)
+        return;
+    struct pkt_buf *buf = (struct pkt_buf *)pkt - 1;
+    if(buf->size < pool_mtu(utcp) || utcp->npool >= PKT_POOL_SIZE) {
+        pkt_buf_free(utcp, buf);
+        return;
+    }
+    buf->next = utcp->pool;
+    utcp->pool = buf;
+    utcp->npool++;
+}
+
+// Drop pooled buffers that can no longer hold a full packet after a change of the mtu.
+static void pkt_pool_resize(struct utcp *utcp) {
+    for(struct pkt_buf **next = &utcp->pool, *buf; (buf = *next); ) {
+        if(buf->size < pool_mtu(utcp)) {
+            *next = buf->next;
+            pkt_buf_free(utcp, buf);
+            utcp->npool--;
+        } else {
+            next = &buf->next;
+        }
+    }
+}
+
+void pkt_pool_exit(struct utcp *utcp) {
+    while(utcp->pool) {
+        struct pkt_buf *buf = utcp->pool;
+        utcp->pool = buf->next;
+        pkt_buf_free(utcp, buf);
+    }
+    utcp->npool = 0;
+}
+
+static void utcp_log_send_error(const void *pkt, size_t len, ssize_t sent, bool drop) {
+    struct hdr hdr;
+    enum hdr_format format;
+    if(!read_hdr(pkt, len, &hdr, &format))
+        return;
+
+    if(sent != len) {
+        if(sent > (ssize_t)len) {
+            debug("Error: sent packet %u and ack %u but with a larger size than it should, %u of %u bytes sent", hdr.seq, hdr.ack, sent, len);
+        }
+        else if(sent >= 0) {
+            // we do not handle split packets
+            debug("Warning: failed to send packet %u and ack %u with only %u of %u bytes packet size sent, %s", hdr.seq, hdr.ack, sent, len, drop? "dropping the packet" : "retrying it later");
+        }
+        else if(sent == UTCP_WOULDBLOCK) {
+            debug("Debug: failed to send packet %u and ack %u with UTCP_WOULDBLOCK, %s", hdr.seq, hdr.ack, drop? "dropping the packet" : "retrying it later");
         }
         else {
             // the pkt receiver might have gone offline causing the routing to fail
             // drop the packet and continue
-            debug("Error: failed to send packet %u and ack %u with error %u, %s", pkt->hdr.seq, pkt->hdr.ack, sent, drop? "dropping the packet" : "retrying it later");
+            debug("Error: failed to send packet %u and ack %u with error %u, %s", hdr.seq, hdr.ack, sent, drop? "dropping the packet" : "retrying it later");
         }
     }
     else if(drop) {
-        debug("Error: failed to send packet %u and ack %u, dropping the packet [sent=%u]", pkt->hdr.seq, pkt->hdr.ack, sent);
+        debug("Error: failed to send packet %u and ack %u, dropping the packet [sent=%u]", hdr.seq, hdr.ack, sent);
+    }
+}
+
+// Hand a train of packets to the datagram layer, in one call if a batch send callback is set.
+// Returns the number of packets that were sent, in order. If not all packets were sent,
+// err is set to UTCP_WOULDBLOCK or UTCP_ERROR to tell what happened to the first unsent one.
+static size_t utcp_send_packets(struct utcp *utcp, const struct iovec *pkts, size_t n, int *err) {
+    *err = 0;
+
+    if(utcp->send_batch) {
+        ssize_t sent = utcp->send_batch(utcp, pkts, n);
+        if(sent >= (ssize_t)n)
+            return n;
+        if(sent >= 0) {
+            // a partial batch means the socket send buffer is full
+            utcp_log_send_error(pkts[sent].iov_base, pkts[sent].iov_len, UTCP_WOULDBLOCK, false);
+            *err = UTCP_WOULDBLOCK;
+            return sent;
+        }
+        utcp_log_send_error(pkts[0].iov_base, pkts[0].iov_len, sent, false);
+        *err = sent == UTCP_WOULDBLOCK ? UTCP_WOULDBLOCK : UTCP_ERROR;
+        return 0;
     }
+
+    for(size_t i = 0; i < n; i++) {
+        ssize_t sent = utcp->send(utcp, pkts[i].iov_base, pkts[i].iov_len);
+        if(sent != pkts[i].iov_len) {
+            utcp_log_send_error(pkts[i].iov_base, pkts[i].iov_len, sent, false);
+            if(sent > (ssize_t)pkts[i].iov_len)
+                continue;
+            // when no data could be sent with possibly the header broken
+            // or when the socket would block, stop and let the caller retry later
+            *err = sent >= 0 || sent == UTCP_WOULDBLOCK ? UTCP_WOULDBLOCK : UTCP_ERROR;
+            return i;
+        }
+    }
+
+    return n;
 }
 
 static bool utcp_queue_packet(struct utcp_connection *c, struct pkt_t *pkt, size_t len) {
-    struct pkt_entry_t *entry = malloc(sizeof *entry);
-    if(!entry) {
-        debug("Error: out of memory");
+    struct pkt_queue *queue = &c->pending_to_send;
+    if(queue->count >= queue->max) {
+        debug("Error: send queue full, %u packets pending", queue->count);
         return false;
     }
 
-    entry->pkt = pkt;
-    entry->len = len;
-    list_insert_tail(c->pending_to_send, entry);
+    struct pkt_buf *buf = (struct pkt_buf *)pkt - 1;
+    buf->next = NULL;
+    buf->len = len;
+
+    if(queue->tail)
+        queue->tail->next = buf;
+    else
+        queue->head = buf;
+    queue->tail = buf;
+    queue->count++;
+
+    // retry sending it from utcp_timeout()
+    mark_ready(c);
 
     return true;
 }
 
+// remove the first packet from the queue and return it to the pool
+static void utcp_dequeue_packet(struct utcp_connection *c) {
+    struct pkt_queue *queue = &c->pending_to_send;
+    struct pkt_buf *buf = queue->head;
+
+    queue->head = buf->next;
+    if(!queue->head)
+        queue->tail = NULL;
+    queue->count--;
+
+    pkt_pool_put(c->utcp, (struct pkt_t *)(buf + 1));
+}
+
 static bool utcp_send_packet(struct utcp *utcp, const struct pkt_t *pkt, size_t len) {
     // attempt to immediately send the packet
     ssize_t sent = utcp->send(utcp, pkt, len);
     if(sent != len) {
-        if(sent > len) {
+        if(sent > (ssize_t)len) {
             utcp_log_send_error(pkt, len, sent, false);
         }
         else if(sent >= 0 || sent == UTCP_WOULDBLOCK) {
@@ -458,8 +1835,8 @@ static bool utcp_send_packet(struct utcp *utcp, const struct pkt_t *pkt, size_t
 
 // if successful takes ownership on the pkt data
 static bool utcp_send_packet_or_queue(struct utcp_connection *c, struct pkt_t *pkt, size_t len) {
-    // when there are already packets queued, just append it to the list to be processed next utcp_timeout
-    if(c->pending_to_send->count) {
+    // when there are already packets queued, just append it to the queue to be processed next utcp_timeout
+    if(c->pending_to_send.count) {
         return utcp_queue_packet(c, pkt, len);
     }
 
@@ -467,7 +1844,7 @@ static bool utcp_send_packet_or_queue(struct utcp_connection *c, struct pkt_t *p
     struct utcp *utcp = c->utcp;
     ssize_t sent = utcp->send(utcp, pkt, len);
     if(sent != len) {
-        if(sent > len) {
+        if(sent > (ssize_t)len) {
             utcp_log_send_error(pkt, len, sent, false);
         }
         else if(sent >= 0 || sent == UTCP_WOULDBLOCK) {
@@ -484,143 +1861,371 @@ static bool utcp_send_packet_or_queue(struct utcp_connection *c, struct pkt_t *p
         }
     }
 
-    // free pkt data if sent
-    free(pkt);
+    // return pkt data to the pool if sent
+    pkt_pool_put(utcp, pkt);
 
     return true;
 }
 
+// The part of a queued packet the scheduler charges for, everything after the header
+static uint32_t pkt_payload_len(const struct pkt_buf *buf) {
+    struct hdr hdr;
+    enum hdr_format format;
+    return buf->len - read_hdr(buf + 1, buf->len, &hdr, &format);
+}
+
 // returns whether all could be sent
 static bool utcp_send_queued(struct utcp_connection *c) {
     struct utcp *utcp = c->utcp;
-    for list_each(struct pkt_entry_t, entry, c->pending_to_send) {
-        if(!entry || !entry->pkt) {
-            list_delete_node(c->pending_to_send, node);
-            continue;
+    while(c->pending_to_send.head) {
+        struct iovec batch[SEND_BATCH_SIZE];
+        size_t n = 0;
+        int32_t quota = c->deficit;
+
+        for(struct pkt_buf *buf = c->pending_to_send.head; buf && n < SEND_BATCH_SIZE; buf = buf->next, n++) {
+            // the scheduler may only allow some of the packets
+            if(c->scheduled && quota <= 0)
+                break;
+            quota -= pkt_payload_len(buf);
+            batch[n].iov_base = buf + 1;
+            batch[n].iov_len = buf->len;
         }
 
-        ssize_t sent = utcp->send(utcp, entry->pkt, entry->len);
-        if(sent != entry->len) {
-            if(sent > entry->len) {
-                utcp_log_send_error(entry->pkt, entry->len, sent, false);
-            }
-            else if(sent >= 0 || sent == UTCP_WOULDBLOCK) {
-                // when no data could be sent with possibly the header broken
-                // or when the socket would block, keep queued and retry later
-                utcp_log_send_error(entry->pkt, entry->len, sent, false);
-                return false;
-            }
-            else {
-                // the pkt receiver might have gone offline causing the routing to fail
-                // drop the packet and continue
-                utcp_log_send_error(entry->pkt, entry->len, sent, true);
-            }
+        if(!n) {
+            c->backlogged = true;
+            return false;
         }
 
-        // free pkt when done
-        free(entry->pkt);
+        int err;
+        size_t sent = utcp_send_packets(utcp, batch, n, &err);
+
+        // return sent pkts to the pool when done
+        for(size_t i = 0; i < sent; i++) {
+            if(c->scheduled)
+                c->deficit -= pkt_payload_len((const struct pkt_buf *)batch[i].iov_base - 1);
+            utcp_dequeue_packet(c);
+        }
 
-        list_delete_node(c->pending_to_send, node);
+        if(err == UTCP_WOULDBLOCK) {
+            // when no data could be sent with possibly the header broken
+            // or when the socket would block, keep queued and retry later
+            return false;
+        } else if(err) {
+            // the pkt receiver might have gone offline causing the routing to fail
+            // drop the packet and continue
+            utcp_log_send_error(batch[sent].iov_base, batch[sent].iov_len, UTCP_ERROR, true);
+            utcp_dequeue_packet(c);
+        }
     }
     return true;
 }
 
+// Connections are stored in an open addressing hash table keyed on the port pair.
+// Linear probing with backward shift deletion gives O(1) lookup, insertion and deletion without tombstones.
+// All connections are also kept in a dense array, so they can be iterated over quickly.
 
-// Connections are stored in a sorted list.
-// This gives O(log(N)) lookup time, O(N log(N)) insertion time and O(N) deletion time.
+static uint32_t hash_ports(uint16_t src, uint16_t dst, uint32_t mask) {
+    uint32_t key = ((uint32_t)src << 16 | dst) * 0x9e3779b1;
+    return (key ^ key >> 16) & mask;
+}
 
-static int compare(const void *va, const void *vb) {
-    assert(va && vb);
+static struct utcp_connection *find_connection(const struct utcp *utcp, uint16_t src, uint16_t dst) {
+    if(!utcp->nconnections)
+        return NULL;
 
-    const struct utcp_connection *a = *(struct utcp_connection **)va;
-    const struct utcp_connection *b = *(struct utcp_connection **)vb;
+    uint32_t mask = utcp->table_size - 1;
+    for(uint32_t i = hash_ports(src, dst, mask); utcp->table[i]; i = (i + 1) & mask) {
+        struct utcp_connection *c = utcp->table[i];
+        if(c->src == src && c->dst == dst)
+            return c;
+    }
 
-    assert(a && b);
-    assert(a->src && b->src);
+    return NULL;
+}
 
-    int c = (int)a->src - (int)b->src;
-    if(c)
-        return c;
-    c = (int)a->dst - (int)b->dst;
-    return c;
+static void table_insert(struct utcp *utcp, struct utcp_connection *c) {
+    uint32_t mask = utcp->table_size - 1;
+    uint32_t i = hash_ports(c->src, c->dst, mask);
+    while(utcp->table[i])
+        i = (i + 1) & mask;
+    utcp->table[i] = c;
 }
 
-static struct utcp_connection *find_connection(const struct utcp *utcp, uint16_t src, uint16_t dst) {
-    if(!utcp->nconnections)
-        return NULL;
-    struct utcp_connection key = {
-        .src = src,
-        .dst = dst,
-    }, *keyp = &key;
-    struct utcp_connection **match = bsearch(&keyp, utcp->connections, utcp->nconnections, sizeof *utcp->connections, compare);
-    return match ? *match : NULL;
+static void table_remove(struct utcp *utcp, struct utcp_connection *c) {
+    uint32_t mask = utcp->table_size - 1;
+    uint32_t i = hash_ports(c->src, c->dst, mask);
+    while(utcp->table[i] != c) {
+        assert(utcp->table[i]);
+        i = (i + 1) & mask;
+    }
+
+    // move entries after the hole back if their probe sequence passes through it
+    utcp->table[i] = NULL;
+    for(uint32_t j = (i + 1) & mask; utcp->table[j]; j = (j + 1) & mask) {
+        uint32_t home = hash_ports(utcp->table[j]->src, utcp->table[j]->dst, mask);
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            utcp->table[i] = utcp->table[j];
+            utcp->table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// Keep the hash table at most half full.
+static bool table_reserve(struct utcp *utcp, uint32_t n) {
+    if(n * 2 <= utcp->table_size)
+        return true;
+
+    uint32_t newsize = utcp->table_size ? utcp->table_size * 2 : 16;
+    struct utcp_connection **new_table = calloc(newsize, sizeof *new_table);
+    if(!new_table)
+        return false;
+
+    free(utcp->table);
+    utcp->table = new_table;
+    utcp->table_size = newsize;
+
+    for(int i = 0; i < utcp->nconnections; i++)
+        table_insert(utcp, utcp->connections[i]);
+
+    return true;
+}
+
+// SplitMix64, so instances do not share the hidden state of rand() and can run on different threads.
+static uint32_t utcp_random(struct utcp *utcp) {
+    uint64_t z = (utcp->prng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (z ^ (z >> 31)) >> 32;
+}
+
+// Pick a free local port with the high bit set, starting at a random position.
+// Whole words of the bitmap of ports in use are skipped at once.
+static uint16_t allocate_port(struct utcp *utcp, uint16_t dst) {
+    uint32_t start = utcp_random(utcp);
+
+    for(uint32_t n = 0; n < NPORTS;) {
+        uint32_t port = (start + n) % NPORTS;
+        uint32_t word = utcp->ports[port / 32];
+
+        if(word == 0xffffffff) {
+            n += 32 - port % 32;
+            continue;
+        }
+
+        if(!(word & 1U << port % 32) && !find_connection(utcp, port | 0x8000, dst)) {
+            utcp->ports[port / 32] |= 1U << port % 32;
+            return port | 0x8000;
+        }
+
+        n++;
+    }
+
+    return 0;
+}
+
+static void free_port(struct utcp *utcp, uint16_t src) {
+    uint32_t port = src & 0x7fff;
+    utcp->ports[port / 32] &= ~(1U << port % 32);
+}
+
+// return all queued packets to the pool
+static void free_pending(struct utcp_connection *c) {
+    while(c->pending_to_send.head)
+        utcp_dequeue_packet(c);
 }
 
 static void free_connection(struct utcp_connection *c) {
     struct utcp *utcp = c->utcp;
-    struct utcp_connection **cp = bsearch(&c, utcp->connections, utcp->nconnections, sizeof *utcp->connections, compare);
 
-    assert(cp);
+    assert(utcp->connections[c->index] == c);
+
+    table_remove(utcp, c);
 
-    int i = cp - utcp->connections;
-    memmove(cp, cp + 1, (utcp->nconnections - i - 1) * sizeof *cp);
-    utcp->nconnections--;
+    // move the last connection into the hole
+    struct utcp_connection *last = utcp->connections[--utcp->nconnections];
+    utcp->connections[c->index] = last;
+    last->index = c->index;
 
-    if(c->pending_to_send)
-        list_delete_list(c->pending_to_send);
+    if(c->ephemeral)
+        free_port(utcp, c->src);
+
+    if(c->heap_pos)
+        heap_remove(utcp, c);
+    unmark_ready(c);
+
+    if(utcp->last_conn == c)
+        utcp->last_conn = NULL;
+
+    // forget about it if it is part of a batch being processed
+    if(c->ack_pending) {
+        for(struct utcp_connection **next = &utcp->ack_list; *next; next = &(*next)->ack_next) {
+            if(*next == c) {
+                *next = c->ack_next;
+                break;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < utcp->ndeferred; i++)
+        if(utcp->deferred[i].c == c)
+            utcp->deferred[i].c = NULL;
+
+    free_pending(c);
 
     buffer_exit(&c->rcvbuf);
-    buffer_exit(&c->sndbuf);
+    range_set_exit(&c->sacks);
+    range_set_exit(&c->scoreboard);
+    chunk_buffer_exit(&c->sndbuf);
     free(c);
 }
 
+// Path MTU discovery, see utcp_set_mtu_probing() and RFC 8899.
+// A probe is a data segment larger than c->mtu. Enough data has to follow it that its loss shows up
+// as a triplicate ACK, which is then not taken as congestion: the data is just sent again in smaller segments.
+
+// Start over from the base mtu, after it or the probing limit changed
+static void pmtu_reset(struct utcp_connection *c) {
+    c->mtu = c->utcp->mtu;
+    c->probe_size = 0;
+    c->probe_hi = (uint32_t)c->utcp->mtu_max + 1;
+    c->probe_losses = 0;
+    c->probe_end = c->snd.nxt;
+    timerclear(&c->probe_next);
+}
+
+static bool in_probe(const struct utcp_connection *c, uint32_t seq) {
+    return c->probe_size && seqdiff(seq, c->probe_seq) >= 0 && seqdiff(seq, c->probe_end) < 0;
+}
+
+// @return the payload size of the next probe, or 0 if it is not the time for one
+static uint32_t probe_mtu(struct utcp_connection *c) {
+    struct utcp *utcp = c->utcp;
+
+    // one probe at a time, none during loss recovery, and none before the data of the last one is acknowledged
+    if(utcp->mtu_max <= c->mtu || c->probe_size || c->fast_recovery || c->dupack || seqdiff(c->snd.una, c->probe_end) < 0)
+        return 0;
+
+    // once the search narrowed down the mtu, only look for a larger one again after a while
+    if(c->probe_hi <= utcp->mtu_max && c->probe_hi - c->mtu <= PMTU_SEARCH_STEP) {
+        struct timeval now;
+        get_time(utcp, &now);
+        if(!timerisset(&c->probe_next)) {
+            c->probe_next = now;
+            c->probe_next.tv_sec += PMTU_RAISE_INTERVAL;
+            return 0;
+        }
+        if(timercmp(&now, &c->probe_next, <))
+            return 0;
+        c->probe_hi = (uint32_t)utcp->mtu_max + 1;
+        timerclear(&c->probe_next);
+    }
+
+    // most paths allow the largest size, otherwise search between what got through and what did not
+    uint32_t size = c->probe_hi > utcp->mtu_max ? utcp->mtu_max : (c->mtu + c->probe_hi) / 2;
+    if(unsacked_len(c, c->snd.nxt) < size)
+        return 0;
+
+    // the segments following it must have data and room in the congestion window
+    uint32_t needed = size + PMTU_PROBE_FOLLOWERS * c->mtu;
+    if((uint32_t)seqdiff(c->snd.last, c->snd.nxt) < needed || c->snd.cwnd < needed)
+        return 0;
+    return size;
+}
+
+static void probe_acked(struct utcp_connection *c) {
+    debug("%p mtu raised to %u\n", c, c->probe_size);
+    c->mtu = c->probe_size;
+    c->probe_size = 0;
+    c->probe_losses = 0;
+}
+
+static void probe_lost(struct utcp_connection *c) {
+    debug("%p mtu probe of %u bytes lost\n", c, c->probe_size);
+    if(++c->probe_losses >= PMTU_MAX_PROBES) {
+        c->probe_hi = c->probe_size;
+        c->probe_losses = 0;
+    }
+    c->probe_size = 0;
+}
+
+// Retransmit timeouts in a row at a raised mtu mean that large segments stopped getting through,
+// for example because the path changed. Go back to the base mtu and search below the one that failed.
+static void detect_black_hole(struct utcp_connection *c) {
+    if(c->timeouts < PMTU_BLACK_HOLE)
+        c->timeouts++;
+    if(c->timeouts < PMTU_BLACK_HOLE || c->mtu <= c->utcp->mtu)
+        return;
+
+    debug("%p mtu %u stopped working, back to %u\n", c, c->mtu, c->utcp->mtu);
+    c->probe_hi = c->mtu;
+    c->mtu = c->utcp->mtu;
+    c->probe_losses = 0;
+    c->timeouts = 0;
+    timerclear(&c->probe_next);
+}
+
 static struct utcp_connection *allocate_connection(struct utcp *utcp, uint16_t src, uint16_t dst) {
     // Check whether this combination of src and dst is free
 
-    if(src) {
-        if(find_connection(utcp, src, dst)) {
-            errno = EADDRINUSE;
-            return NULL;
-        }
-    } else { // If src == 0, generate a random port number with the high bit set
-        if(utcp->nconnections >= 32767) {
-            errno = ENOMEM;
-            return NULL;
-        }
-        src = rand() | 0x8000;
-        while(find_connection(utcp, src, dst))
-            src++;
+    if(src && find_connection(utcp, src, dst)) {
+        errno = EADDRINUSE;
+        return NULL;
     }
 
     // Allocate memory for the new connection
 
     if(utcp->nconnections >= utcp->nallocated) {
-        if(!utcp->nallocated)
-            utcp->nallocated = 4;
-        else
-            utcp->nallocated *= 2;
-        struct utcp_connection **new_array = realloc(utcp->connections, utcp->nallocated * sizeof *utcp->connections);
+        int nallocated = utcp->nallocated ? utcp->nallocated * 2 : 4;
+        struct utcp_connection **new_array = realloc(utcp->connections, nallocated * sizeof *utcp->connections);
         if(!new_array)
             return NULL;
         utcp->connections = new_array;
+        // the timer heap never holds more than all connections
+        new_array = realloc(utcp->timers, nallocated * sizeof *utcp->timers);
+        if(!new_array)
+            return NULL;
+        utcp->timers = new_array;
+        utcp->nallocated = nallocated;
     }
 
+    if(!table_reserve(utcp, utcp->nconnections + 1))
+        return NULL;
+
     struct utcp_connection *c = calloc(1, sizeof *c);
     if(!c)
         return NULL;
 
-    if(!buffer_init(&c->sndbuf, DEFAULT_SNDBUFSIZE, DEFAULT_MAXSNDBUFSIZE)) {
+    if(!chunk_buffer_init(&c->sndbuf, DEFAULT_SNDBUFSIZE, DEFAULT_MAXSNDBUFSIZE)) {
         free(c);
         return NULL;
     }
 
     if(!buffer_init(&c->rcvbuf, DEFAULT_RCVBUFSIZE, DEFAULT_MAXRCVBUFSIZE)) {
-        buffer_exit(&c->sndbuf);
+        chunk_buffer_exit(&c->sndbuf);
         free(c);
         return NULL;
     }
 
-    c->pending_to_send = list_alloc((list_action_t)free_pkt_entry);
+    chunk_buffer_account(&c->sndbuf, &utcp->mem);
+    buffer_account(&c->rcvbuf, &utcp->mem);
+    range_set_init(&c->sacks, &utcp->mem);
+    range_set_init(&c->scoreboard, &utcp->mem);
+
+    if(!src) { // If src == 0, generate a random port number with the high bit set
+        src = allocate_port(utcp, dst);
+        if(!src) {
+            buffer_exit(&c->rcvbuf);
+            chunk_buffer_exit(&c->sndbuf);
+            free(c);
+            errno = ENOMEM;
+            return NULL;
+        }
+        c->ephemeral = true;
+    }
+
+    c->pending_to_send.max = DEFAULT_MAX_PENDING;
+    c->priority = DEFAULT_PRIORITY;
 
     // Fill in the details
 
@@ -629,26 +2234,171 @@ static struct utcp_connection *allocate_connection(struct utcp *utcp, uint16_t s
 #ifdef UTCP_DEBUG
     c->snd.iss = 0;
 #else
-    c->snd.iss = rand();
+    c->snd.iss = utcp_random(utcp);
 #endif
     c->snd.una = c->snd.iss;
     c->snd.nxt = c->snd.iss + 1;
     c->rcv.wnd = utcp->mtu;
     c->snd.last = c->snd.nxt;
+    c->snd.max = c->snd.una;
+    c->snd.small = c->snd.una;
+    c->utcp = utcp;
+    pmtu_reset(c);
     c->snd.cwnd = utcp->mtu;
     c->snd.ssthresh = 1 << 30;
     c->cwnd_max = 0;
+    c->ack_every = 1;
+    c->ack_delay = DEFAULT_ACK_DELAY;
+    c->cc = &cc_reno;
+    c->cc->init(c);
+    c->reordering = DUPTHRESH;
     c->rtrx_tolerance = 0;
-    c->utcp = utcp;
+    c->srtt = utcp->srtt;
+    c->rttvar = utcp->rttvar;
+    c->rto = utcp->rto;
 
-    // Add it to the sorted list of connections
+    // Add it to the connection table
 
+    c->index = utcp->nconnections;
     utcp->connections[utcp->nconnections++] = c;
-    qsort(utcp->connections, utcp->nconnections, sizeof *utcp->connections, compare);
+    table_insert(utcp, c);
 
     return c;
 }
 
+// Whether most of the memory budget is used up. Buffers then no longer grow, and idle ones are freed.
+static bool mem_pressure(const struct utcp *utcp) {
+    return utcp->mem.limit && utcp->mem.used >= utcp->mem.limit - utcp->mem.limit / 4;
+}
+
+// The window to advertise, no more than what fits in the receive buffer and the remaining memory budget,
+// minus the data waiting for utcp_read().
+static uint32_t rcv_window(const struct utcp_connection *c) {
+    const struct mem_account *mem = &c->utcp->mem;
+    uint32_t wnd = c->rcv.wnd;
+    if(mem->limit && c->rcv.wnd > c->rcvbuf.size) {
+        size_t avail = mem->used < mem->limit ? mem->limit - mem->used : 0;
+        wnd = max(min(c->rcv.wnd, c->rcvbuf.size + avail), c->utcp->mtu);
+    }
+    return wnd > c->rcv_ready ? wnd - c->rcv_ready : 0;
+}
+
+// The window to put in a packet, remembering how far it lets the peer send for utcp_read().
+static uint32_t advertise_window(struct utcp_connection *c) {
+    uint32_t wnd = rcv_window(c);
+    c->rcv_adv = c->rcv.nxt + wnd;
+    return wnd;
+}
+
+// Free space in the send buffer, as far as the memory budget lets it grow.
+static uint32_t sndbuf_free(const struct utcp_connection *c) {
+    // nothing can follow a source until it is acked
+    if(c->read_at)
+        return 0;
+
+    const struct mem_account *mem = &c->utcp->mem;
+    uint32_t free = chunk_buffer_free(&c->sndbuf);
+    if(!mem->limit)
+        return free;
+    size_t avail = mem->used < mem->limit ? mem->limit - mem->used : 0;
+    return min(free, c->sndbuf.size - c->sndbuf.start - c->sndbuf.used + avail / CHUNK_SIZE * CHUNK_SIZE);
+}
+
+// Copy len bytes of the stream, starting offset bytes after the first unacked byte of data.
+// Whatever is beyond the send buffer is read from the source added with utcp_send_source().
+// @return false if the source could not be read, the connection is reset next time it is handled
+static bool copy_stream(struct utcp_connection *c, void *data, size_t offset, size_t len) {
+    size_t used = c->sndbuf.used;
+    if(offset < used) {
+        size_t n = min(len, used - offset);
+        chunk_buffer_copy(&c->sndbuf, data, offset, n);
+        data = (char *)data + n;
+        offset += n;
+        len -= n;
+    }
+
+    while(len) {
+        assert(c->read_at && offset - used + len <= c->source_left);
+        errno = 0;
+        ssize_t n = c->read_at(c, data, len, c->source_pos + offset - used);
+        if(n <= 0 || (size_t)n > len) {
+            debug("Error: %p could not read the source at %llu\n", c, (unsigned long long)(c->source_pos + offset - used));
+            c->source_error = n < 0 && errno ? errno : EIO;
+            mark_ready(c);
+            return false;
+        }
+        data = (char *)data + n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Free the buffers of a connection that have no data in them, if memory is tight.
+static void reclaim_buffers(struct utcp_connection *c) {
+    if(!mem_pressure(c->utcp))
+        return;
+    if(!c->snd_reserved)
+        chunk_buffer_release(&c->sndbuf);
+    buffer_release(&c->rcvbuf);
+}
+
+// Send our SYN, or the SYNACK of a connection accepted on a fast open SYN, with as much of the
+// buffered data as fits in one segment, followed by the FIN if it was queued and fits as well.
+// SYNs carry no options, hdr.aux holds the capabilities instead.
+static bool send_syn(struct utcp_connection *c) {
+    struct pkt_t *pkt = pkt_pool_get(c->utcp);
+    if(!pkt)
+        return false;
+
+    bool synack = c->state != SYN_SENT;
+    bool fin = fin_queued(c);
+    uint32_t len = seqdiff(c->snd.last, c->snd.iss + 1) - fin;
+    if(len > c->utcp->mtu) {
+        len = c->utcp->mtu;
+        fin = false;
+    }
+
+    memset(&pkt->hdr, 0, sizeof pkt->hdr);
+    pkt->hdr.src = c->src;
+    pkt->hdr.dst = c->dst;
+    pkt->hdr.seq = c->snd.iss;
+    pkt->hdr.ack = synack ? c->rcv.nxt : 0;
+    pkt->hdr.trs = c->snd.trs;
+    pkt->hdr.tra = c->rcv.trs;
+    pkt->hdr.wnd = advertise_window(c);
+    pkt->hdr.ctl = SYN | (synack ? ACK : 0) | (fin ? FIN : 0);
+    pkt->hdr.aux = synack ? c->caps : c->utcp->caps;
+    if(!copy_stream(c, pkt->data, 0, len)) {
+        pkt_pool_put(c->utcp, pkt);
+        return false;
+    }
+
+    // a bare SYN is left to the connection timer, but data and the FIN are sent again when lost
+    c->syn_queued = false;
+    if(len || fin)
+        start_retransmit_timer(c);
+    if(!timerisset(&c->conn_timeout))
+        start_connection_timer(c);
+
+    print_packet(c->utcp, "send", pkt, sizeof pkt->hdr + len);
+    packet_sent(c->utcp, c, pkt, sizeof pkt->hdr + len, len, seqdiff(c->snd.max, c->snd.iss) > 0);
+    if(!utcp_send_packet_or_queue(c, pkt, sizeof pkt->hdr + len)) {
+        debug("Error: failed to send SYN");
+        pkt_pool_put(c->utcp, pkt);
+        return false;
+    }
+
+    uint32_t end = c->snd.iss + 1 + len + fin;
+    if(seqdiff(end, c->snd.nxt) > 0)
+        c->snd.nxt = end;
+    if(seqdiff(end, c->snd.max) > 0)
+        c->snd.max = end;
+
+    return true;
+}
+
 struct utcp_connection *utcp_connect(struct utcp *utcp, uint16_t dst, utcp_recv_t recv, void *priv) {
     struct utcp_connection *c = allocate_connection(utcp, 0, dst);
     if(!c)
@@ -657,25 +2407,22 @@ struct utcp_connection *utcp_connect(struct utcp *utcp, uint16_t dst, utcp_recv_
     c->recv = recv;
     c->priv = priv;
 
-    struct pkt_t *pkt = calloc(1, sizeof(struct pkt_t));
-    pkt->hdr.src = c->src;
-    pkt->hdr.dst = c->dst;
-    pkt->hdr.seq = c->snd.iss;
-    pkt->hdr.wnd = c->rcv.wnd;
-    pkt->hdr.ctl = SYN;
-
     set_state(c, SYN_SENT);
 
-    print_packet(utcp, "send", pkt, sizeof pkt->hdr);
-    if(!utcp_send_packet_or_queue(c, pkt, sizeof pkt->hdr)) {
+    // with fast open, the SYN waits for the first data, or else the next utcp_timeout()
+    if(utcp->fastopen) {
+        c->syn_queued = true;
+        start_connection_timer(c);
+        mark_ready(c);
+        return c;
+    }
+
+    if(!send_syn(c)) {
         debug("Error: utcp_connect failed to send SYN");
-        free(pkt);
         free_connection(c);
         return NULL;
     }
 
-    start_connection_timer(c);
-
     return c;
 }
 
@@ -692,6 +2439,120 @@ void utcp_accept(struct utcp_connection *c, utcp_recv_t recv, void *priv) {
     set_state(c, ESTABLISHED);
 }
 
+// Every segment tells the peer which out-of-order data we have, if it fits.
+static size_t segment_option_len(const struct utcp_connection *c) {
+    size_t optlen = ts_option_len(c) + sack_option_len(c);
+    return optlen < c->mtu ? optlen : 0;
+}
+
+static void write_options(const struct utcp_connection *c, char *opt, size_t len) {
+    size_t tslen = ts_option_len(c);
+    if(tslen && len >= tslen) {
+        write_ts_option(c, opt);
+        opt += tslen;
+        len -= tslen;
+    }
+    if(len)
+        write_sack_option(c, opt, len);
+}
+
+// Replace the full header of a packet by a compact one, if the connection negotiated it and it is shorter.
+// A pure ACK leaves out seq when nothing is in flight, the peer's rcv.nxt is then the same.
+// @return the new length of the packet
+static size_t compact_packet(const struct utcp_connection *c, struct pkt_t *pkt, size_t len) {
+    if(!(c->caps & CAP_COMPACT) || (pkt->hdr.ctl & SYN))
+        return len;
+
+    bool pure_ack = len == sizeof pkt->hdr + pkt->hdr.aux && !(pkt->hdr.ctl & (FIN | RST));
+    bool omit_seq = pure_ack && pkt->hdr.seq == c->snd.una && c->snd.nxt == c->snd.una;
+    uint8_t buf[MAX_COMPACT_HDR];
+    size_t hlen = write_compact_hdr(buf, &pkt->hdr, c->snd.iss, c->rcv.irs, omit_seq);
+    if(!hlen)
+        return len;
+
+    memmove((char *)pkt + hlen, pkt->data, len - sizeof pkt->hdr);
+    memcpy(pkt, buf, hlen);
+    return len - sizeof pkt->hdr + hlen;
+}
+
+// Build a segment with up to len bytes from the send buffer at seq, in a packet from the pool.
+// The options and data together fill at most mtu bytes. It stops at data the peer already has.
+// Sets seglen to the sequence space covered, and pktlen to the packet size.
+// @return the packet, or NULL when out of memory or the source could not be read
+static struct pkt_t *build_segment(struct utcp_connection *c, uint32_t seq, uint32_t len, size_t optlen, uint16_t ctl, uint32_t mtu, uint32_t *seglen, size_t *pktlen) {
+    struct pkt_t *pkt = pkt_pool_get(c->utcp);
+    if(!pkt)
+        return NULL;
+
+    pkt->hdr.src = c->src;
+    pkt->hdr.dst = c->dst;
+    pkt->hdr.seq = seq;
+    pkt->hdr.ack = c->rcv.nxt;
+    pkt->hdr.trs = c->snd.trs;
+    pkt->hdr.tra = c->rcv.trs;
+    pkt->hdr.wnd = advertise_window(c);
+    pkt->hdr.ctl = ctl;
+    pkt->hdr.aux = optlen;
+    if(optlen)
+        write_options(c, pkt->data, optlen);
+
+    // don't run into data the peer already has
+    uint32_t maxseg = mtu - optlen;
+    *seglen = len > maxseg ? maxseg : len;
+    uint32_t unsacked = unsacked_len(c, seq);
+    if(*seglen > unsacked)
+        *seglen = unsacked;
+
+    // adjust packet data length for the segment length
+    // when FIN is not ack'ed yet len must be at least 1
+    size_t datalen = *seglen;
+    if(*seglen && fin_wanted(c, seq + *seglen)) {
+        datalen--;
+        pkt->hdr.ctl |= FIN;
+    }
+
+    if(!copy_stream(c, pkt->data + optlen, seqdiff(seq, c->snd.una), datalen)) {
+        pkt_pool_put(c->utcp, pkt);
+        return NULL;
+    }
+    *pktlen = compact_packet(c, pkt, sizeof pkt->hdr + optlen + datalen);
+
+    return pkt;
+}
+
+// Whether to hold back a segment smaller than the maximum that would end at seq,
+// so the application can add more data to it first. See utcp_set_nodelay() and utcp_set_autocork().
+static bool hold_small(struct utcp_connection *c, uint32_t seq) {
+    if(c->nodelay || fin_wanted(c, seq))
+        return false;
+
+    // Nagle's algorithm with Minshall's modification: have at most one small segment in flight,
+    // so full-sized segments are never held back waiting for a delayed ACK
+    if(seqdiff(c->snd.small, c->snd.una) > 0 && seqdiff(c->snd.small, c->snd.nxt) <= 0)
+        return true;
+
+    // autocork: wait for the next ACK or the cork timer
+    if(c->cork_delay && !c->uncork) {
+        if(!timerisset(&c->cork_timeout))
+            start_cork_timer(c);
+        return true;
+    }
+
+    return false;
+}
+
+// Rate in bytes per second to send at when pacing, or 0 if unknown.
+// Without a rate from the congestion control algorithm, spread cwnd over the RTT,
+// a bit faster so cwnd can still grow.
+static uint64_t pacing_rate(const struct utcp_connection *c) {
+    uint64_t rate = c->cc->pacing_rate(c);
+    if(rate || !c->srtt)
+        return rate;
+
+    rate = (uint64_t)c->snd.cwnd * USEC_PER_SEC / c->srtt;
+    return c->snd.cwnd < c->snd.ssthresh ? rate * 2 : rate * 5 / 4;
+}
+
 static int ack(struct utcp_connection *c, bool sendatleastone) {
     if(sendatleastone) {
         c->sendatleastone = true;
@@ -702,11 +2563,18 @@ static int ack(struct utcp_connection *c, bool sendatleastone) {
         return UTCP_WOULDBLOCK;
     }
 
+    // don't send what the peer already has
+    c->snd.nxt = skip_sacked(c, c->snd.nxt);
+
     int32_t left = seqdiff(c->snd.last, c->snd.nxt);
     assert(left >= 0);
 
-    // limit by congestion window increased by utcp->mtu on each advance
-    int32_t cwndleft = c->snd.cwnd - seqdiff(c->snd.nxt, c->snd.una);
+    // data that did not fit on the SYN waits for it to be acknowledged, the sequence numbers are off by one until then
+    if(syn_unacked(c))
+        left = 0;
+
+    // limit by congestion window increased by the mtu on each advance
+    int32_t cwndleft = c->snd.cwnd - (seqdiff(c->snd.nxt, c->snd.una) - (int32_t)sacked_in_flight(c));
     debug("cwndleft = %d (of %d)\n", cwndleft, c->snd.cwnd);
 
     if(cwndleft <= 0)
@@ -714,119 +2582,239 @@ static int ack(struct utcp_connection *c, bool sendatleastone) {
     if(cwndleft < left)
         left = cwndleft;
 
-    // If we don't need to send an ACK...
-    if(!c->sendatleastone) {
-        // then don't if we don't have any new data,
-        if(!left)
-            return 0;
+    // and by the peer's receive window, SACKed data is buffered there as well
+    int32_t wndleft = max(c->snd.wnd, c->mtu) - seqdiff(c->snd.nxt, c->snd.una);
 
-        // and avoid sending small packets.
-        if(left < c->utcp->mtu && seqdiff(c->snd.last, c->snd.una) >= c->utcp->mtu)
-            return 0;
+    if(wndleft <= 0)
+        wndleft = 0;
+    if(wndleft < left)
+        left = wndleft;
+
+    // when only the congestion window is too short for a probe, hold back new data until enough is acknowledged
+    uint32_t probe = probe_mtu(c);
+    if(probe && (uint32_t)left < probe) {
+        if(left == cwndleft && c->snd.nxt != c->snd.una)
+            left = 0;
+        probe = 0;
+    }
+
+    // limit by the pacing rate, the rest is sent when the pacing timer expires
+    struct timeval now;
+    uint64_t rate = c->pacing && left ? pacing_rate(c) : 0;
+    bool paced = false;
+
+    if(rate) {
+        get_time(c->utcp, &now);
+        if(timercmp(&now, &c->pace_next, <)) {
+            left = 0;
+            start_pacing_timer(c);
+        } else {
+            // send at least two segments at once, and otherwise what the rate allows per clock tick
+            uint64_t burst = rate * CLOCK_GRANULARITY / USEC_PER_SEC;
+            if(burst < 2 * c->mtu)
+                burst = 2 * c->mtu;
+            if((uint64_t)left > burst) {
+                left = burst;
+                paced = true;
+            }
+        }
     }
 
-    struct pkt_t *pkt;
+    size_t optlen = segment_option_len(c);
+    uint32_t maxseg = c->mtu - optlen;
 
-    pkt = malloc(sizeof pkt->hdr + c->utcp->mtu);
-    if(!pkt) {
-        debug("Error: out of memory");
-        return UTCP_ERROR;
+    // when utcp_timeout() serves the connection, send only as many whole segments as the scheduler allows,
+    // paced connections are already limited by their rate
+    if(c->scheduled && left && !rate) {
+        uint32_t allowed = c->deficit > 0 ? (c->deficit + maxseg - 1) / maxseg * maxseg : 0;
+        if((uint32_t)left > allowed) {
+            left = allowed;
+            c->backlogged = true;
+        }
     }
 
-    pkt->hdr.src = c->src;
-    pkt->hdr.dst = c->dst;
-    pkt->hdr.ack = c->rcv.nxt;
-    pkt->hdr.trs = c->snd.trs;
-    pkt->hdr.tra = c->rcv.trs;
-    pkt->hdr.wnd = c->rcv.wnd;
-    pkt->hdr.ctl = c->rcv.ahead? ACK | RTR: ACK;
-    pkt->hdr.aux = 0;
+    // If we don't need to send an ACK...
+    if(!c->sendatleastone) {
+        // avoid sending a small packet at the end,
+        uint32_t tail = left % maxseg;
+        if(tail && hold_small(c, c->snd.nxt + left))
+            left -= tail;
+
+        // and don't if we don't have any new data.
+        if(!left)
+            return 0;
+    }
 
+    struct iovec batch[SEND_BATCH_SIZE];
+    uint32_t seqs[SEND_BATCH_SIZE];
+    uint32_t seglens[SEND_BATCH_SIZE];
+    uint16_t ctl = c->rcv.ahead? ACK | RTR: ACK;
     int err = 0;
+    uint32_t sent_bytes = 0;
+
     do {
-        uint32_t seglen = left > c->utcp->mtu ? c->utcp->mtu : left;
-        uint32_t bufpos = seqdiff(c->snd.nxt, c->snd.una);
-        pkt->hdr.seq = c->snd.nxt;
+        // build a train of segments, the first one may probe for a larger mtu
+        size_t n = 0;
+        size_t probe_at = SEND_BATCH_SIZE;
+        uint32_t seq = c->snd.nxt;
+
+        do {
+            uint32_t seglen;
+            size_t pktlen;
+            struct pkt_t *pkt = build_segment(c, seq, left, optlen, ctl, probe ? probe : c->mtu, &seglen, &pktlen);
+            if(!pkt) {
+                err = UTCP_ERROR;
+                break;
+            }
 
-        left -= seglen;
+            if(probe && optlen + seglen > c->mtu)
+                probe_at = n;
 
-        // adjust packet data length for the segment length
-        // when FIN is not ack'ed yet len must be at least 1
-        size_t datalen = seglen;
-        if(seglen && fin_wanted(c, c->snd.nxt + seglen)) {
-            datalen--;
-            pkt->hdr.ctl |= FIN;
-        }
+            batch[n].iov_base = pkt;
+            batch[n].iov_len = pktlen;
+            seqs[n] = seq;
+            seglens[n] = seglen;
 
-        buffer_copy(&c->sndbuf, pkt->data, bufpos, datalen);
+            left -= seglen;
+            seq += seglen;
+            n++;
 
-        size_t pktlen = sizeof pkt->hdr + datalen;
-        print_packet(c->utcp, "send", pkt, pktlen);
-        ssize_t sent = c->utcp->send(c->utcp, pkt, pktlen);
-        if(sent != pktlen) {
-            if(sent > pktlen) {
-                utcp_log_send_error(pkt, pktlen, sent, false);
-            }
-            else if(sent >= 0 || sent == UTCP_WOULDBLOCK) {
-                // when no data could be sent with possibly the header broken
-                // or when the socket would block, don't advance but retry later
-                utcp_log_send_error(pkt, pktlen, sent, false);
-                err = UTCP_WOULDBLOCK;
-                break;
+            print_packet(c->utcp, "send", pkt, batch[n - 1].iov_len);
+
+            probe = 0;
+
+            // continue after the next range the peer already has
+            uint32_t next = skip_sacked(c, seq);
+            if(next != seq) {
+                if(left > seqdiff(c->snd.last, next))
+                    left = seqdiff(c->snd.last, next);
+                seq = next;
             }
-            else {
-                // the pkt receiver might have gone offline causing the routing to fail
-                // break loop and hope to recover some time later
-                // it would only cause a retransmit when skipped
-                utcp_log_send_error(pkt, pktlen, sent, false);
-                err = UTCP_ERROR;
-                break;
+        } while(left && n < SEND_BATCH_SIZE);
+
+        // send it in one go if possible
+        // when no data could be sent with possibly the header broken
+        // or when the socket would block, don't advance but retry later
+        // when the pkt receiver might have gone offline causing the routing to fail,
+        // stop and hope to recover some time later, it would only cause a retransmit when skipped
+        int senderr = 0;
+        size_t sent = n ? utcp_send_packets(c->utcp, batch, n, &senderr) : 0;
+        if(senderr)
+            err = senderr;
+
+        // a probe the datagram layer refused is as good as lost
+        if(probe_at < n) {
+            c->probe_size = optlen + seglens[probe_at];
+            c->probe_seq = seqs[probe_at];
+            c->probe_end = seqs[probe_at] + seglens[probe_at];
+            debug("%p probing mtu %u\n", c, c->probe_size);
+            if(probe_at >= sent) {
+                if(senderr == UTCP_ERROR && probe_at == sent)
+                    probe_lost(c);
+                else
+                    c->probe_size = 0;
             }
         }
 
-        // if anything sent, andvance
-        c->snd.nxt += seglen;
-        c->sendatleastone = false;
+        for(size_t i = 0; i < sent; i++) {
+            uint32_t seglen = seglens[i];
+            sent_bytes += seglen;
+
+            bool resent = seglen && seqdiff(seqs[i], c->snd.max) < 0;
+            packet_sent(c->utcp, c, batch[i].iov_base, batch[i].iov_len, seglen, resent);
+            if(seqdiff(seqs[i] + seglen, c->snd.max) > 0)
+                c->snd.max = seqs[i] + seglen;
+
+            // if anything sent, andvance, possibly past data the peer already has
+            c->snd.nxt = skip_sacked(c, seqs[i] + seglen);
+            c->sendatleastone = false;
+
+            // don't report back an ahead packet twice
+            c->rcv.ahead = false;
+            ack_sent(c);
+
+            // remember the last small segment for Nagle's algorithm
+            if(seglen && seglen < maxseg) {
+                c->snd.small = seqs[i] + seglen;
+                c->uncork = false;
+                if(timerisset(&c->cork_timeout))
+                    stop_cork_timer(c);
+            }
 
-        // don't report back an ahead packet twice
-        c->rcv.ahead = false;
+            // on outgoing progess, initialize the timers if not already
+            if(seglen > 0) {
+                if(!timerisset(&c->rtrx_timeout))
+                    start_retransmit_timer(c);
+                if(!timerisset(&c->conn_timeout))
+                    start_connection_timer(c);
+            }
 
-        // on outgoing progess, initialize the timers if not already
-        if(seglen > 0) {
-            if(!timerisset(&c->rtrx_timeout))
-                start_retransmit_timer(c);
-            if(!timerisset(&c->conn_timeout))
-                start_connection_timer(c);
+            // on successful send of new data, start the RTT measurement if none already in progress,
+            // the ACK for data that is sent again doesn't tell which copy arrived (Karn's algorithm)
+            if(resent && c->rtt_start.tv_sec && seqdiff(seqs[i], c->rtt_seq) < 0)
+                c->rtt_start.tv_sec = 0;
+            else if(seglen && !resent && !c->rtt_start.tv_sec && !(c->caps & CAP_TS)) {
+                get_time(c->utcp, &c->rtt_start);
+                c->rtt_seq = seqs[i] + seglen;
+                debug("Starting RTT measurement, expecting ack %u\n", c->rtt_seq);
+            }
         }
 
-        // on successful send, start the RTT measurement if none already in progress
-        if(!c->rtt_start.tv_sec) {
-            gettimeofday(&c->rtt_start, NULL);
-            c->rtt_seq = pkt->hdr.seq + seglen;
-            debug("Starting RTT measurement, expecting ack %u\n", c->rtt_seq);
+        // give the buffers back to the pool, unsent segments are rebuilt from the send buffer later
+        for(size_t i = 0; i < n; i++)
+            pkt_pool_put(c->utcp, batch[i].iov_base);
+    } while(left && !err);
+
+    if(c->scheduled)
+        c->deficit -= sent_bytes;
+
+    if(rate && sent_bytes) {
+        // The next burst may go when this one would have been sent at the pacing rate.
+        // Allow the timer to be late by one clock tick without lowering the rate.
+        struct timeval late;
+        timersub(&now, &c->pace_next, &late);
+        if(late.tv_sec || late.tv_usec > CLOCK_GRANULARITY)
+            c->pace_next = now;
+
+        c->pace_next.tv_usec += sent_bytes * USEC_PER_SEC / rate;
+        while(c->pace_next.tv_usec >= USEC_PER_SEC) {
+            c->pace_next.tv_usec -= USEC_PER_SEC;
+            c->pace_next.tv_sec++;
         }
 
-    } while(left);
+        if(paced)
+            start_pacing_timer(c);
+    }
+
+    // retry from utcp_timeout()
+    if(err)
+        mark_ready(c);
 
-    free(pkt);
     return err;
 }
 
-ssize_t utcp_buffer(struct utcp_connection *c, const void *data, size_t len) {
+// Check whether new data may be added to the send buffer, setting errno if not.
+static bool is_writable(struct utcp_connection *c) {
     if(c->reapable) {
-        debug("Error: utcp_buffer() called on closed connection %p\n", c);
+        debug("Error: writing on closed connection %p\n", c);
         errno = EBADF;
-        return UTCP_ERROR;
+        return false;
     }
 
     switch(c->state) {
     case CLOSED:
     case LISTEN:
-    case SYN_SENT:
     case SYN_RECEIVED:
-        debug("Error: utcp_buffer() called on unconnected connection %p\n", c);
+        debug("Error: writing on unconnected connection %p\n", c);
         errno = ENOTCONN;
-        return UTCP_ERROR;
+        return false;
+    case SYN_SENT:
+        // queued until the connection is established, or carried on the SYN with fast open
+        if(c->syn_fin) {
+            errno = EPIPE;
+            return false;
+        }
+        break;
     case ESTABLISHED:
     case CLOSE_WAIT:
         break;
@@ -835,11 +2823,26 @@ ssize_t utcp_buffer(struct utcp_connection *c, const void *data, size_t len) {
     case CLOSING:
     case LAST_ACK:
     case TIME_WAIT:
-        debug("Error: utcp_buffer() called on closing connection %p\n", c);
+        debug("Error: writing on closing connection %p\n", c);
         errno = EPIPE;
-        return UTCP_ERROR;
+        return false;
     }
 
+    return true;
+}
+
+// Send new data from the send buffer, with fast open the SYN takes the first segment.
+static void send_buffered(struct utcp_connection *c) {
+    if(c->syn_queued)
+        send_syn(c);
+    else
+        ack(c, false);
+}
+
+ssize_t utcp_buffer(struct utcp_connection *c, const void *data, size_t len) {
+    if(!is_writable(c))
+        return UTCP_ERROR;
+
     if(!len)
         return 0;
 
@@ -849,7 +2852,7 @@ ssize_t utcp_buffer(struct utcp_connection *c, const void *data, size_t len) {
     }
 
     // attempt to add the new data to the send buffer
-    ssize_t buffered = buffer_put(&c->sndbuf, data, len);
+    ssize_t buffered = chunk_buffer_put(&c->sndbuf, data, min(len, sndbuf_free(c)));
     if(buffered <= 0) {
         errno = EWOULDBLOCK;
         return UTCP_WOULDBLOCK;
@@ -858,17 +2861,176 @@ ssize_t utcp_buffer(struct utcp_connection *c, const void *data, size_t len) {
     // advance upper send buffer position to be sent
     c->snd.last += buffered;
 
+    // the reserved space now holds this data
+    c->snd_reserved = 0;
+
     return buffered;
 }
 
+ssize_t utcp_send_reserve(struct utcp_connection *c, struct iovec *iov, size_t len) {
+    if(!is_writable(c))
+        return UTCP_ERROR;
+
+    c->snd_reserved = 0;
+
+    if(!len)
+        return 0;
+
+    if(!iov) {
+        errno = EFAULT;
+        return UTCP_ERROR;
+    }
+
+    ssize_t n = chunk_buffer_reserve(&c->sndbuf, iov, min(len, sndbuf_free(c)));
+    if(n < 0) {
+        errno = ENOMEM;
+        return UTCP_ERROR;
+    }
+    if(!n) {
+        errno = EWOULDBLOCK;
+        return UTCP_WOULDBLOCK;
+    }
+
+    c->snd_reserved = iov[0].iov_len + (n > 1 ? iov[1].iov_len : 0);
+    return n;
+}
+
+ssize_t utcp_send_commit(struct utcp_connection *c, size_t len) {
+    if(!is_writable(c))
+        return UTCP_ERROR;
+
+    if(len > c->snd_reserved) {
+        debug("Error: committing %lu bytes, only %lu reserved\n", (unsigned long)len, (unsigned long)c->snd_reserved);
+        errno = EINVAL;
+        return UTCP_ERROR;
+    }
+
+    c->snd_reserved = 0;
+
+    if(!len)
+        return 0;
+
+    size_t committed = chunk_buffer_commit(&c->sndbuf, len);
+    c->snd.last += committed;
+
+    send_buffered(c);
+
+    return committed;
+}
+
 ssize_t utcp_send(struct utcp_connection *c, const void *data, size_t len) {
     // attempt to add the new data to the send buffer
     ssize_t buffered = utcp_buffer(c, data, len);
 
     // attempt to send the buffered data
-    ack(c, false);
+    if(buffered > 0)
+        send_buffered(c);
+    else
+        ack(c, false);
+
+    return buffered;
+}
+
+ssize_t utcp_send_source(struct utcp_connection *c, utcp_read_at_t read_at, uint64_t offset, size_t len) {
+    if(!is_writable(c))
+        return UTCP_ERROR;
+
+    if(!len)
+        return 0;
+
+    if(!read_at) {
+        errno = EFAULT;
+        return UTCP_ERROR;
+    }
+
+    if(c->read_at) {
+        errno = EWOULDBLOCK;
+        return UTCP_WOULDBLOCK;
+    }
+
+    // keep the stream well within the sequence number space
+    if(len > MAX_SOURCE_LEN)
+        len = MAX_SOURCE_LEN;
+
+    c->read_at = read_at;
+    c->source_pos = offset;
+    c->source_left = len;
+    c->snd.last += len;
+    c->snd_reserved = 0;
+
+    send_buffered(c);
+
+    return len;
+}
+
+#ifndef _WIN32
+static ssize_t read_file(struct utcp_connection *c, void *data, size_t len, uint64_t offset) {
+    return pread(c->source_fd, data, len, offset);
+}
+
+ssize_t utcp_send_file(struct utcp_connection *c, int fd, uint64_t offset, size_t len) {
+    if(!is_writable(c))
+        return UTCP_ERROR;
+
+    if(c->read_at) {
+        errno = EWOULDBLOCK;
+        return UTCP_WOULDBLOCK;
+    }
+
+    c->source_fd = fd;
+    return utcp_send_source(c, read_file, offset, len);
+}
+#endif
+
+ssize_t utcp_read(struct utcp_connection *c, void *data, size_t len) {
+    if(!c) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(c->reapable) {
+        debug("Error: read() called on closed connection %p\n", c);
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!c->pull) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!c->rcv_ready) {
+        switch(c->state) {
+        case CLOSE_WAIT:
+        case CLOSING:
+        case LAST_ACK:
+        case TIME_WAIT:
+        case CLOSED:
+            return 0;
+        default:
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    len = buffer_get(&c->rcvbuf, data, min(len, c->rcv_ready));
+    c->rcv_ready -= len;
+
+    // Send a window update once a quarter of the buffer has been freed, the window the peer knows of may be closed
+    switch(c->state) {
+    case ESTABLISHED:
+    case FIN_WAIT_1:
+    case FIN_WAIT_2:
+        if(seqdiff(c->rcv.nxt + rcv_window(c), c->rcv_adv) >= (int32_t)max(c->rcvbuf.maxsize / 4, 1)) {
+            debug("%p window update\n", c);
+            ack(c, true);
+        }
+        break;
+    default:
+        break;
+    }
 
-    return buffered;
+    return len;
 }
 
 static void swap_ports(struct hdr *hdr) {
@@ -878,8 +3040,7 @@ static void swap_ports(struct hdr *hdr) {
 }
 
 static bool send_meta(struct utcp_connection *c, uint32_t seq, uint32_t ack, uint16_t flags) {
-    struct pkt_t *pkt;
-    pkt = malloc(sizeof pkt->hdr + c->utcp->mtu);
+    struct pkt_t *pkt = pkt_pool_get(c->utcp);
     if(!pkt)
         return false;
 
@@ -887,22 +3048,44 @@ static bool send_meta(struct utcp_connection *c, uint32_t seq, uint32_t ack, uin
     pkt->hdr.dst = c->dst;
     pkt->hdr.trs = c->snd.trs;
     pkt->hdr.tra = c->rcv.trs;
-    pkt->hdr.wnd = c->rcv.wnd;
-    pkt->hdr.aux = 0;
+    pkt->hdr.wnd = advertise_window(c);
+    // offer our capabilities in a SYN, and answer with the negotiated ones
+    pkt->hdr.aux = flags & SYN ? (flags & ACK ? c->caps : c->utcp->caps) : 0;
     pkt->hdr.seq = seq;
     pkt->hdr.ack = ack;
     pkt->hdr.ctl = flags;
 
-    print_packet(c->utcp, "send_meta", pkt, sizeof pkt->hdr);
-    if(!utcp_send_packet(c->utcp, pkt, sizeof pkt->hdr)) {
+    size_t len = compact_packet(c, pkt, sizeof pkt->hdr);
+    print_packet(c->utcp, "send_meta", pkt, len);
+    packet_sent(c->utcp, c, pkt, len, 0, flags & SYN);
+    if(!utcp_send_packet(c->utcp, pkt, len)) {
         debug("Error: send_meta failed to send %u", flags);
-        free(pkt);
+        pkt_pool_put(c->utcp, pkt);
         return false;
     }
-    free(pkt);
+    pkt_pool_put(c->utcp, pkt);
     return true;
 }
 
+// Don't let the congestion window be larger than either our or the receiver's buffer, or cwnd_max.
+static void limit_cwnd(struct utcp_connection *c) {
+    // Never more than the peer's window, but keep room for one segment to probe it
+    uint32_t wnd = max(c->snd.wnd, c->mtu);
+    if(c->snd.cwnd > wnd)
+        c->snd.cwnd = wnd;
+    if(c->cwnd_max > 0 && c->snd.cwnd > c->cwnd_max)
+        c->snd.cwnd = c->cwnd_max;
+
+    // Let the send buffer grow along with cwnd, so the application can stay a window ahead of the sender
+    if(!c->sndbuf_locked && c->sndbuf.maxsize < c->utcp->sndbuf_max && c->snd.cwnd > c->sndbuf.maxsize / 2 && !mem_pressure(c->utcp)) {
+        c->sndbuf.maxsize = min(2 * (size_t)c->snd.cwnd, c->utcp->sndbuf_max);
+        debug("%p sndbuf grown to %u\n", c, c->sndbuf.maxsize);
+    }
+
+    if(c->snd.cwnd > c->sndbuf.maxsize)
+        c->snd.cwnd = c->sndbuf.maxsize;
+}
+
 static bool retransmit(struct utcp_connection *c) {
     if(c->state == CLOSED || c->snd.last == c->snd.una) {
         debug("Retransmit() called but nothing to retransmit!\n");
@@ -910,16 +3093,20 @@ static bool retransmit(struct utcp_connection *c) {
         return true;
     }
     debug("retransmit() called\n.");
-
-    struct utcp *utcp = c->utcp;
+    trace_event(c, UTCP_TRACE_TIMEOUT, c->rto);
+    c->stats.timeouts++;
+    c->utcp->stats.timeouts++;
 
     // increment transmit number
     ++c->snd.trs;
 
-    switch(c->state) {
+    // the SYNACK of a fast open connection carries the first data, send all of it again
+    enum state state = c->synack_unacked ? SYN_SENT : c->state;
+
+    switch(state) {
         case SYN_SENT:
             // Send our SYN again
-            if(!send_meta(c, c->snd.iss, 0, SYN)) {
+            if(!send_syn(c)) {
                 debug("Error: retransmit failed to send SYN");
                 return false;
             }
@@ -941,11 +3128,13 @@ static bool retransmit(struct utcp_connection *c) {
             // reset seqno for the next packet to send
             c->snd.nxt = c->snd.una;
 
-            // reduce congestion window and slow start threshold
-            c->snd.ssthresh = max(c->snd.cwnd / 2, 2 * c->utcp->mtu);
-            c->snd.cwnd = utcp->mtu;
-            if( c->cwnd_max > 0 && c->snd.cwnd > c->cwnd_max )
-                c->snd.cwnd = c->cwnd_max;
+            if(in_probe(c, c->snd.una))
+                probe_lost(c);
+            detect_black_hole(c);
+
+            // reduce congestion window
+            c->cc->on_rto(c);
+            limit_cwnd(c);
             break;
 
         case CLOSED:
@@ -959,9 +3148,14 @@ static bool retransmit(struct utcp_connection *c) {
             return false;
     }
 
-    utcp->rto *= 2;
-    if(utcp->rto > MAX_RTO)
-        utcp->rto = MAX_RTO;
+    // a timeout ends fast recovery, everything after snd.una is sent again
+    c->fast_recovery = false;
+    c->dupack = 0;
+
+    // only this connection backs off, the others to the same peer are not affected
+    c->rto *= 2;
+    if(c->rto > MAX_RTO)
+        c->rto = MAX_RTO;
     c->rtt_start.tv_sec = 0; // invalidate RTT timer
 
     start_retransmit_timer(c);
@@ -969,119 +3163,422 @@ static bool retransmit(struct utcp_connection *c) {
     return true;
 }
 
-/* Update receive buffer and SACK entries after consuming data.
- *
- * Situation:
- *
- * |.....0000..1111111111.....22222......3333|
- * |---------------^
- *
- * 0..3 represent the SACK entries. The ^ indicates up to which point we want
- * to remove data from the receive buffer. The idea is to substract "len"
- * from the offset of all the SACK entries, and then remove/cut down entries
- * that are shifted to before the start of the receive buffer.
- *
- * There are three cases:
- * - the SACK entry is after ^, in that case just change the offset.
- * - the SACK entry starts before and ends after ^, so we have to
- *   change both its offset and size.
- * - the SACK entry is completely before ^, in that case delete it.
- */
-static void sack_consume(struct utcp_connection *c, size_t len) {
-    debug("sack_consume %lu\n", (unsigned long)len);
+// Send the segment at snd.una again, without going back with snd.nxt. See RFC 6582.
+static void fast_retransmit(struct utcp_connection *c) {
+    int32_t len = seqdiff(c->snd.last, c->snd.una);
+    if(len <= 0 || c->snd.nxt == c->snd.una)
+        return;
 
-    buffer_get(&c->rcvbuf, NULL, len);
+    // sending the probe again means it was lost
+    if(in_probe(c, c->snd.una))
+        probe_lost(c);
 
-    for(int i = 0; i < NSACKS && c->sacks[i].len; ) {
-        if(len < c->sacks[i].offset) {
-            c->sacks[i].offset -= len;
-            i++;
-        } else if(len < c->sacks[i].offset + c->sacks[i].len) {
-            c->sacks[i].len -= len - c->sacks[i].offset;
-            c->sacks[i].offset = 0;
-            i++;
-        } else {
-            if(i < NSACKS - 1) {
-                // move remaining sacks one ahead
-                memmove(&c->sacks[i], &c->sacks[i + 1], ((NSACKS - 1) - i) * sizeof c->sacks[i]);
-                // clean last sack len
-                c->sacks[NSACKS - 1].len = 0;
-            } else {
-                c->sacks[i].len = 0;
-                break;
-            }
+    uint32_t seglen;
+    size_t pktlen;
+    struct pkt_t *pkt = build_segment(c, c->snd.una, len, segment_option_len(c), c->rcv.ahead ? ACK | RTR : ACK, c->mtu, &seglen, &pktlen);
+    if(!pkt)
+        return;
+
+    print_packet(c->utcp, "rtrx", pkt, pktlen);
+    packet_sent(c->utcp, c, pkt, pktlen, seglen, true);
+
+    if(!utcp_send_packet_or_queue(c, pkt, pktlen)) {
+        pkt_pool_put(c->utcp, pkt);
+        return;
+    }
+
+    ack_sent(c);
+
+    if(seqdiff(c->snd.nxt, c->snd.una + seglen) < 0)
+        c->snd.nxt = c->snd.una + seglen;
+
+    // The ACK for it doesn't tell which copy arrived, and holds back the ACK for whatever is timed behind it,
+    // so it can't be used for an RTT sample
+    if(c->rtt_start.tv_sec && seqdiff(c->snd.una, c->rtt_seq) < 0)
+        c->rtt_start.tv_sec = 0;
+}
+
+// Whether the ACK that filled the hole fast recovery started with was for the original segment, not our retransmission.
+// With timestamps it echoes when the copy it acknowledges was sent, see RFC 3522.
+// Otherwise, an ACK that comes back much faster than any RTT measured so far can't be for the retransmission,
+// but only if that difference is well above the clock granularity.
+static bool spurious_retransmit(const struct utcp_connection *c, const struct options *opts, const struct timeval *now) {
+    if((c->caps & CAP_TS) && opts->ts)
+        return opts->ts_ecr && seqdiff(opts->ts_ecr, timestamp(&c->rtx_stamp)) < 0;
+
+    struct timeval diff;
+    timersub(now, &c->rtx_stamp, &diff);
+    return c->rtt_min / 2 > CLOCK_GRANULARITY && !diff.tv_sec && (uint32_t)diff.tv_usec + CLOCK_GRANULARITY < c->rtt_min / 2;
+}
+
+// Fast recovery was started by reordering, reordered segments were ahead of the hole when it was filled.
+// Take the reduction back, and wait for more duplicate ACKs from now on. See RFC 4015.
+static void undo_recovery(struct utcp_connection *c, uint32_t reordered) {
+    debug("Spurious fast retransmit, %u segments were reordered\n", reordered);
+    c->fast_recovery = false;
+    c->snd.cwnd = c->undo_cwnd;
+    c->snd.ssthresh = c->undo_ssthresh;
+    c->cc->on_undo(c);
+    limit_cwnd(c);
+
+    if(reordered >= MAX_REORDERING)
+        reordered = MAX_REORDERING - 1;
+    if(reordered >= c->reordering)
+        c->reordering = reordered + 1;
+}
+
+// Send the holes below the highest byte the peer has again during fast recovery with SACK,
+// as far as the congestion window allows, so all losses in a window are repaired in one RTT.
+// See RFC 6675. With force set at least one segment is sent, to start the repair.
+static void sack_retransmit(struct utcp_connection *c, bool force) {
+    uint32_t high = sacked_high(c);
+    if(seqdiff(c->rtx_next, c->snd.una) < 0)
+        c->rtx_next = c->snd.una;
+
+    int32_t pipe = recovery_pipe(c);
+    size_t optlen = segment_option_len(c);
+    bool sent = false;
+
+    for(uint32_t seq = skip_sacked(c, c->rtx_next); seqdiff(seq, high) < 0; seq = skip_sacked(c, c->rtx_next)) {
+        if(!force && pipe + (int32_t)c->mtu > (int32_t)c->snd.cwnd)
+            break;
+        force = false;
+
+        // sending part of the probe again means it was lost
+        if(in_probe(c, seq))
+            probe_lost(c);
+
+        uint32_t seglen;
+        size_t pktlen;
+        struct pkt_t *pkt = build_segment(c, seq, seqdiff(high, seq), optlen, c->rcv.ahead ? ACK | RTR : ACK, c->mtu, &seglen, &pktlen);
+        if(!pkt)
+            break;
+
+        print_packet(c->utcp, "rtrx", pkt, pktlen);
+        packet_sent(c->utcp, c, pkt, pktlen, seglen, true);
+
+        if(!utcp_send_packet_or_queue(c, pkt, pktlen)) {
+            pkt_pool_put(c->utcp, pkt);
+            break;
+        }
+
+        sent = true;
+        pipe += seglen;
+        c->rtx_next = seq + seglen;
+
+        if(c->rtt_start.tv_sec && seqdiff(seq, c->rtt_seq) < 0)
+            c->rtt_start.tv_sec = 0;
+    }
+
+    if(sent)
+        ack_sent(c);
+}
+
+// Send the data of a lost probe again in segments that fit, without taking the loss as congestion
+static void retransmit_probe(struct utcp_connection *c) {
+    uint32_t end = c->probe_end;
+    probe_lost(c);
+
+    uint32_t seglen;
+    for(uint32_t seq = skip_sacked(c, c->snd.una); seqdiff(end, seq) > 0; seq = skip_sacked(c, seq + seglen)) {
+        size_t pktlen;
+        struct pkt_t *pkt = build_segment(c, seq, seqdiff(end, seq), segment_option_len(c), c->rcv.ahead ? ACK | RTR : ACK, c->mtu, &seglen, &pktlen);
+        if(!pkt)
+            return;
+
+        print_packet(c->utcp, "rtrx", pkt, pktlen);
+        packet_sent(c->utcp, c, pkt, pktlen, seglen, true);
+
+        if(!utcp_send_packet_or_queue(c, pkt, pktlen)) {
+            pkt_pool_put(c->utcp, pkt);
+            return;
         }
     }
 
-    for(int i = 0; i < NSACKS && c->sacks[i].len; i++)
-        debug("SACK[%d] offset %u len %u\n", i, c->sacks[i].offset, c->sacks[i].len);
+    ack_sent(c);
+
+    if(c->rtt_start.tv_sec && seqdiff(c->snd.una, c->rtt_seq) < 0)
+        c->rtt_start.tv_sec = 0;
+}
+
+// Remove len bytes from the start of the receive buffer, the SACK entries move along with it.
+static void sack_consume(struct utcp_connection *c, size_t len) {
+    debug("sack_consume %lu\n", (unsigned long)len);
+
+    buffer_get(&c->rcvbuf, NULL, len);
+    range_set_consume(&c->sacks, len);
+    debug("%u SACK entries left\n", c->sacks.count);
 }
 
 static size_t buffer_consumable(struct utcp_connection *c, size_t bufferOffset) {
     // Check if we can process out-of-order data now.
-    if(c->sacks[0].len && bufferOffset >= c->sacks[0].offset) {
-        // compute consumable end size
-        size_t consumable = bufferOffset;
-        for(int i = 0; i < NSACKS && c->sacks[i].len && c->sacks[i].offset <= consumable; i++)
-            consumable = max(consumable, c->sacks[i].offset + c->sacks[i].len);
-        return consumable - bufferOffset;
-    }
+    // Ranges that touch are merged, so only the first one can continue the data at bufferOffset.
+    struct sack first;
+    if(range_set_get(&c->sacks, &first, 1) && bufferOffset >= first.offset)
+        return max(bufferOffset, first.offset + first.len) - bufferOffset;
     return 0;
 }
 
+// Grow the receive window when the peer fills more than half of it every round trip,
+// so the window does not limit the throughput (dynamic right-sizing).
+static void rcvbuf_autotune(struct utcp_connection *c) {
+    struct timeval now, diff;
+    get_time(c->utcp, &now);
+
+    // The receiver often has no RTT estimate of its own, use the time it takes to receive a window of data instead
+    if(!timerisset(&c->rcv_rtt_time) || seqdiff(c->rcv.nxt, c->rcv_rtt_seq) >= 0) {
+        if(timerisset(&c->rcv_rtt_time)) {
+            timersub(&now, &c->rcv_rtt_time, &diff);
+            uint32_t sample = diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+
+            if(!c->rcv_rtt || sample < c->rcv_rtt)
+                c->rcv_rtt = sample;
+            else
+                c->rcv_rtt = (c->rcv_rtt * 7 + sample) / 8;
+        }
+
+        c->rcv_rtt_time = now;
+        c->rcv_rtt_seq = c->rcv.nxt + c->rcv.wnd;
+    }
+
+    uint32_t rtt = c->rcv_rtt ? c->rcv_rtt : c->srtt;
+
+    if(!timerisset(&c->rcv_space_time)) {
+        c->rcv_space_time = now;
+        c->rcv_space_seq = c->rcv.nxt;
+        return;
+    }
+
+    timersub(&now, &c->rcv_space_time, &diff);
+
+    if(!rtt || diff.tv_sec * USEC_PER_SEC + diff.tv_usec < rtt)
+        return;
+
+    uint32_t copied = c->rcv.nxt - c->rcv_space_seq;
+    c->rcv_space_time = now;
+    c->rcv_space_seq = c->rcv.nxt;
+
+    if(c->rcvbuf_locked || copied <= c->rcvbuf.maxsize / 2 || c->rcvbuf.maxsize >= c->utcp->rcvbuf_max || mem_pressure(c->utcp))
+        return;
+
+    c->rcvbuf.maxsize = min(2 * (size_t)copied, c->utcp->rcvbuf_max);
+    c->rcv.wnd = c->rcvbuf.maxsize;
+    debug("%p rcvbuf grown to %u\n", c, c->rcvbuf.maxsize);
+}
+
 static void handle_out_of_order(struct utcp_connection *c, uint32_t offset, const void *data, size_t len) {
     debug("out of order packet, offset %u\n", offset);
 
     // drop packets that are ahead of max buffer size
-    if(offset >= c->rcvbuf.maxsize) {
+    if(c->rcv_ready + offset >= c->rcvbuf.maxsize) {
         debug("warning: packet offset %u ahead of max buffer size %u\n", offset, c->rcvbuf.maxsize);
         return;
     }
 
-    // Packet loss or reordering occurred. Store the data in the buffer.
-    ssize_t rxd = buffer_put_at(&c->rcvbuf, offset, data, len);
+    // Packet loss or reordering occurred. Store the data in the buffer, after what waits for utcp_read().
+    ssize_t rxd = buffer_put_at(&c->rcvbuf, c->rcv_ready + offset, data, len);
 
-    // Make note of where we put it.
-    for(int i = 0; i < NSACKS; i++) {
-        if(!c->sacks[i].len) { // nothing to merge, add new entry
-            debug("New SACK entry %d\n", i);
-            c->sacks[i].offset = offset;
-            c->sacks[i].len = rxd;
-            break;
-        } else if(offset < c->sacks[i].offset) {
-            if(offset + rxd < c->sacks[i].offset) { // insert before
-                if(!c->sacks[NSACKS - 1].len) { // only if room left
-                    debug("Insert SACK entry at %d\n", i);
-                    memmove(&c->sacks[i + 1], &c->sacks[i], (NSACKS - i - 1) * sizeof c->sacks[i]);
-                    c->sacks[i].offset = offset;
-                    c->sacks[i].len = rxd;
-                } else {
-                    debug("SACK entries full, dropping packet\n");
-                }
-                break;
-            } else { // merge
-                debug("Merge with start of SACK entry at %d\n", i);
-                c->sacks[i].offset = offset;
-                break;
-            }
-        } else if(offset <= c->sacks[i].offset + c->sacks[i].len) {
-            if(offset + rxd > c->sacks[i].offset + c->sacks[i].len) { // merge
-                debug("Merge with end of SACK entry at %d\n", i);
-                c->sacks[i].len = offset + rxd - c->sacks[i].offset;
-                // TODO: handle potential merge with next entry
-            }
-            break;
+    if(rxd < 0 && !c->rcvbuf_locked) {
+        // Out of memory, shrink the window to what we managed to allocate so far
+        c->rcvbuf.maxsize = max(c->rcvbuf.size, c->utcp->mtu);
+        c->rcv.wnd = c->rcvbuf.maxsize;
+        debug("%p rcvbuf shrunk to %u\n", c, c->rcvbuf.maxsize);
+    }
+
+    if(rxd <= 0)
+        return;
+
+    // Make note of where we put it, merging it with all entries it overlaps or touches.
+    if(!range_set_add(&c->sacks, offset, rxd)) {
+        debug("SACK entries full, dropping packet\n");
+        return;
+    }
+
+    c->rcv_recent = c->rcv.nxt + offset;
+
+    debug("%u SACK entries\n", c->sacks.count);
+}
+
+// Pass data to the application, using the vectored callback if there is one.
+// Without data, this tells the application the stream ended.
+static void deliver(struct utcp_connection *c, const struct iovec *iov, size_t iovcnt) {
+    if(c->pull && iovcnt) {
+        // the application may have read it all by now
+        if(c->recv && c->rcv_ready)
+            c->recv(c, NULL, c->rcv_ready);
+        return;
+    }
+
+    if(c->recv_iov) {
+        c->recv_iov(c, iovcnt ? iov : NULL, iovcnt);
+        return;
+    }
+
+    if(!iovcnt) {
+        if(c->recv)
+            c->recv(c, NULL, 0);
+        return;
+    }
+
+    // the callback may close the connection halfway
+    for(size_t i = 0; i < iovcnt && c->recv; i++)
+        if(iov[i].iov_len)
+            c->recv(c, iov[i].iov_base, iov[i].iov_len);
+}
+
+// During utcp_recv_batch(), remember what to pass to the recv callback until the whole batch is processed.
+static void defer_recv(struct utcp_connection *c, const void *data, size_t len, int error) {
+    struct utcp *utcp = c->utcp;
+
+    if(utcp->ndeferred >= utcp->ndeferred_allocated) {
+        size_t nallocated = utcp->ndeferred_allocated ? utcp->ndeferred_allocated * 2 : 32;
+        struct deferred_recv *new_array = realloc(utcp->deferred, nallocated * sizeof *utcp->deferred);
+        if(!new_array) {
+            // deliver it immediately rather than losing the data
+            debug("Error: out of memory, delivering data immediately\n");
+            struct iovec iov = {(void *)data, len};
+            errno = error;
+            deliver(c, &iov, len ? 1 : 0);
+            return;
+        }
+        utcp->deferred = new_array;
+        utcp->ndeferred_allocated = nallocated;
+    }
+
+    struct deferred_recv *d = &utcp->deferred[utcp->ndeferred++];
+    d->c = c;
+    d->data = data;
+    d->len = len;
+    d->error = error;
+}
+
+static void deliver_deferred(struct deferred_recv *d) {
+    if(!d->c)
+        return;
+
+    struct iovec iov = {(void *)d->data, d->len};
+    errno = d->error;
+    deliver(d->c, &iov, d->len ? 1 : 0);
+    d->c = NULL;
+}
+
+// Pass in-order data to the application.
+// The first element is the packet payload, the others point into the receive buffer.
+static void handle_in_order(struct utcp_connection *c, const struct iovec *iov, size_t iovcnt) {
+    struct utcp *utcp = c->utcp;
+
+    if(utcp->batching) {
+        if(iovcnt == 1) {
+            defer_recv(c, iov[0].iov_base, iov[0].iov_len, 0);
+            return;
         }
+
+        // later packets in the batch may overwrite the consumed part of the receive buffer,
+        // so deliver it right away, after what is still pending for this connection
+        for(size_t i = 0; i < utcp->ndeferred; i++)
+            if(utcp->deferred[i].c == c)
+                deliver_deferred(&utcp->deferred[i]);
+    }
+
+    deliver(c, iov, iovcnt);
+}
+
+// Tell the application the stream ended, with error set to the reason or 0 if the peer closed it.
+static void handle_closed(struct utcp_connection *c, int error) {
+    if(c->utcp->batching) {
+        defer_recv(c, NULL, 0, error);
+        return;
+    }
+
+    errno = error;
+    deliver(c, NULL, 0);
+}
+
+// Send an ACK now, or once at the end of the batch when called from utcp_recv_batch().
+// Whether the ACK for a received packet can wait, see utcp_set_delayed_ack()
+static bool delay_ack(struct utcp_connection *c, const struct hdr *hdr, size_t len, int32_t rcv_offset, bool filled_hole) {
+    // out-of-order data, retransmissions and filled holes tell the sender about loss, SYN and FIN change state
+    if(rcv_offset || filled_hole || (hdr->ctl & (SYN | FIN)))
+        return false;
+
+    // a short segment is probably the last one for a while
+    if(hdr->aux + len < c->utcp->mtu)
+        return false;
+
+    return ++c->delack_count < c->ack_every;
+}
+
+static void ack_or_defer(struct utcp_connection *c, bool sendatleastone) {
+    struct utcp *utcp = c->utcp;
+
+    if(!utcp->batching) {
+        ack(c, sendatleastone);
+        return;
     }
 
-    for(int i = 0; i < NSACKS && c->sacks[i].len; i++)
-        debug("SACK[%d] offset %u len %u\n", i, c->sacks[i].offset, c->sacks[i].len);
+    if(sendatleastone)
+        c->sendatleastone = true;
+
+    // remember if any packet in the batch was ahead, so the RTR flag is not lost
+    if(c->rcv.ahead)
+        c->ack_ahead = true;
+
+    if(!c->ack_pending) {
+        c->ack_pending = true;
+        c->ack_next = utcp->ack_list;
+        utcp->ack_list = c;
+    }
 }
 
-static void handle_in_order(struct utcp_connection *c, const void *data, size_t len) {
-    if(c->recv) {
-        c->recv(c, data, len);
+// Accept a connection on a SYN carrying data and maybe the FIN, see utcp_set_fastopen().
+// The data is passed to the application right away, also during a batch,
+// so whatever it sends and whether it closes the connection in its callbacks goes out on the SYNACK.
+// @return false if the application did not accept the connection
+static bool fastopen_accept(struct utcp_connection *c, const void *data, size_t len, bool fin) {
+    struct utcp *utcp = c->utcp;
+
+    utcp->accept(c, c->src);
+    if(c->state != ESTABLISHED) {
+        debug("Warning: fast open connection not accepted, closing %p state=%s\n", c, strstate[c->state]);
+        c->reapable = true;
+        set_state(c, CLOSED);
+        return false;
+    }
+
+    // in pull mode the data waits in the receive buffer, what does not fit is not acknowledged and sent again
+    if(c->pull && len) {
+        ssize_t stored = buffer_put_at(&c->rcvbuf, c->rcv_ready, data, len);
+        if(stored < 0)
+            stored = 0;
+        if((size_t)stored < len)
+            fin = false;
+        len = stored;
+        c->rcv_ready += len;
+    }
+
+    // ack() holds back what the callbacks send until the SYNACK is acknowledged
+    c->synack_unacked = true;
+    c->rcv.nxt += len;
+    if(fin) {
+        set_state(c, CLOSE_WAIT);
+        c->rcv.nxt++;
+    }
+    c->ts_last_ack = c->rcv.nxt;
+
+    if(len) {
+        struct iovec iov = {(void *)data, len};
+        deliver(c, &iov, 1);
     }
+    if(fin && !c->reapable) {
+        errno = 0;
+        deliver(c, NULL, 0);
+    }
+
+    // the callbacks may have aborted it
+    if(c->state != CLOSED)
+        send_syn(c);
+
+    return true;
 }
 
 ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
@@ -1100,41 +3597,82 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
 
     print_packet(utcp, "recv", data, len);
 
-    // Drop packets smaller than the header
+    // Copy the potentially unaligned header, drop packets smaller than it
+
+    struct hdr hdr;
+    enum hdr_format format;
+    size_t hlen = read_hdr(data, len, &hdr, &format);
 
-    if(len < sizeof(struct hdr)) {
+    if(!hlen) {
         errno = EBADMSG;
         return -1;
     }
 
-    // Reinterpret potentially unaligned data to a pkt_t struct
-
-    const struct pkt_t *pkt = data;
-    len -= sizeof(struct hdr);
+    len -= hlen;
 
-    // Drop packets with an unknown CTL flag
+    // Drop packets with an unknown CTL flag, and compact SYNs, which need the full header to negotiate
 
-    if(pkt->hdr.ctl & ~(SYN | ACK | RTR | FIN | RST)) {
+    if((hdr.ctl & ~(SYN | ACK | RTR | FIN | RST)) || (format != HDR_FULL && (hdr.ctl & SYN))) {
         errno = EBADMSG;
         return -1;
     }
 
+    // Parse options, in a SYN hdr.aux holds the capabilities instead
+
+    struct options opts = {0};
+    opts.nsacks = 0;
+    opts.ts = false;
+    const char *payload = (const char *)data + hlen;
+
+    if(hdr.aux && !(hdr.ctl & SYN)) {
+        if(hdr.aux > len || !parse_options(payload, hdr.aux, &opts)) {
+            errno = EBADMSG;
+            return -1;
+        }
+        payload += hdr.aux;
+        len -= hdr.aux;
+    }
+
     // Try to match the packet to an existing connection
 
-    struct utcp_connection *c = find_connection(utcp, pkt->hdr.dst, pkt->hdr.src);
+    struct utcp_connection *c = utcp->last_conn;
+    if(!c || c->src != hdr.dst || c->dst != hdr.src) {
+        c = find_connection(utcp, hdr.dst, hdr.src);
+        utcp->last_conn = c;
+    }
+
+    // Make the sequence numbers of a compact header absolute again.
+    // Without a connection they stay relative, and so does the RST sent back.
+
+    if(c && format != HDR_FULL) {
+        hdr.seq = format == HDR_COMPACT ? hdr.seq + c->rcv.irs : c->rcv.nxt;
+        hdr.ack += c->snd.iss;
+    }
+
+    utcp->stats.segments_received++;
+    utcp->stats.bytes_received += len;
+    if(c) {
+        c->stats.segments_received++;
+        c->stats.bytes_received += len;
+    }
+
+#ifndef UTCP_NO_TRACE
+    if(utcp->trace)
+        trace_packet(utcp, c, UTCP_TRACE_RECV, &hdr, len);
+#endif
 
     // Is it for a new connection?
 
     if(!c) {
         // Ignore RST packets
 
-        if(pkt->hdr.ctl & RST)
+        if(hdr.ctl & RST)
             return 0;
 
         // Is it a SYN packet?
-        if(!(pkt->hdr.ctl & SYN) || (pkt->hdr.ctl & ACK)) {
+        if(!(hdr.ctl & SYN) || (hdr.ctl & ACK)) {
             // No, we don't want your packets, send a RST back
-            debug("Warning: connection rejected, hdr.ctl=%u\n", pkt->hdr.ctl);
+            debug("Warning: connection rejected, hdr.ctl=%u\n", hdr.ctl);
             len = 1;
             goto reset;
         }
@@ -1148,14 +3686,14 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         }
 
         // If we don't want to accept it, send a RST back
-        if((utcp->pre_accept && !utcp->pre_accept(utcp, pkt->hdr.dst))) {
-            debug("Info: connection not accepted, dst=%u\n", (unsigned int)pkt->hdr.dst);
+        if((utcp->pre_accept && !utcp->pre_accept(utcp, hdr.dst))) {
+            debug("Info: connection not accepted, dst=%u\n", (unsigned int)hdr.dst);
             len = 1;
             goto reset;
         }
 
         // Try to allocate memory, otherwise send a RST back
-        c = allocate_connection(utcp, pkt->hdr.dst, pkt->hdr.src);
+        c = allocate_connection(utcp, hdr.dst, hdr.src);
         if(!c) {
             debug("Error: failed to allocate connection\n");
             len = 1;
@@ -1163,13 +3701,28 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         }
 
         // Return SYN+ACK, go to SYN_RECEIVED state
-        c->snd.wnd = pkt->hdr.wnd;
-        c->rcv.irs = pkt->hdr.seq;
+        c->caps = hdr.aux & utcp->caps;
+        c->snd.wnd = hdr.wnd;
+        c->rcv.irs = hdr.seq;
         c->rcv.nxt = c->rcv.irs + 1;
-        c->rcv.trs = pkt->hdr.trs;
+        c->ts_last_ack = c->rcv.nxt;
+        c->rcv.trs = hdr.trs;
         set_state(c, SYN_RECEIVED);
 
-        struct pkt_t *response = calloc(1, sizeof(struct pkt_t));;
+        // A fast open SYN carries data or the FIN, accept it right away and answer on the SYNACK
+        if(utcp->fastopen && (len || (hdr.ctl & FIN))) {
+            if(!fastopen_accept(c, payload, len, hdr.ctl & FIN)) {
+                len = 1;
+                goto reset;
+            }
+            return 0;
+        }
+
+        struct pkt_t *response = pkt_pool_get(utcp);
+        if(!response)
+            return 0;
+
+        memset(&response->hdr, 0, sizeof response->hdr);
         response->hdr.dst = c->dst;
         response->hdr.src = c->src;
         response->hdr.ack = c->rcv.irs + 1;
@@ -1177,11 +3730,15 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         response->hdr.trs = c->snd.trs;
         response->hdr.tra = c->rcv.trs;
         response->hdr.ctl = SYN | ACK;
+        response->hdr.wnd = c->rcvbuf.maxsize; // the window once accepted
+        response->hdr.aux = c->caps;
         print_packet(c->utcp, "send", response, sizeof response->hdr);
+        packet_sent(utcp, c, response, sizeof response->hdr, 0, false);
         if(!utcp_send_packet_or_queue(c, response, sizeof response->hdr)) {
             debug("Error: utcp_recv failed to send SYN | ACK");
-            free(response);
+            pkt_pool_put(utcp, response);
         }
+        c->snd.max = c->snd.nxt;
 
         return 0;
     }
@@ -1226,24 +3783,50 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
     // But it might be bigger than snd.nxt since we reset snd.nxt in retransmit and on triplicate ack.
     // And by package reordering it might be lower than snd.una, still it might have some useful data.
 
-    if((pkt->hdr.ctl & ACK) && (seqdiff(pkt->hdr.ack, c->snd.last) > 0)) {
+    if((hdr.ctl & ACK) && (seqdiff(hdr.ack, c->snd.last) > 0)) {
         debug("Packet ack seqno out of range: hdr.ack=%u snd.una=%u snd.nxt=%u snd.last=%u\n",
-            pkt->hdr.ack, c->snd.una, c->snd.nxt, c->snd.last);
+            hdr.ack, c->snd.una, c->snd.nxt, c->snd.last);
         // Ignore unacceptable RST packets.
-        if(pkt->hdr.ctl & RST)
+        if(hdr.ctl & RST)
             return 0;
         goto reset;
     }
 
+    // 1c. A retransmitted fast open SYN means the peer did not get our SYNACK and the data on it
+
+    if((hdr.ctl & SYN) && !(hdr.ctl & ACK) && c->synack_unacked && hdr.seq == c->rcv.irs) {
+        send_syn(c);
+        return 0;
+    }
+
+    // 1d. Drop old duplicates, their timestamp is older than the last one received
+
+    struct timeval now;
+    get_time(utcp, &now);
+
+    if((c->caps & CAP_TS) && !(hdr.ctl & (SYN | RST)) && paws_reject(c, &opts, &now)) {
+        debug("Dropping old duplicate, timestamp %u < %u\n", opts.ts_val, c->ts_recent);
+        // our ACK of the original may have been lost
+        if(len)
+            ack_or_defer(c, true);
+        return 0;
+    }
+
+    // the timestamp to echo is that of the earliest packet our next ACK acknowledges
+    if(opts.ts && seqdiff(hdr.seq, c->ts_last_ack) <= 0) {
+        c->ts_recent = opts.ts_val;
+        c->ts_recent_age = now;
+    }
+
     // 2. Advance remote connectio state
 
     // 2a. Update received transmit number
 
-    c->rcv.trs = pkt->hdr.trs;
+    c->rcv.trs = hdr.trs;
 
     // 2b. Update send window
 
-    c->snd.wnd = pkt->hdr.wnd;
+    c->snd.wnd = hdr.wnd;
 
     // 2c. Advance acknowledged progress
     // process acks even when hdr.seq doesn't match to adapt early and
@@ -1251,25 +3834,34 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
 
     uint32_t prevrcvnxt = c->rcv.nxt;
     uint32_t advanced = 0;
+    bool rtrx_una = false; // send the segment at snd.una again
 
-    if(pkt->hdr.ctl & ACK)
+    if(hdr.ctl & ACK)
     {
-        int32_t progress = seqdiff(pkt->hdr.ack, c->snd.una);
+        int32_t progress = seqdiff(hdr.ack, c->snd.una);
         advanced = (progress > 0)? progress: 0;
 
         if(advanced) {
+            uint32_t rtt = 0;
+
             // RTT measurement
-            // check the measurement was started and the transmit number matches the last retransmit
-            if(c->rtt_start.tv_sec && pkt->hdr.tra == c->snd.trs) {
-                // check the acknowledged sequence number matches the sequence number of last RTT measurement sent
-                if(c->rtt_seq == pkt->hdr.ack) {
-                    struct timeval now, diff;
-                    gettimeofday(&now, NULL);
+            // with timestamps, every ACK echoes when the packet it acknowledges was sent, even a retransmitted one
+            // otherwise, check the measurement was started and the transmit number matches the last retransmit
+
+            if((c->caps & CAP_TS) && opts.ts && opts.ts_ecr) {
+                rtt = timestamp(&now) - opts.ts_ecr;
+                if(rtt < MAX_RTO)
+                    update_rtt(c, rtt);
+                else
+                    rtt = 0;
+            } else if(c->rtt_start.tv_sec && hdr.tra == c->snd.trs) {
+                // check the acknowledged sequence number covers the sequence number of last RTT measurement sent,
+                // a delayed ACK can cover more segments
+                if(seqdiff(hdr.ack, c->rtt_seq) >= 0) {
+                    struct timeval diff;
                     timersub(&now, &c->rtt_start, &diff);
-                    update_rtt(c, diff.tv_sec * USEC_PER_SEC + diff.tv_usec);
-                    c->rtt_start.tv_sec = 0;
-                } else if(c->rtt_seq < pkt->hdr.ack) {
-                    debug("Cancelling RTT measurement: %u < %u\n", c->rtt_seq, pkt->hdr.ack);
+                    rtt = diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+                    update_rtt(c, rtt);
                     c->rtt_start.tv_sec = 0;
                 }
             }
@@ -1277,21 +3869,12 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
             int32_t data_acked = advanced;
 
             // sub virtual SYN & FIN ack length
-            switch(c->state) {
-                case SYN_SENT:
-                case SYN_RECEIVED:
-                    data_acked--;
-                    break;
-                case FIN_WAIT_1:
-                case CLOSING:
-                case LAST_ACK:
-                    // last ack is the FIN
-                    if(pkt->hdr.ack == c->snd.last)
-                        data_acked--;
-                    break;
-                default:
-                    break;
-            }
+            if(syn_unacked(c))
+                data_acked--;
+            // last ack is the FIN
+            if(fin_queued(c) && hdr.ack == c->snd.last)
+                data_acked--;
+            c->synack_unacked = false;
 
             assert(data_acked >= 0);
 
@@ -1299,38 +3882,84 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
             assert(data_acked <= bufused);
 
             // Remove data from send buffer
+            // and release the source once all of it is acked
             if(data_acked) {
-                buffer_get(&c->sndbuf, NULL, data_acked);
+                uint32_t from_buffer = min(data_acked, c->sndbuf.used);
+                uint32_t from_source = data_acked - from_buffer;
+                chunk_buffer_get(&c->sndbuf, NULL, from_buffer);
+                if(from_source) {
+                    c->source_pos += from_source;
+                    c->source_left -= from_source;
+                    if(!c->source_left)
+                        c->read_at = NULL;
+                }
+                // there is room for the poll callback to add more data
+                if(c->poll)
+                    mark_ready(c);
+            }
+
+            // Check whether the ACK for the first retransmission of fast recovery shows it was not needed,
+            // and how many segments had overtaken the hole then
+            bool undo = false;
+            uint32_t reordered = c->dupack;
+            if(c->fast_recovery && timerisset(&c->rtx_stamp)) {
+                undo = spurious_retransmit(c, &opts, &now);
+                int32_t ahead = seqdiff(sacked_high(c), c->snd.una);
+                if(ahead > 0 && (uint32_t)ahead / c->mtu > reordered)
+                    reordered = ahead / c->mtu;
+                timerclear(&c->rtx_stamp);
             }
 
             // Advance snd.una & snd.nxt
-            if(seqdiff(c->snd.nxt, pkt->hdr.ack) < 0)
-                c->snd.nxt = pkt->hdr.ack;
-            c->snd.una = pkt->hdr.ack;
+            if(seqdiff(c->snd.nxt, hdr.ack) < 0)
+                c->snd.nxt = hdr.ack;
+            uint32_t sacked = c->scoreboard.bytes;
+            c->snd.una = hdr.ack;
+            advance_scoreboard(c);
+
+            // what the peer already reported with SACK was delivered back then
+            sacked -= c->scoreboard.bytes;
+            c->delivered += (uint32_t)data_acked > sacked ? (uint32_t)data_acked - sacked : 0;
 
             // Reset triplicate ack detection
             c->dupack = 0;
+            c->timeouts = 0;
 
-            // Update congestion window size
-            // When the acknowledged transmit number matches the current transmit number, increase the congestion window.
-            // Otherwise on retransmit keep it low to leave the receiver time to catch up if busy.
-            if(pkt->hdr.tra == c->snd.trs) {
-                if(c->snd.cwnd < c->snd.ssthresh) // slow start
-                    c->snd.cwnd += min(data_acked, c->utcp->mtu);
-                else // congestion avoidance
-                    c->snd.cwnd += max(1, c->utcp->mtu * c->utcp->mtu / c->snd.cwnd);
-
-                // Don't let the send window be larger than either our or the receiver's buffer.
-                if(c->snd.cwnd > c->rcv.wnd)
-                    c->snd.cwnd = c->rcv.wnd;
-                if(c->snd.cwnd > c->sndbuf.maxsize)
-                    c->snd.cwnd = c->sndbuf.maxsize;
-
-                // limit to cwnd_max
-                if(c->cwnd_max > 0 && c->snd.cwnd > c->cwnd_max)
-                    c->snd.cwnd = c->cwnd_max;
+            if(c->probe_size && seqdiff(hdr.ack, c->probe_end) >= 0)
+                probe_acked(c);
+
+            // An ACK uncorks a held back small segment
+            if(timerisset(&c->cork_timeout)) {
+                stop_cork_timer(c);
+                c->uncork = true;
             }
 
+            // When the acknowledged transmit number doesn't match the current transmit number, we are recovering from a retransmit.
+            bool recovering = hdr.tra != c->snd.trs || c->fast_recovery;
+
+            if(undo) {
+                undo_recovery(c, reordered);
+            } else if(c->fast_recovery) {
+                if(seqdiff(hdr.ack, c->recover) >= 0) {
+                    // Full ACK, everything sent before the loss has arrived
+                    debug("Fast recovery done\n");
+                    c->fast_recovery = false;
+                    c->snd.cwnd = c->recover_cwnd;
+                } else {
+                    // Partial ACK, the next hole starts at snd.una
+                    // Take back the inflation for the segments that left the network
+                    if(!(c->caps & CAP_SACK)) {
+                        c->snd.cwnd = c->snd.cwnd > (uint32_t)data_acked ? c->snd.cwnd - data_acked : 0;
+                        c->snd.cwnd += c->mtu;
+                    }
+                    rtrx_una = true;
+                }
+            }
+
+            // Update congestion window size
+            c->cc->on_ack(c, data_acked, rtt, recovering, &now);
+            limit_cwnd(c);
+
             // Check if we have sent a FIN that is now ACKed.
             switch(c->state) {
             case FIN_WAIT_1:
@@ -1349,23 +3978,53 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
             if(data_acked && c->ack)
                 c->ack(c, data_acked);
         }
-        else if(!progress && pkt->hdr.ctl & RTR) {
+        else if(!progress && hdr.ctl & RTR) {
             // Count duplicate acks but disregard those for packets that were behind
             // Only for triplicate acks that signal missing data perform the retransmit
             c->dupack++;
-            // ignore additional triplicate acks for old transmit sequences
-            if(c->dupack == 3 && pkt->hdr.tra == c->snd.trs) {
+            c->stats.dupacks++;
+            utcp->stats.dupacks++;
+            if(c->fast_recovery) {
+                // Each duplicate ACK means another segment left the network.
+                // With SACK, ack() already doesn't count it as in flight.
+                if(!(c->caps & CAP_SACK)) {
+                    c->snd.cwnd += c->mtu;
+                    limit_cwnd(c);
+                }
+            } else if(c->dupack == c->reordering && in_probe(c, c->snd.una)) {
+                // the probe was too large, which says nothing about congestion
+                debug("Triplicate ACK for the MTU probe\n");
+                retransmit_probe(c);
+            } else if(c->dupack == c->reordering && hdr.tra == c->snd.trs) {
+                // ignore additional triplicate acks for old transmit sequences
                 debug("Triplicate ACK\n");
+                // Fast recovery, see RFC 6582
+                c->fast_recovery = true;
+                c->recover = c->snd.nxt;
+                c->rtx_stamp = now;
+                c->undo_cwnd = c->snd.cwnd;
+                c->undo_ssthresh = c->snd.ssthresh;
+                c->cc->on_loss(c);
+                limit_cwnd(c);
+                c->recover_cwnd = c->snd.cwnd;
+                c->rtx_next = c->snd.una;
+                if(!(c->caps & CAP_SACK))
+                    c->snd.cwnd += 3 * c->mtu;
                 // Fast retransmit
-                c->snd.nxt = c->snd.una;
-                // Fast recovery
-                c->snd.ssthresh = max(c->snd.cwnd / 2, 2 * c->utcp->mtu);
-                c->snd.cwnd = c->snd.ssthresh;
-                if(c->cwnd_max > 0 && c->snd.cwnd > c->cwnd_max)
-                    c->snd.cwnd = c->cwnd_max;
+                rtrx_una = true;
             }
         }
 
+        // The SACK blocks of the most recent ACK tell what the peer has beyond hdr.ack
+        if((c->caps & CAP_SACK) && seqdiff(hdr.ack, c->snd.una) >= 0)
+            update_scoreboard(c, hdr.ack, &opts);
+
+        // with SACK every ACK during recovery may let more holes be sent again
+        if(c->fast_recovery && (c->caps & CAP_SACK))
+            sack_retransmit(c, rtrx_una);
+        else if(rtrx_una)
+            fast_retransmit(c);
+
         // Reset retransmit timer
 
         // reset on progress, so data can be continously sent over the channel
@@ -1390,7 +4049,7 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
     if(c->state == SYN_SENT)
         acceptable = true;
     else {
-        rcv_offset = seqdiff(pkt->hdr.seq, c->rcv.nxt);
+        rcv_offset = seqdiff(hdr.seq, c->rcv.nxt);
         c->rcv.ahead = rcv_offset > 0;
 
         // always accept control data packets that are ahead
@@ -1412,7 +4071,7 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
                 }
             } else {
                 // accept packets that can partially be stored to the buffer
-                acceptable = rcv_offset < c->rcvbuf.maxsize;
+                acceptable = c->rcv_ready + rcv_offset < c->rcvbuf.maxsize;
             }
         }
     }
@@ -1444,13 +4103,13 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
     // seqno rolls back on retransmit, so possibly a previous ack got dropped
 
     if(!acceptable) {
-        debug("Packet not acceptable, %u <= %u + " PRINT_SIZE_T " < %u\n", c->rcv.nxt, pkt->hdr.seq, len, c->rcv.nxt + c->rcvbuf.maxsize);
+        debug("Packet not acceptable, %u <= %u + " PRINT_SIZE_T " < %u\n", c->rcv.nxt, hdr.seq, len, c->rcv.nxt + c->rcvbuf.maxsize);
         // Ignore unacceptable RST packets.
-        if(pkt->hdr.ctl & RST)
+        if(hdr.ctl & RST)
             return 0;
         // Otherwise, send an ACK back in the hope things improve.
         // needed to trigger the triple ack and reset the sender's seqno
-        ack(c, true);
+        ack_or_defer(c, true);
         return 0;
     }
 
@@ -1458,20 +4117,18 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
 
     // 4a. RST state changes
 
-    if(pkt->hdr.ctl & RST) {
+    if(hdr.ctl & RST) {
         switch(c->state) {
         case SYN_SENT:
-            if(!(pkt->hdr.ctl & ACK))
+            if(!(hdr.ctl & ACK))
                 return 0;
             // The peer has refused our connection.
             debug("Warning: peer refused connection, %p state=%s\n", c, strstate[c->state]);
             set_state(c, CLOSED);
-            errno = ECONNREFUSED;
-            if(c->recv)
-                c->recv(c, NULL, 0);
+            handle_closed(c, ECONNREFUSED);
             return 0;
         case SYN_RECEIVED:
-            if(pkt->hdr.ctl & ACK)
+            if(hdr.ctl & ACK)
                 return 0;
             // We haven't told the application about this connection yet. Silently delete.
             free_connection(c);
@@ -1480,19 +4137,17 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         case FIN_WAIT_1:
         case FIN_WAIT_2:
         case CLOSE_WAIT:
-            if(pkt->hdr.ctl & ACK)
+            if(hdr.ctl & ACK)
                 return 0;
             // The peer has aborted our connection.
             debug("Info: connection aborted, %p state=%s\n", c, strstate[c->state]);
             set_state(c, CLOSED);
-            errno = ECONNRESET;
-            if(c->recv)
-                c->recv(c, NULL, 0);
+            handle_closed(c, ECONNRESET);
             return 0;
         case CLOSING:
         case LAST_ACK:
         case TIME_WAIT:
-            if(pkt->hdr.ctl & ACK)
+            if(hdr.ctl & ACK)
                 return 0;
             // As far as the application is concerned, the connection has already been closed.
             // If it has called utcp_close() already, we can immediately free this connection.
@@ -1511,7 +4166,7 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
 
     // 4b. SYN state changes
 
-    if(pkt->hdr.ctl & SYN) {
+    if(hdr.ctl & SYN) {
         switch(c->state) {
         case SYN_SENT:
             // This is a SYNACK. It should always have ACKed the SYN.
@@ -1519,10 +4174,18 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
                 debug("Warning: SYNACK didn't advance, %p state=%s\n", c, strstate[c->state]);
                 goto reset;
             }
-            c->rcv.irs = pkt->hdr.seq;
-            c->rcv.nxt = pkt->hdr.seq;
+            c->rcv.irs = hdr.seq;
+            c->rcv.nxt = hdr.seq;
+            c->ts_last_ack = c->rcv.nxt;
             c->rcv.wnd = c->rcvbuf.maxsize;
-            set_state(c, ESTABLISHED);
+            c->caps = hdr.aux & utcp->caps;
+            // a FIN queued with fast open may have been acknowledged already
+            if(c->syn_fin)
+                set_state(c, c->snd.una == c->snd.last ? FIN_WAIT_2 : FIN_WAIT_1);
+            else
+                set_state(c, ESTABLISHED);
+            // send right away what the SYN carried but the peer did not take
+            c->snd.nxt = c->snd.una;
             // TODO: notify application of this somehow.
             break;
         case SYN_RECEIVED:
@@ -1557,16 +4220,16 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         // Are we still LISTENing?
         if(!utcp->accept) {
             debug("Warning: not listening, closing %p state=%s\n", c, strstate[c->state]);
-            set_state(c, CLOSED);
             c->reapable = true;
+            set_state(c, CLOSED);
             goto reset;
         }
         
         utcp->accept(c, c->src);
         if(c->state != ESTABLISHED) {
             debug("Warning: couldn't establish connection, closing %p state=%s\n", c, strstate[c->state]);
-            set_state(c, CLOSED);
             c->reapable = true;
+            set_state(c, CLOSED);
             goto reset;
         }
     }
@@ -1598,12 +4261,23 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
         // delay to process the new data received till after the ack
         // for quicker response time and a decreased rtt measurement variance
         handle_incoming = true;
+
+        // in pull mode, in-order data is only accepted as far as it fits in the receive buffer,
+        // a segment that does not fit at all is acknowledged with the current window
+        if(c->pull && rcv_offset <= 0) {
+            ssize_t stored = buffer_put_at(&c->rcvbuf, c->rcv_ready, payload + data_offset, data_len);
+            data_len = stored > 0 ? stored : 0;
+            handle_incoming = data_len > 0;
+        }
     }
 
     // 4d. FIN state changes
+    // the FIN follows the data, which is in order if step 5 consumes it
 
     bool closed = false;
-    if((pkt->hdr.ctl & FIN) && pkt->hdr.seq + len == c->rcv.nxt) {
+    uint32_t fin_seq = hdr.seq + (hdr.ctl & SYN ? 1 : 0) + len;
+    uint32_t data_end = c->rcv.nxt + (handle_incoming && rcv_offset <= 0 ? data_len : 0);
+    if((hdr.ctl & FIN) && fin_seq == data_end) {
         switch(c->state) {
         case SYN_SENT:
         case SYN_RECEIVED:
@@ -1639,25 +4313,46 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
     }
 
     // 5. Consume incoming packet data, advancing the rcv.nxt counter
-    char* frombuf = NULL;
-    if(handle_incoming && rcv_offset <= 0)
+    // out-of-order data is stored right away, so the ACK can tell the sender about it
+    // the packet data is followed by any buffered SACK data it made consumable, without copying it
+    struct iovec rcv_iov[3];
+    size_t rcv_iovcnt = 0;
+    bool filled_hole = false;
+    if(handle_incoming && rcv_offset > 0)
+    {
+        handle_out_of_order(c, rcv_offset, payload, data_len);
+        handle_incoming = false;
+    }
+    else if(handle_incoming)
     {
+        // in pull mode, the data is in the receive buffer already and the application is only told how much there is
+        rcv_iov[0].iov_base = c->pull ? NULL : (void *)(payload + data_offset);
+        rcv_iov[0].iov_len = data_len;
+        rcv_iovcnt = 1;
+
         size_t consumable = buffer_consumable(c, data_len);
         if( consumable )
         {
-            debug("consuming buffered SACKs up to %u\n", (unsigned long)( pkt->hdr.seq + data_offset + data_len + consumable));
+            debug("consuming buffered SACKs up to %u\n", (unsigned long)( hdr.seq + data_offset + data_len + consumable));
 
-            frombuf = malloc(data_len + consumable);
-            memcpy( frombuf, pkt->data + data_offset, data_len );
-            buffer_copy(&c->rcvbuf, frombuf + data_len, data_len, consumable);
+            // sack_consume() only moves the start of the ring, the data stays in place till the next write
+            if(!c->pull)
+                rcv_iovcnt += buffer_peek(&c->rcvbuf, rcv_iov + 1, data_len, consumable);
             data_len += consumable;
+            filled_hole = true;
         }
 
-        if(c->rcvbuf.used)
+        if(c->pull) {
+            range_set_consume(&c->sacks, data_len);
+            c->rcv_ready += data_len;
+        } else if(c->rcvbuf.used) {
             sack_consume(c, data_len);
+        }
 
         // advance ack sequence number for the next packet to receive
         c->rcv.nxt += data_len;
+
+        rcvbuf_autotune(c);
     }
 
     // 6. Ack accepted packets
@@ -1669,47 +4364,49 @@ ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len) {
     //   -> sendatleastone = true
     // - or we got an ack, so we should maybe send a bit more data
     //   -> sendatleastone = false
-    ack(c, len || prevrcvnxt != c->rcv.nxt);
+    // With delayed ACKs, in-order full-sized data segments are only acknowledged every ack_every segments,
+    // or when the delayed ACK timer expires, unless we have data to send anyway.
+    bool sendatleastone = len || prevrcvnxt != c->rcv.nxt;
+
+    if(sendatleastone && c->ack_every > 1 && delay_ack(c, &hdr, len, rcv_offset, filled_hole)) {
+        if(!timerisset(&c->delack_timeout))
+            start_delack_timer(c);
+        sendatleastone = false;
+    }
+
+    ack_or_defer(c, sendatleastone);
 
     // 7. Send new data to application
     // Given the ack is used for roundtrip measurement and a too high response time or variation
     // easily implicts retransmits, delay all compution intensive processing till after the ack.
 
     // Handle new incoming data.
-    if(handle_incoming)
-    {
-        if(rcv_offset > 0)
-        {
-            handle_out_of_order(c, rcv_offset, pkt->data, data_len);
-        }
-        else
-        {
-            const char* rcv_data = frombuf ? frombuf : pkt->data + data_offset;
-            handle_in_order(c, rcv_data, data_len);
-        }
+    if(handle_incoming)
+    {
+        handle_in_order(c, rcv_iov, rcv_iovcnt);
     }
 
-    if( frombuf ) {
-        free(frombuf);
-    }
+    reclaim_buffers(c);
 
     // Inform the application when the peer closed the connection.
-    if(closed && c->recv) {
-        errno = 0;
-        c->recv(c, NULL, 0);
-    }
+    if(closed)
+        handle_closed(c, 0);
 
     return 0;
 
 reset:
     {
-        struct pkt_t *response = malloc(sizeof(struct pkt_t));
-        memcpy(&response->hdr, &pkt->hdr, sizeof pkt->hdr);
+        struct pkt_t *response = pkt_pool_get(utcp);
+        if(!response)
+            return 0;
+
+        memcpy(&response->hdr, &hdr, sizeof hdr);
 
         swap_ports(&response->hdr);
         response->hdr.trs = c? c->snd.trs: 0;
-        response->hdr.tra = pkt->hdr.trs;
+        response->hdr.tra = hdr.trs;
         response->hdr.wnd = 0;
+        response->hdr.aux = 0;
         if(response->hdr.ctl & ACK) {
             response->hdr.seq = response->hdr.ack;
             response->hdr.ctl = RST;
@@ -1718,17 +4415,79 @@ reset:
             response->hdr.seq = 0;
             response->hdr.ctl = RST | ACK;
         }
-        print_packet(utcp, "send", response, sizeof response->hdr);
+
+        // answer a compact header in kind, the peer may not be able to tell the connection's ISNs from it otherwise
+        size_t rlen = sizeof response->hdr;
+        if(format != HDR_FULL) {
+            uint8_t buf[MAX_COMPACT_HDR];
+            size_t clen = write_compact_hdr(buf, &response->hdr, c ? c->snd.iss : 0, c ? c->rcv.irs : 0, false);
+            if(clen) {
+                memcpy(response, buf, clen);
+                rlen = clen;
+            }
+        }
+        print_packet(utcp, "send", response, rlen);
+        packet_sent(utcp, c, response, rlen, 0, false);
 
         // attempt to report back the RST but wait for the next failed packet when not in a condition to send
-        if(!utcp_send_packet(utcp, response, sizeof response->hdr)) {
+        if(!utcp_send_packet(utcp, response, rlen))
             debug("Info: utcp_recv failed to send back RST");
-            free(response);
-        }
+        pkt_pool_put(utcp, response);
         return 0;
     }
 }
 
+ssize_t utcp_recv_batch(struct utcp *utcp, const struct iovec *pkts, size_t n) {
+    if(!utcp || (n && !pkts)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    // Process all packets, only remembering which connections need an ACK
+    // and what data has to be passed to the application
+    ssize_t processed = 0;
+    utcp->batching = true;
+
+    for(size_t i = 0; i < n; i++)
+        if(utcp_recv(utcp, pkts[i].iov_base, pkts[i].iov_len) == 0)
+            processed++;
+
+    utcp->batching = false;
+
+    // Send one ACK per connection
+    while(utcp->ack_list) {
+        struct utcp_connection *c = utcp->ack_list;
+        utcp->ack_list = c->ack_next;
+        c->ack_next = NULL;
+        c->ack_pending = false;
+        if(c->ack_ahead) {
+            c->rcv.ahead = true;
+            c->ack_ahead = false;
+        }
+        ack(c, false);
+    }
+
+    // Deliver the received data in order. Callbacks may start a new batch, so take the array.
+    struct deferred_recv *deferred = utcp->deferred;
+    size_t ndeferred = utcp->ndeferred;
+    size_t ndeferred_allocated = utcp->ndeferred_allocated;
+    utcp->deferred = NULL;
+    utcp->ndeferred = 0;
+    utcp->ndeferred_allocated = 0;
+
+    for(size_t i = 0; i < ndeferred; i++)
+        deliver_deferred(&deferred[i]);
+
+    if(!utcp->deferred) {
+        utcp->deferred = deferred;
+        utcp->ndeferred_allocated = ndeferred_allocated;
+    } else {
+        free(deferred);
+    }
+
+    return processed;
+}
+
 int utcp_shutdown(struct utcp_connection *c, int dir) {
     debug("%p shutdown %d at %u\n", c ? c->utcp : NULL, dir, c ? c->snd.last : 0);
     if(!c) {
@@ -1749,8 +4508,16 @@ int utcp_shutdown(struct utcp_connection *c, int dir) {
 
     // TCP does not have a provision for stopping incoming packets.
     // The best we can do is to just ignore them.
-    if(dir == UTCP_SHUT_RD || dir == UTCP_SHUT_RDWR)
+    if(dir == UTCP_SHUT_RD || dir == UTCP_SHUT_RDWR) {
         c->recv = NULL;
+        c->recv_iov = NULL;
+        // stop holding back the peer for data that will never be read
+        if(c->pull) {
+            buffer_get(&c->rcvbuf, NULL, c->rcv_ready);
+            c->rcv_ready = 0;
+            c->pull = false;
+        }
+    }
 
     // The rest of the code deals with shutting down writes.
     if(dir == UTCP_SHUT_RD)
@@ -1763,7 +4530,16 @@ int utcp_shutdown(struct utcp_connection *c, int dir) {
         return -1;
 
     case SYN_SENT:
-        set_state(c, CLOSED);
+        // queue the FIN behind data that is waiting for the connection, fast open can put it on the SYN
+        if(c->snd.last != c->snd.iss + 1 && !c->syn_fin) {
+            c->syn_fin = true;
+            c->snd.last++;
+            if(c->syn_queued)
+                send_syn(c);
+            return 0;
+        }
+        if(!c->syn_fin)
+            set_state(c, CLOSED);
         return 0;
 
     case SYN_RECEIVED:
@@ -1794,8 +4570,11 @@ int utcp_close(struct utcp_connection *c) {
     if(utcp_shutdown(c, SHUT_RDWR) && errno != ENOTCONN)
         return -1;
     c->recv = NULL;
+    c->recv_iov = NULL;
     c->poll = NULL;
     c->reapable = true;
+    if(c->state == CLOSED)
+        mark_ready(c);
     return 0;
 }
 
@@ -1812,11 +4591,13 @@ int utcp_abort(struct utcp_connection *c) {
     }
 
     c->recv = NULL;
+    c->recv_iov = NULL;
     c->poll = NULL;
     c->reapable = true;
 
     switch(c->state) {
     case CLOSED:
+        mark_ready(c);
         return 0;
     case LISTEN:
     case SYN_SENT:
@@ -1837,7 +4618,11 @@ int utcp_abort(struct utcp_connection *c) {
 
     // Send RST
 
-    struct pkt_t *pkt = calloc(1, sizeof(struct pkt_t));
+    struct pkt_t *pkt = pkt_pool_get(c->utcp);
+    if(!pkt)
+        return 0;
+
+    memset(&pkt->hdr, 0, sizeof pkt->hdr);
     pkt->hdr.src = c->src;
     pkt->hdr.dst = c->dst;
     pkt->hdr.seq = c->snd.nxt;
@@ -1846,123 +4631,222 @@ int utcp_abort(struct utcp_connection *c) {
     pkt->hdr.ctl = RST;
 
     print_packet(c->utcp, "send", pkt, sizeof pkt->hdr);
+    packet_sent(c->utcp, c, pkt, sizeof pkt->hdr, 0, false);
     if(!utcp_send_packet_or_queue(c, pkt, sizeof pkt->hdr)) {
         debug("Error: utcp_abort failed to send RST");
-        free(pkt);
+        pkt_pool_put(c->utcp, pkt);
     }
     return 0;
 }
 
+// Handle the timers and pending work of a single connection.
+// Returns false if sending would block, so the other connections are handled next time.
+static bool handle_connection(struct utcp_connection *c, const struct timeval *now, struct timeval *next) {
+    // the pacing timer only makes sure ack() is called below
+    if(timerisset(&c->pace_timeout) && !timercmp(&c->pace_timeout, now, >))
+        stop_pacing_timer(c);
+
+    // and so does the cork timer, but then a small segment may be sent
+    if(timerisset(&c->cork_timeout) && !timercmp(&c->cork_timeout, now, >)) {
+        stop_cork_timer(c);
+        c->uncork = true;
+    }
+
+    // a closed connection has nothing left to time out
+    if(c->state == CLOSED) {
+        stop_connection_timer(c);
+        stop_retransmit_timer(c);
+        stop_pacing_timer(c);
+        stop_delack_timer(c);
+        stop_cork_timer(c);
+        return true;
+    }
+
+    // the source could not be read, the peer would never get the rest of the stream
+    if(c->source_error) {
+        if(c->state != SYN_SENT)
+            send_meta(c, c->snd.nxt, c->rcv.nxt, RST);
+        set_state(c, CLOSED);
+        stop_connection_timer(c);
+        stop_retransmit_timer(c);
+        handle_closed(c, c->source_error);
+        return true;
+    }
+
+    // check connection timeout
+    if(timerisset(&c->conn_timeout) && timercmp(&c->conn_timeout, now, <)) {
+        c->state = CLOSED;
+        stop_connection_timer(c);
+        stop_retransmit_timer(c);
+        handle_closed(c, ETIMEDOUT);
+        return true;
+    }
+
+    // the delayed ACK is due
+    if(timerisset(&c->delack_timeout) && timercmp(&c->delack_timeout, now, <)) {
+        stop_delack_timer(c);
+        ack(c, true);
+    }
+
+    // attempt to send packets from pending queue
+    if(!utcp_send_queued(c)) {
+        // the scheduler serves it again after the other connections
+        if(c->backlogged)
+            return true;
+
+        // retry with 1ms timeout
+        struct timeval retry = {0,1000};
+        if(timercmp(&retry, next, <))
+            *next = retry;
+
+        return false;
+    }
+
+    // a fast open SYN that got no data to carry
+    if(c->syn_queued && c->state == SYN_SENT && !send_syn(c)) {
+        struct timeval retry = {0,1000};
+        if(timercmp(&retry, next, <))
+            *next = retry;
+        return true;
+    }
+
+    // when there's nothing pending queued, check the retransmit timeout
+    if(timerisset(&c->rtrx_timeout) && timercmp(&c->rtrx_timeout, now, <)) {
+        debug("retransmit()\n");
+        if(!retransmit(c)) {
+            // when the retransmit failed, retry with 1ms timeout
+            struct timeval retry = {0,1000};
+            if(timercmp(&retry, next, <))
+                *next = retry;
+            return true;
+        }
+    }
+
+    // when the connection is established, process all data to be sent
+    if(c->state == ESTABLISHED || c->state == CLOSE_WAIT) {
+        // when the poll callback is set and there's free buffer left, poll new data to the buffer
+        if(sndbuf_free(c) && c->poll) {
+            c->poll(c, sndbuf_free(c));
+        }
+
+        // try to send any remainining buffered data
+        // the polling might only call utcp_send and ack when there's something new to send
+        // on error return with a 1ms timeout to retry soon
+        int err = ack(c, false);
+        if(0 != err) {
+            struct timeval retry = {0,1000};
+            if(timercmp(&retry, next, <))
+                *next = retry;
+
+            // stop on UTCP_WOULDBLOCK to proceed with the next connection next time
+            if(UTCP_WOULDBLOCK == err && !c->backlogged)
+                return false;
+        }
+    }
+    // also retry the last shutdown send if failed
+    else if(c->state == FIN_WAIT_1 || c->state == CLOSING || c->state == LAST_ACK) {
+        // on error return with a 1ms timeout to retry soon
+        int err = ack(c, false);
+        if(0 != err) {
+            struct timeval retry = {0,1000};
+            if(timercmp(&retry, next, <))
+                *next = retry;
+
+            // stop on UTCP_WOULDBLOCK to proceed with the next connection next time
+            if(UTCP_WOULDBLOCK == err && !c->backlogged)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// whether the poll callback should be called again
+static bool wants_poll(const struct utcp_connection *c) {
+    if(!c->poll || c->reapable)
+        return false;
+
+    switch(c->state) {
+    case SYN_SENT:
+    case SYN_RECEIVED:
+        return true;
+    case ESTABLISHED:
+    case CLOSE_WAIT:
+        return sndbuf_free(c);
+    default:
+        return false;
+    }
+}
+
 /* Handle timeouts.
- * One call to this function will loop through all connections,
- * checking if something needs to be resent or not.
+ * One call to this function handles all connections whose timers expired,
+ * and those on the ready list, checking if something needs to be resent or not.
  * The return value is the time to the next timeout in milliseconds,
  * or maybe a negative value if the timeout is infinite.
  */
 struct timeval utcp_timeout(struct utcp *utcp) {
     struct timeval now;
-    gettimeofday(&now, NULL);
+    get_time(utcp, &now);
     struct timeval next = {3600, 0};
 
-    static int next_conn = 0;
+    // connections whose timers expired have work to do
+    while(utcp->ntimers && timercmp(earliest_timer(utcp->timers[0]), &now, <)) {
+        struct utcp_connection *c = utcp->timers[0];
+        heap_remove(utcp, c);
+        mark_ready(c);
+    }
 
-    for(int i = 0; i < utcp->nconnections; ++i, ++next_conn) {
-        next_conn %= utcp->nconnections;
-        
-        struct utcp_connection *c = utcp->connections[next_conn];
-        if(!c)
-            continue;
+    // connections that become ready while handling the list are handled next time
+    for(uint32_t n = utcp->nready; n && utcp->ready_head; n--) {
+        struct utcp_connection *c = utcp->ready_head;
+        unmark_ready(c);
 
         // delete connections that have been utcp_close()d.
-        if(c->state == CLOSED) {
-            if(c->reapable) {
-                debug("Reaping %p\n", c);
-                free_connection(c);
-                --i;
-                --next_conn;
-            }
+        if(c->state == CLOSED && c->reapable) {
+            debug("Reaping %p\n", c);
+            free_connection(c);
             continue;
         }
 
-        // check connection timeout
-        if(timerisset(&c->conn_timeout)) {
-             if(timercmp(&c->conn_timeout, &now, <)) {
-                errno = ETIMEDOUT;
-                c->state = CLOSED;
-                if(c->recv)
-                    c->recv(c, NULL, 0);
-                continue;
-            }
-            struct timeval diff;
-            timersub(&c->conn_timeout, &now, &diff);
-            if(timercmp(&diff, &next, <))
-                next = diff;
-        }
+        // Deficit round robin: every turn adds a quantum in proportion to the priority,
+        // what is left of it is only kept while the connection has more to send.
+        c->deficit += c->priority * utcp->mtu;
+        c->scheduled = true;
+        c->backlogged = false;
 
-        // attempt to send packets from pending queue
-        if(!utcp_send_queued(c)) {
-            // retry with 1ms timeout
-            struct timeval retry = {0,1000};
-            if(timercmp(&retry, &next, <))
-                next = retry;
+        bool done = handle_connection(c, &now, &next);
+        c->scheduled = false;
+
+        // put it back in the heap if a timer is still running
+        update_timer(c);
 
-            // break on UTCP_WOULDBLOCK to proceed with the next connection next time
+        if(!done) {
+            if(c->deficit > (int32_t)(c->priority * utcp->mtu))
+                c->deficit = c->priority * utcp->mtu;
+            mark_ready_first(c);
             break;
         }
 
-        // when there's nothing pending queued, check the retransmit timeout
-        if(timerisset(&c->rtrx_timeout)) {
-            if(timercmp(&c->rtrx_timeout, &now, <)) {
-                debug("retransmit()\n");
-                if(!retransmit(c)) {
-                    // when the retransmit failed, retry with 1ms timeout
-                    struct timeval retry = {0,1000};
-                    if(timercmp(&retry, &next, <))
-                        next = retry;
-                    continue;
-                }
-            }
-            struct timeval diff;
-            timersub(&c->rtrx_timeout, &now, &diff);
-            if(timercmp(&diff, &next, <))
-                next = diff;
+        // it gets another turn after the other ready connections
+        if(c->backlogged) {
+            mark_ready(c);
+            n++;
+            continue;
         }
 
-        // when the connection is established, process all data to be sent
-        if(c->state == ESTABLISHED || c->state == CLOSE_WAIT) {
-            // when the poll callback is set and there's free buffer left, poll new data to the buffer
-            if(buffer_free(&c->sndbuf) && c->poll) {
-                c->poll(c, buffer_free(&c->sndbuf));
-            }
+        c->deficit = 0;
 
-            // try to send any remainining buffered data
-            // the polling might only call utcp_send and ack when there's something new to send
-            // on error return with a 1ms timeout to retry soon
-            int err = ack(c, false);
-            if(0 != err) {
-                struct timeval retry = {0,1000};
-                if(timercmp(&retry, &next, <))
-                    next = retry;
-
-                // break on UTCP_WOULDBLOCK to proceed with the next connection next time
-                if(UTCP_WOULDBLOCK == err)
-                    break;
-            }
-        }
-        // also retry the last shutdown send if failed
-        else if(c->state == FIN_WAIT_1 || c->state == CLOSING) {
-            // on error return with a 1ms timeout to retry soon
-            int err = ack(c, false);
-            if(0 != err) {
-                struct timeval retry = {0,1000};
-                if(timercmp(&retry, &next, <))
-                    next = retry;
-
-                // break on UTCP_WOULDBLOCK to proceed with the next connection next time
-                if(UTCP_WOULDBLOCK == err)
-                    break;
-            }
-        }
+        if(wants_poll(c))
+            mark_ready(c);
+    }
+
+    if(utcp->ntimers) {
+        const struct timeval *deadline = earliest_timer(utcp->timers[0]);
+        struct timeval diff = {0, 0};
+        if(timercmp(deadline, &now, >))
+            timersub(deadline, &now, &diff);
+        if(timercmp(&diff, &next, <))
+            next = diff;
     }
 
     return next;
@@ -1992,11 +4876,19 @@ struct utcp *utcp_init(utcp_accept_t accept, utcp_pre_accept_t pre_accept, utcp_
     utcp->accept = accept;
     utcp->pre_accept = pre_accept;
     utcp->send = send;
+    utcp->send_batch = NULL;
     utcp->priv = priv;
     utcp->mtu = DEFAULT_MTU;
     utcp->timeout = DEFAULT_USER_TIMEOUT; // sec
+    utcp->caps = DEFAULT_CAPS;
+    utcp->sndbuf_max = DEFAULT_AUTOTUNE_MAX;
+    utcp->rcvbuf_max = DEFAULT_AUTOTUNE_MAX;
     utcp->rto = START_RTO; // usec
 
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    utcp->prng = ((uint64_t)now.tv_sec * USEC_PER_SEC + now.tv_usec) ^ (uintptr_t)utcp;
+
     return utcp;
 }
 
@@ -2007,13 +4899,18 @@ void utcp_exit(struct utcp *utcp) {
         struct utcp_connection *c = utcp->connections[i];
         if(!c->reapable)
             debug("Warning, freeing unclosed connection %p\n", utcp->connections[i]);
-        if(c->pending_to_send)
-            list_delete_list(c->pending_to_send);
+        free_pending(c);
         buffer_exit(&c->rcvbuf);
-        buffer_exit(&c->sndbuf);
+        range_set_exit(&c->sacks);
+        range_set_exit(&c->scoreboard);
+        chunk_buffer_exit(&c->sndbuf);
         free(c);
     }
     free(utcp->connections);
+    free(utcp->timers);
+    free(utcp->table);
+    free(utcp->deferred);
+    pkt_pool_exit(utcp);
     free(utcp);
 }
 
@@ -2021,10 +4918,19 @@ uint16_t utcp_get_mtu(struct utcp *utcp) {
     return utcp ? utcp->mtu : 0;
 }
 
+// Connections start probing again from the new base mtu
+static void mtu_changed(struct utcp *utcp) {
+    pkt_pool_resize(utcp);
+    for(int i = 0; i < utcp->nconnections; i++)
+        pmtu_reset(utcp->connections[i]);
+}
+
 void utcp_set_mtu(struct utcp *utcp, uint16_t mtu) {
     // directly set the mtu so utcp_get_mtu matches the value specified
-    if(utcp)
+    if(utcp) {
         utcp->mtu = mtu;
+        mtu_changed(utcp);
+    }
 }
 
 uint16_t utcp_update_mtu(struct utcp *utcp, uint16_t mtu) {
@@ -2032,11 +4938,45 @@ uint16_t utcp_update_mtu(struct utcp *utcp, uint16_t mtu) {
     {
         // handle overhead of the header
         utcp->mtu = mtu > sizeof(struct hdr)? mtu - sizeof(struct hdr): DEFAULT_MTU;
+        mtu_changed(utcp);
         return utcp->mtu;
     }
     return 0;
 }
 
+uint16_t utcp_get_mtu_probing(struct utcp *utcp) {
+    return utcp ? utcp->mtu_max : 0;
+}
+
+void utcp_set_mtu_probing(struct utcp *utcp, uint16_t max) {
+    if(utcp) {
+        utcp->mtu_max = max;
+        mtu_changed(utcp);
+    }
+}
+
+uint16_t utcp_get_connection_mtu(struct utcp_connection *c) {
+    return c ? c->mtu : 0;
+}
+
+bool utcp_get_connection_stats(struct utcp_connection *c, struct utcp_stats *stats) {
+    if(!c || !stats)
+        return false;
+
+    *stats = c->stats;
+    stats->srtt = c->srtt;
+    stats->rttvar = c->rttvar;
+    stats->rto = c->rto;
+    stats->cwnd = c->snd.cwnd;
+    stats->ssthresh = c->snd.ssthresh;
+    stats->pending = c->pending_to_send.count;
+    stats->sndbuf = c->sndbuf.maxsize;
+    stats->sndbuf_used = c->sndbuf.used;
+    stats->rcvbuf = c->rcvbuf.maxsize;
+    stats->rcvbuf_used = c->rcvbuf.used;
+    return true;
+}
+
 int utcp_get_user_timeout(struct utcp *u) {
     return u ? u->timeout : 0;
 }
@@ -2046,13 +4986,101 @@ void utcp_set_user_timeout(struct utcp *u, int timeout) {
         u->timeout = timeout;
 }
 
+void utcp_get_buffer_limits(struct utcp *u, size_t *sndbuf_max, size_t *rcvbuf_max) {
+    if(!u)
+        return;
+    if(sndbuf_max)
+        *sndbuf_max = u->sndbuf_max;
+    if(rcvbuf_max)
+        *rcvbuf_max = u->rcvbuf_max;
+}
+
+void utcp_set_buffer_limits(struct utcp *u, size_t sndbuf_max, size_t rcvbuf_max) {
+    if(!u)
+        return;
+    u->sndbuf_max = min(sndbuf_max, UINT32_MAX);
+    u->rcvbuf_max = min(rcvbuf_max, MAX_RCVBUFSIZE);
+}
+
+bool utcp_get_timestamps(struct utcp *u) {
+    return u ? u->caps & CAP_TS : false;
+}
+
+bool utcp_get_compact_header(struct utcp *u) {
+    return u ? u->caps & CAP_COMPACT : false;
+}
+
+void utcp_set_compact_header(struct utcp *u, bool compact) {
+    if(!u)
+        return;
+    if(compact)
+        u->caps |= CAP_COMPACT;
+    else
+        u->caps &= ~CAP_COMPACT;
+}
+
+bool utcp_get_fastopen(struct utcp *u) {
+    return u ? u->fastopen : false;
+}
+
+void utcp_set_fastopen(struct utcp *u, bool fastopen) {
+    if(u)
+        u->fastopen = fastopen;
+}
+
+void utcp_set_timestamps(struct utcp *u, bool timestamps) {
+    if(!u)
+        return;
+    if(timestamps)
+        u->caps |= CAP_TS;
+    else
+        u->caps &= ~CAP_TS;
+}
+
+size_t utcp_get_mem_limit(struct utcp *u) {
+    return u ? u->mem.limit : 0;
+}
+
+void utcp_set_mem_limit(struct utcp *u, size_t limit) {
+    if(!u)
+        return;
+    u->mem.limit = limit;
+    for(int i = 0; i < u->nconnections; i++)
+        reclaim_buffers(u->connections[i]);
+}
+
+size_t utcp_get_mem_usage(struct utcp *u) {
+    return u ? u->mem.used : 0;
+}
+
+bool utcp_get_stats(struct utcp *u, struct utcp_stats *stats) {
+    if(!u || !stats)
+        return false;
+
+    *stats = u->stats;
+    stats->srtt = u->srtt;
+    stats->rttvar = u->rttvar;
+    stats->rto = u->rto;
+    stats->connections = u->nconnections;
+    for(int i = 0; i < u->nconnections; i++) {
+        struct utcp_connection *c = u->connections[i];
+        stats->cwnd += c->snd.cwnd;
+        stats->pending += c->pending_to_send.count;
+        stats->sndbuf += c->sndbuf.maxsize;
+        stats->sndbuf_used += c->sndbuf.used;
+        stats->rcvbuf += c->rcvbuf.maxsize;
+        stats->rcvbuf_used += c->rcvbuf.used;
+    }
+    return true;
+}
+
 size_t utcp_get_sndbuf(struct utcp_connection *c) {
     return c ? c->sndbuf.maxsize : 0;
 }
 
 size_t utcp_get_sndbuf_free(struct utcp_connection *c) {
     if(c && (c->state == ESTABLISHED || c->state == CLOSE_WAIT))
-        return buffer_free(&c->sndbuf);
+        return sndbuf_free(c);
     else
         return 0;
 }
@@ -2060,6 +5088,7 @@ size_t utcp_get_sndbuf_free(struct utcp_connection *c) {
 void utcp_set_sndbuf(struct utcp_connection *c, size_t size) {
     if(!c)
         return;
+    c->sndbuf_locked = true;
     c->sndbuf.maxsize = size;
     if(c->sndbuf.maxsize != size)
         c->sndbuf.maxsize = -1;
@@ -2081,13 +5110,25 @@ void utcp_set_rcvbuf(struct utcp_connection *c, size_t size) {
         return;
     if(size < c->utcp->mtu)
         size = c->utcp->mtu;
-    if(size >= 1U << 30)
-        size = 1U << 30;
+    if(size >= MAX_RCVBUFSIZE)
+        size = MAX_RCVBUFSIZE;
+    c->rcvbuf_locked = true;
     c->rcvbuf.maxsize = size;
     if(c->state == ESTABLISHED)
         c->rcv.wnd = size;
 }
 
+bool utcp_get_pull(struct utcp_connection *c) {
+    return c ? c->pull : false;
+}
+
+bool utcp_set_pull(struct utcp_connection *c, bool pull) {
+    if(!c || (!pull && c->rcv_ready))
+        return false;
+    c->pull = pull;
+    return true;
+}
+
 bool utcp_get_nodelay(struct utcp_connection *c) {
     return c ? c->nodelay : false;
 }
@@ -2097,6 +5138,56 @@ void utcp_set_nodelay(struct utcp_connection *c, bool nodelay) {
         c->nodelay = nodelay;
 }
 
+uint32_t utcp_get_autocork(struct utcp_connection *c) {
+    return c ? c->cork_delay : 0;
+}
+
+void utcp_set_autocork(struct utcp_connection *c, uint32_t usec) {
+    if(!c)
+        return;
+
+    c->cork_delay = usec;
+    if(!usec && timerisset(&c->cork_timeout)) {
+        stop_cork_timer(c);
+        mark_ready(c);
+    }
+}
+
+bool utcp_set_delayed_ack(struct utcp_connection *c, uint32_t segments, uint32_t usec) {
+    if(!c || (segments > 1 && !usec))
+        return false;
+
+    c->ack_every = segments;
+    c->ack_delay = usec;
+    return true;
+}
+
+bool utcp_get_delayed_ack(struct utcp_connection *c, uint32_t *segments, uint32_t *usec) {
+    if(!c)
+        return false;
+
+    if(segments)
+        *segments = c->ack_every;
+    if(usec)
+        *usec = c->ack_delay;
+    return true;
+}
+
+bool utcp_get_pacing(struct utcp_connection *c) {
+    return c ? c->pacing : false;
+}
+
+void utcp_set_pacing(struct utcp_connection *c, bool pacing) {
+    if(!c)
+        return;
+
+    c->pacing = pacing;
+    if(!pacing && timerisset(&c->pace_timeout)) {
+        stop_pacing_timer(c);
+        mark_ready(c);
+    }
+}
+
 bool utcp_get_keepalive(struct utcp_connection *c) {
     return c ? c->keepalive : false;
 }
@@ -2106,6 +5197,18 @@ void utcp_set_keepalive(struct utcp_connection *c, bool keepalive) {
         c->keepalive = keepalive;
 }
 
+size_t utcp_get_max_pending(struct utcp_connection *c) {
+    return c ? c->pending_to_send.max : 0;
+}
+
+void utcp_set_max_pending(struct utcp_connection *c, size_t max) {
+    if(!c)
+        return;
+    c->pending_to_send.max = max;
+    if(c->pending_to_send.max != max)
+        c->pending_to_send.max = -1;
+}
+
 size_t utcp_get_outq(struct utcp_connection *c) {
     return c ? seqdiff(c->snd.nxt, c->snd.una) : 0;
 }
@@ -2115,9 +5218,29 @@ void utcp_set_recv_cb(struct utcp_connection *c, utcp_recv_t recv) {
         c->recv = recv;
 }
 
-void utcp_set_poll_cb(struct utcp_connection *c, utcp_poll_t poll) {
+void utcp_set_recv_iov_cb(struct utcp_connection *c, utcp_recv_iov_t recv_iov) {
     if(c)
+        c->recv_iov = recv_iov;
+}
+
+bool utcp_get_rtt(struct utcp_connection *c, uint32_t *srtt, uint32_t *rttvar, uint32_t *rto) {
+    if(!c)
+        return false;
+    if(srtt)
+        *srtt = c->srtt;
+    if(rttvar)
+        *rttvar = c->rttvar;
+    if(rto)
+        *rto = c->rto;
+    return true;
+}
+
+void utcp_set_poll_cb(struct utcp_connection *c, utcp_poll_t poll) {
+    if(c) {
         c->poll = poll;
+        if(poll)
+            mark_ready(c);
+    }
 }
 
 void utcp_set_ack_cb(struct utcp_connection *c, utcp_ack_t ack) {
@@ -2125,6 +5248,21 @@ void utcp_set_ack_cb(struct utcp_connection *c, utcp_ack_t ack) {
         c->ack = ack;
 }
 
+void utcp_set_send_batch_cb(struct utcp *utcp, utcp_send_batch_t send_batch) {
+    if(utcp)
+        utcp->send_batch = send_batch;
+}
+
+void utcp_set_trace_cb(struct utcp *utcp, utcp_trace_t trace) {
+    if(utcp)
+        utcp->trace = trace;
+}
+
+void utcp_set_clock_cb(struct utcp *utcp, utcp_clock_t clock) {
+    if(utcp)
+        utcp->clock = clock;
+}
+
 void utcp_set_accept_cb(struct utcp *utcp, utcp_accept_t accept, utcp_pre_accept_t pre_accept) {
     if(utcp) {
         utcp->accept = accept;
@@ -2165,3 +5303,33 @@ bool utcp_get_rtrx_tolerance(struct utcp_connection *connection, uint32_t *toler
     *tolerance = 0;
     return false;
 }
+
+uint32_t utcp_get_priority(struct utcp_connection *c) {
+    return c ? c->priority : 0;
+}
+
+bool utcp_set_priority(struct utcp_connection *c, uint32_t priority) {
+    if(!c || !priority || priority > MAX_PRIORITY)
+        return false;
+    c->priority = priority;
+    return true;
+}
+
+bool utcp_set_congestion_control(struct utcp_connection *connection, const char *name) {
+    if(!connection || !name) {
+        return false;
+    }
+    const struct cc_ops *cc = cc_find(name);
+    if(!cc) {
+        return false;
+    }
+    if(cc != connection->cc) {
+        connection->cc = cc;
+        cc->init(connection);
+    }
+    return true;
+}
+
+const char *utcp_get_congestion_control(struct utcp_connection *connection) {
+    return connection ? connection->cc->name : NULL;
+}
@@ -52,11 +52,78 @@ typedef void (*utcp_accept_t)(struct utcp_connection *utcp_connection, uint16_t
 
 // @return the length sent or UTCP_ERROR or UTCP_WOULDBLOCK when the send buffer is full
 typedef ssize_t (*utcp_send_t)(struct utcp *utcp, const void *data, size_t len);
+// @return the number of packets sent, in order, or UTCP_ERROR or UTCP_WOULDBLOCK when none could be sent
+typedef ssize_t (*utcp_send_batch_t)(struct utcp *utcp, const struct iovec *pkts, size_t n);
 typedef void (*utcp_recv_t)(struct utcp_connection *connection, const void *data, size_t len);
+// Receives data in up to three pieces without copying: the packet payload and any buffered data it made contiguous.
+// Called with iov NULL and iovcnt 0 when the stream ends, like utcp_recv_t with len 0.
+typedef void (*utcp_recv_iov_t)(struct utcp_connection *connection, const struct iovec *iov, size_t iovcnt);
 typedef void (*utcp_ack_t)(struct utcp_connection *connection, size_t len);
 // @return 0 on success or UTCP_ERROR or UTCP_WOULDBLOCK when the send buffer is full
 typedef int (*utcp_poll_t)(struct utcp_connection *connection, size_t len);
+// Reads up to len bytes of a source at offset, see utcp_send_source(). It may be called for the same data more than once.
+// @return the number of bytes read, or -1 with errno set on error, 0 only when len is 0
+typedef ssize_t (*utcp_read_at_t)(struct utcp_connection *connection, void *data, size_t len, uint64_t offset);
 
+/** Statistics of a connection, or of an instance, see utcp_get_stats().
+ * The counters start at zero when the connection or instance is created, the other fields give the current state.
+ */
+struct utcp_stats {
+	uint64_t bytes_sent; // payload of the packets sent, retransmissions included
+	uint64_t bytes_received; // payload of the packets received, duplicates included
+	uint64_t segments_sent; // packets handed to the send callback or queued for it, pure ACKs included
+	uint64_t segments_received;
+	uint64_t retransmits; // segments sent again
+	uint64_t timeouts; // retransmit timeouts
+	uint64_t dupacks; // duplicate ACKs received
+
+	uint32_t srtt; // usec
+	uint32_t rttvar; // usec
+	uint32_t rto; // usec
+	uint32_t cwnd;
+	uint32_t ssthresh;
+	uint32_t pending; // packets queued because the send callback returned UTCP_WOULDBLOCK
+	uint32_t connections;
+	size_t sndbuf; // buffer sizes and the bytes held in them
+	size_t sndbuf_used;
+	size_t rcvbuf;
+	size_t rcvbuf_used;
+};
+
+enum utcp_trace_event {
+	UTCP_TRACE_SEND, // a packet is sent
+	UTCP_TRACE_RETRANSMIT, // a segment is sent again
+	UTCP_TRACE_RECV, // a packet arrived and is about to be processed
+	UTCP_TRACE_TIMEOUT, // the retransmit timer expired
+	UTCP_TRACE_STATE, // the connection changed state
+	UTCP_TRACE_RTT, // a round trip time was measured
+};
+
+// What the trace callback is told about an event.
+struct utcp_trace {
+	enum utcp_trace_event event;
+
+	// For packets, the header fields and the length of the payload. The flags are 1 for SYN,
+	// 2 for ACK, 4 for RTR, 8 for FIN and 16 for RST. Packets in compact format that belong to no connection
+	// only tell the sequence numbers relative to the start of the connection, as seq and ack are sent.
+	uint32_t seq;
+	uint32_t ack;
+	uint32_t wnd;
+	uint32_t len;
+	uint16_t ctl;
+
+	uint32_t value; // the rto before backing off for a timeout, the sample for an RTT, in usec
+	const char *state; // the name of the state of the connection, the new one for UTCP_TRACE_STATE
+};
+
+// Called for every tracepoint that is hit, connection is NULL for packets that belong to no connection.
+typedef void (*utcp_trace_t)(struct utcp *utcp, struct utcp_connection *connection, const struct utcp_trace *trace);
+// Sets now to the current time, see utcp_set_clock_cb().
+typedef void (*utcp_clock_t)(struct utcp *utcp, struct timeval *now);
+
+// There is no global state: different instances can be used from different threads at the same time,
+// but an instance and its connections must only be used by one thread at a time, callbacks included.
+// See utcp_group.h for running instances on a set of worker threads.
 extern struct utcp *utcp_init(utcp_accept_t accept, utcp_pre_accept_t pre_accept, utcp_send_t send, void *priv);
 extern void utcp_exit(struct utcp *utcp);
 
@@ -64,15 +131,56 @@ extern struct utcp_connection *utcp_connect(struct utcp *utcp, uint16_t port, ut
 extern void utcp_accept(struct utcp_connection *utcp, utcp_recv_t recv, void *priv);
 extern ssize_t utcp_buffer(struct utcp_connection *connection, const void *data, size_t len);
 extern ssize_t utcp_send(struct utcp_connection *connection, const void *data, size_t len);
+// Get up to len bytes of free space in the send buffer, so data can be written into it directly.
+// iov must have room for two elements, the space is split in two when it crosses a block of the buffer,
+// and may be less than len since at most two blocks are handed out at once.
+// Any other call that adds data to the send buffer cancels the reservation.
+// @return the number of iov elements filled in, or UTCP_ERROR or UTCP_WOULDBLOCK when the send buffer is full
+extern ssize_t utcp_send_reserve(struct utcp_connection *connection, struct iovec *iov, size_t len);
+// Add the first len bytes written into the reserved space to the stream and send them, like utcp_send().
+// @return the number of bytes added, or UTCP_ERROR
+extern ssize_t utcp_send_commit(struct utcp_connection *connection, size_t len);
+// Add len bytes of a source to the stream after the buffered data, read with read_at from offset on when sent.
+// Retransmissions read the data again, so it is not held in the send buffer and the source must not change
+// until it has been acked. Nothing else can be added until the peer acked the source, the poll callback is
+// called again then. When read_at fails the connection is reset, and the recv callback gets the error.
+// @return the number of bytes added, which is less than len for sources of 1 GiB or more, or UTCP_ERROR
+extern ssize_t utcp_send_source(struct utcp_connection *connection, utcp_read_at_t read_at, uint64_t offset, size_t len);
+#ifndef _WIN32
+// Send len bytes of the file fd from offset on with utcp_send_source(), reading it with pread().
+// The file descriptor must stay open until the data has been acked.
+extern ssize_t utcp_send_file(struct utcp_connection *connection, int fd, uint64_t offset, size_t len);
+#endif
 extern ssize_t utcp_recv(struct utcp *utcp, const void *data, size_t len);
+// Take up to len bytes of received data out of the receive buffer of a connection in pull mode, see utcp_set_pull().
+// @return the number of bytes read, 0 at the end of the stream, or -1 with errno EAGAIN when nothing is waiting
+extern ssize_t utcp_read(struct utcp_connection *connection, void *data, size_t len);
+// Process a number of packets at once, for example from recvmmsg(). Each connection sends at most one ACK,
+// and received data is passed to the recv callbacks in order after all packets have been processed.
+// The packet data must stay valid until the function returns.
+// @return the number of packets that were processed successfully, or -1 on error
+extern ssize_t utcp_recv_batch(struct utcp *utcp, const struct iovec *pkts, size_t n);
 extern int utcp_close(struct utcp_connection *connection);
 extern int utcp_abort(struct utcp_connection *connection);
 extern int utcp_shutdown(struct utcp_connection *connection, int how);
 extern struct timeval utcp_timeout(struct utcp *utcp);
 extern void utcp_set_recv_cb(struct utcp_connection *connection, utcp_recv_t recv);
+// When set, the vectored callback is used instead of the regular recv callback.
+extern void utcp_set_recv_iov_cb(struct utcp_connection *connection, utcp_recv_iov_t recv_iov);
 extern void utcp_set_poll_cb(struct utcp_connection *connection, utcp_poll_t poll);
 extern void utcp_set_ack_cb(struct utcp_connection *connection, utcp_ack_t ack);
 extern void utcp_set_accept_cb(struct utcp *utcp, utcp_accept_t accept, utcp_pre_accept_t pre_accept);
+// Optionally hand trains of packets to the datagram layer at once, for example with sendmmsg().
+// The regular send callback is still used for single control packets.
+extern void utcp_set_send_batch_cb(struct utcp *utcp, utcp_send_batch_t send_batch);
+// Optionally have a function called at tracepoints, for example to log packets or feed a tracing framework.
+// This costs a single test per tracepoint while no callback is set, and nothing when built with UTCP_NO_TRACE,
+// in which case the callback is never called.
+extern void utcp_set_trace_cb(struct utcp *utcp, utcp_trace_t trace);
+// Optionally take the time from a function instead of gettimeofday(), for example to run instances in simulated time.
+// The clock must never go backwards, and a time with tv_sec zero means unset, so it should not start at zero.
+// Set it before opening connections. Instances run by a utcp_group must use the real time.
+extern void utcp_set_clock_cb(struct utcp *utcp, utcp_clock_t clock);
 extern bool utcp_is_active(struct utcp *utcp);
 
 // Global socket options
@@ -86,23 +194,186 @@ extern void utcp_set_mtu(struct utcp *utcp, uint16_t mtu);
 // Set the mtu to the given value, minus the size of the utcp header. Returns the effective remaining mtu.
 extern uint16_t utcp_update_mtu(struct utcp *utcp, uint16_t mtu);
 
+// Get the largest mtu connections probe for, see utcp_set_mtu_probing().
+extern uint16_t utcp_get_mtu_probing(struct utcp *utcp);
+
+/** Let connections find out whether the path allows segments larger than the mtu,
+ * using packetization layer path MTU discovery (RFC 8899). Each connection starts at the mtu,
+ * and while it has enough data in flight it sometimes sends one segment of a larger size.
+ * When that is acknowledged, the connection uses the larger size from then on. When it is lost,
+ * it is sent again in smaller segments without treating the loss as congestion, and after several losses
+ * the search continues between the largest size that worked and the one that did not. Should large segments
+ * stop getting through later on, repeated retransmit timeouts make the connection fall back to the mtu.
+ * max is the largest payload to try, like utcp_set_mtu() without the header. The mtu remains the size that always
+ * has to work. 0 turns probing off, which is the default. Changing either restarts the search on all connections.
+ */
+extern void utcp_set_mtu_probing(struct utcp *utcp, uint16_t max);
+
+/** Get the limits up to which send and receive buffers grow automatically, see utcp_set_buffer_limits().
+ * Either pointer may be NULL.
+ */
+extern void utcp_get_buffer_limits(struct utcp *utcp, size_t *sndbuf_max, size_t *rcvbuf_max);
+
+/** Set the limits up to which send and receive buffers grow automatically.
+ * The receive window grows when the peer fills more than half of it every round trip,
+ * the send buffer grows to twice the congestion window. Buffers are never shrunk below their current size,
+ * except when memory runs out. Connections whose buffer size was set with utcp_set_sndbuf() or utcp_set_rcvbuf()
+ * are left alone. The default for both is 4 MiB.
+ */
+extern void utcp_set_buffer_limits(struct utcp *utcp, size_t sndbuf_max, size_t rcvbuf_max);
+
+// Get whether new connections use timestamps, see utcp_set_timestamps().
+extern bool utcp_get_timestamps(struct utcp *utcp);
+
+/** Offer and accept the timestamp option for new connections. Both sides must enable it.
+ * Every packet then carries when it was sent and echoes the peer's latest, so every ACK gives an RTT sample,
+ * also during loss, and old duplicate packets are dropped even when the sequence numbers wrap around (PAWS).
+ * It adds 10 bytes to every packet. Off by default.
+ */
+extern void utcp_set_timestamps(struct utcp *utcp, bool timestamps);
+
+// Get whether new connections use compact headers, see utcp_set_compact_header().
+extern bool utcp_get_compact_header(struct utcp *utcp);
+
+/** Offer and accept compact headers for new connections. Both sides must enable it.
+ * Packets other than SYNs then use a variable-length header instead of the fixed 24 bytes:
+ * sequence numbers are sent relative to the start of the connection, the window in units of 256 bytes,
+ * and fields that are zero or implied are left out. A pure ACK takes about 12 bytes. This mostly helps
+ * connections exchanging small messages, for bulk transfers the header is a small part of each packet.
+ * Port 0 must not be used, a compact header starts where a full header has the source port. Off by default.
+ */
+extern void utcp_set_compact_header(struct utcp *utcp, bool compact);
+
+// Get whether fast open is enabled, see utcp_set_fastopen().
+extern bool utcp_get_fastopen(struct utcp *utcp);
+
+/** Let connections carry data on the SYN, saving a round trip for short requests. Off by default.
+ * When connecting, utcp_connect() does not send the SYN yet, but waits for the first utcp_send()
+ * to put up to one segment of data on it, or else sends it on the next utcp_timeout().
+ * Data queued with utcp_buffer() followed by utcp_shutdown() goes out as one SYN with the FIN.
+ * When listening, a SYN with data is accepted right away: the accept callback is called,
+ * the data (and the end of the stream) passed to the recv callback, and whatever the application
+ * sends from these callbacks, up to one segment and the FIN, goes out on the SYNACK.
+ * A request and its response then take a single round trip. A peer that does not have fast open
+ * enabled ignores the data on the SYN, which is then sent again once the connection is established.
+ * There is no cookie exchange as in RFC 7413, so the listening side has no proof that the sender
+ * of a SYN with data can receive from the address it claims. This allows replay: a copied or
+ * delayed duplicate SYN is accepted and its request processed again, also after the connection
+ * has been closed. It also allows amplification: a sender can have the response, up to one
+ * segment, sent to an address it spoofed. Only enable it on the listening side if the packets
+ * UTCP is given are authenticated and protected against replay by the underlying transport,
+ * and duplicated requests are harmless.
+ */
+extern void utcp_set_fastopen(struct utcp *utcp, bool fastopen);
+
+/** Limit the memory used by the buffers and packets of all connections, in bytes. 0 means no limit, which is the default.
+ * Once three quarters of it are used, buffers no longer grow and empty ones are freed. Advertised receive windows
+ * shrink to what the remaining budget can hold, and the send buffer only accepts as much data as fits in it.
+ */
+extern void utcp_set_mem_limit(struct utcp *utcp, size_t limit);
+extern size_t utcp_get_mem_limit(struct utcp *utcp);
+// Get the number of bytes currently allocated for buffers and packets.
+extern size_t utcp_get_mem_usage(struct utcp *utcp);
+
+/** Get the statistics of an instance. The counters include the connections that were closed already, and packets that
+ * belong to no connection. cwnd, pending and the buffer fields are summed over the current connections, connections
+ * is their number, and the RTT fields are the estimate new connections start with. ssthresh is zero.
+ * Returns false if utcp or stats is NULL.
+ */
+extern bool utcp_get_stats(struct utcp *utcp, struct utcp_stats *stats);
+
 // Per-socket options
 
 extern size_t utcp_get_sndbuf(struct utcp_connection *connection);
+// Set the send buffer size, this turns off auto-tuning of it.
 extern void utcp_set_sndbuf(struct utcp_connection *connection, size_t size);
 extern size_t utcp_get_sndbuf_free(struct utcp_connection *connection);
 
 extern size_t utcp_get_rcvbuf(struct utcp_connection *connection);
+// Set the receive window size, this turns off auto-tuning of it.
 extern void utcp_set_rcvbuf(struct utcp_connection *connection, size_t size);
 extern size_t utcp_get_rcvbuf_free(struct utcp_connection *connection);
 
+// Get whether received data waits for utcp_read(), see utcp_set_pull().
+extern bool utcp_get_pull(struct utcp_connection *connection);
+
+/** Keep received data in the receive buffer until the application takes it with utcp_read(),
+ * instead of passing it to the recv callback right away. The advertised window shrinks by what is waiting,
+ * so a slow reader holds back the sender rather than having to queue the data itself. Once reading has
+ * opened up a quarter of the receive buffer, the peer is sent a window update.
+ * Whenever data arrives, the recv callback is called with data NULL and len the number of bytes waiting.
+ * The end of the stream is reported with len 0 as usual, what is still waiting can be read after that.
+ * The vectored callback is only used for the end of the stream. Off by default.
+ * Returns false if connection is NULL, or if pull mode is turned off while data is waiting.
+ */
+extern bool utcp_set_pull(struct utcp_connection *connection, bool pull);
+
 extern bool utcp_get_nodelay(struct utcp_connection *connection);
+// Send small segments right away. Otherwise, at most one segment smaller than the mtu is unacknowledged at a time (Nagle).
 extern void utcp_set_nodelay(struct utcp_connection *connection, bool nodelay);
 
+/** Get the autocork delay in usec, or 0 if autocork is off. */
+extern uint32_t utcp_get_autocork(struct utcp_connection *connection);
+
+/** Hold back a segment smaller than the mtu until an ACK arrives or usec have passed,
+ * even when nothing is in flight, so more data from the application can be added to it.
+ * This is on top of Nagle's algorithm, and disabled by utcp_set_nodelay(). 0 turns it off, which is the default.
+ */
+extern void utcp_set_autocork(struct utcp_connection *connection, uint32_t usec);
+
+/** Acknowledge in-order data only every segments full-sized segments, or usec after the first
+ * unacknowledged one arrived, whichever comes first. Out-of-order data, short segments and FINs
+ * are still acknowledged right away, and any data sent back carries the ACK too.
+ * segments 0 or 1 acknowledges every segment, which is the default.
+ * Returns true on success, false if usec is 0 while segments is larger than 1.
+ */
+extern bool utcp_set_delayed_ack(struct utcp_connection *connection, uint32_t segments, uint32_t usec);
+
+/** Get the delayed ACK policy, see utcp_set_delayed_ack().
+ * Either pointer may be NULL.
+ * Returns true on success, false if connection is NULL.
+ */
+extern bool utcp_get_delayed_ack(struct utcp_connection *connection, uint32_t *segments, uint32_t *usec);
+
+/** Get whether segments are paced, see utcp_set_pacing(). */
+extern bool utcp_get_pacing(struct utcp_connection *connection);
+
+/** Spread the segments of the congestion window out over the round trip time,
+ * instead of sending them in line-rate bursts. The rate comes from the congestion
+ * control algorithm, or from cwnd and the RTT estimate. utcp_timeout() returns when the
+ * next burst is due. Off by default.
+ */
+extern void utcp_set_pacing(struct utcp_connection *connection, bool pacing);
+
 extern bool utcp_get_keepalive(struct utcp_connection *connection);
 extern void utcp_set_keepalive(struct utcp_connection *connection, bool keepalive);
 
 extern size_t utcp_get_outq(struct utcp_connection *connection);
+// Get the payload size of the segments a connection currently sends, see utcp_set_mtu_probing().
+extern uint16_t utcp_get_connection_mtu(struct utcp_connection *connection);
+
+/** Get the statistics of a connection, see struct utcp_stats. connections is zero.
+ * Returns false if connection or stats is NULL.
+ */
+extern bool utcp_get_connection_stats(struct utcp_connection *connection, struct utcp_stats *stats);
+
+/** Get the round trip time estimate of a connection, in microseconds.
+ * srtt and rttvar are zero until the first RTT sample is taken.
+ * Any of the pointers may be NULL.
+ * Returns false if connection is NULL.
+ */
+extern bool utcp_get_rtt(struct utcp_connection *connection, uint32_t *srtt, uint32_t *rttvar, uint32_t *rto);
+
+/** Get the maximum number of packets that are queued when the send callback
+ * returns UTCP_WOULDBLOCK.
+ */
+extern size_t utcp_get_max_pending(struct utcp_connection *connection);
+
+/** Set the maximum number of packets that are queued when the send callback
+ * returns UTCP_WOULDBLOCK. Packets that do not fit are dropped.
+ * Already queued packets are kept when the limit is lowered.
+ */
+extern void utcp_set_max_pending(struct utcp_connection *connection, size_t max);
 
 /** Set connection maximum congestion window size.
  * Set to 0 for no maximum.
@@ -128,4 +399,26 @@ extern bool utcp_set_rtrx_tolerance(struct utcp_connection *conection, uint32_t
  */
 extern bool utcp_get_rtrx_tolerance(struct utcp_connection *connection, uint32_t *tolerance);
 
+/** Set the share of transmit opportunities of a connection, from 1 to 1024. The default is 1.
+ * utcp_timeout() serves connections that have data or queued packets to send in deficit round robin order,
+ * each turn a connection may send its priority times the mtu in bytes, so a connection with priority 4 gets four times
+ * the bandwidth of one with priority 1 when the datagram layer is the bottleneck.
+ * Returns true on success, false if priority is out of range.
+ */
+extern bool utcp_set_priority(struct utcp_connection *connection, uint32_t priority);
+
+// Get the priority of a connection, see utcp_set_priority().
+extern uint32_t utcp_get_priority(struct utcp_connection *connection);
+
+/** Set the congestion control algorithm of a connection: "reno", "cubic" or "bbr".
+ * The default is "reno". Switching algorithms keeps the current congestion window.
+ * Returns true on success, false if the algorithm is unknown.
+ */
+extern bool utcp_set_congestion_control(struct utcp_connection *connection, const char *name);
+
+/** Get the name of the congestion control algorithm of a connection.
+ * Returns NULL if connection is NULL.
+ */
+extern const char *utcp_get_congestion_control(struct utcp_connection *connection);
+
 #endif
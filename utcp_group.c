@@ -0,0 +1,509 @@
+/*
+    utcp_group.c -- Running UTCP instances on a set of worker threads
+    Copyright (C) 2014 Guus Sliepen <guus@tinc-vpn.org>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "utcp_group.h"
+
+#ifndef timeradd
+#define timeradd(a, b, r) do {\
+    (r)->tv_sec = (a)->tv_sec + (b)->tv_sec;\
+    (r)->tv_usec = (a)->tv_usec + (b)->tv_usec;\
+    if((r)->tv_usec >= 1000000)\
+        (r)->tv_sec++, (r)->tv_usec -= 1000000;\
+} while (0)
+#endif
+
+#define IDLE_TIMEOUT 3600 // sec, how long a shard without timers sleeps
+
+enum msg_type {
+    MSG_ADD,
+    MSG_REMOVE,
+    MSG_RECV,
+    MSG_CALL,
+};
+
+// Packet data is stored right after the message.
+struct msg {
+    struct msg *next;
+    enum msg_type type;
+    struct utcp_group_member *member;
+    utcp_group_call_t fn;
+    void *arg;
+    size_t len;
+};
+
+// Intrusive multiple producer, single consumer queue (Vyukov).
+// Producers only swap the head pointer, the consumer is the only one touching tail.
+struct inbox {
+    struct msg *head; // last message posted
+    struct msg *tail; // next message to take out
+    struct msg stub; // keeps the queue non-empty so producers never touch tail
+};
+
+struct shard {
+    struct utcp_group *group;
+    unsigned int index;
+    pthread_t thread;
+    struct inbox inbox;
+    unsigned int load; // number of members, only used for placement
+
+    // Waking up an idle shard
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool sleeping;
+
+    // Only touched by the shard's thread
+
+    struct utcp_group_member *members;
+    struct utcp_group_member *dirty; // members that need utcp_timeout() before sleeping
+    struct timeval next; // earliest deadline of all members
+};
+
+struct utcp_group {
+    bool stop;
+    unsigned int nshards;
+    struct shard *shards;
+};
+
+// A member is freed when the last reference is gone: one for the membership, and one for each message to it,
+// so threads that post to it while it is being removed never touch freed memory.
+struct utcp_group_member {
+    struct utcp *utcp;
+    struct shard *shard;
+    unsigned int refs;
+    bool removed; // only touched by the shard's thread
+    struct utcp_group_member *prev;
+    struct utcp_group_member *next;
+    struct utcp_group_member *next_dirty;
+    bool dirty;
+    struct timeval deadline; // when utcp_timeout() has to run again
+};
+
+static void inbox_init(struct inbox *inbox) {
+    inbox->stub.next = NULL;
+    inbox->head = &inbox->stub;
+    inbox->tail = &inbox->stub;
+}
+
+static void inbox_push(struct inbox *inbox, struct msg *msg) {
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    struct msg *prev = __atomic_exchange_n(&inbox->head, msg, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+// @return the oldest message, or NULL when there is none or a producer has not finished linking its message yet
+static struct msg *inbox_pop(struct inbox *inbox) {
+    struct msg *tail = inbox->tail;
+    struct msg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(tail == &inbox->stub) {
+        if(!next)
+            return NULL;
+
+        inbox->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next) {
+        inbox->tail = next;
+        return tail;
+    }
+
+    if(tail != __atomic_load_n(&inbox->head, __ATOMIC_SEQ_CST))
+        return NULL;
+
+    // tail is the last message, put the stub behind it so it can be taken out
+    inbox_push(inbox, &inbox->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(next) {
+        inbox->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+// Only valid for the consumer. A message that is still being linked counts as present.
+static bool inbox_empty(struct inbox *inbox) {
+    return inbox->tail == &inbox->stub && __atomic_load_n(&inbox->head, __ATOMIC_SEQ_CST) == &inbox->stub;
+}
+
+static void post(struct shard *shard, struct msg *msg) {
+    inbox_push(&shard->inbox, msg);
+
+    // pairs with the store in shard_sleep(), one of the two sees the other
+    if(__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&shard->lock);
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void member_unref(struct utcp_group_member *member) {
+    if(!__atomic_sub_fetch(&member->refs, 1, __ATOMIC_ACQ_REL))
+        free(member);
+}
+
+static struct msg *msg_alloc(struct utcp_group_member *member, enum msg_type type, size_t len) {
+    struct msg *msg = malloc(sizeof *msg + len);
+
+    if(!msg)
+        return NULL;
+
+    __atomic_add_fetch(&member->refs, 1, __ATOMIC_RELAXED);
+    msg->type = type;
+    msg->member = member;
+    msg->fn = NULL;
+    msg->arg = NULL;
+    msg->len = len;
+    return msg;
+}
+
+static void mark_dirty(struct shard *shard, struct utcp_group_member *member) {
+    if(member->dirty)
+        return;
+
+    member->dirty = true;
+    member->next_dirty = shard->dirty;
+    shard->dirty = member;
+}
+
+static void run_timeout(struct shard *shard, struct utcp_group_member *member, const struct timeval *now) {
+    struct timeval timeout = utcp_timeout(member->utcp);
+    timeradd(now, &timeout, &member->deadline);
+
+    if(timercmp(&member->deadline, &shard->next, <))
+        shard->next = member->deadline;
+}
+
+static void flush_dirty(struct shard *shard) {
+    if(!shard->dirty)
+        return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    while(shard->dirty) {
+        struct utcp_group_member *member = shard->dirty;
+        shard->dirty = member->next_dirty;
+        member->dirty = false;
+        run_timeout(shard, member, &now);
+    }
+}
+
+static void handle_msg(struct shard *shard, struct msg *msg) {
+    struct utcp_group_member *member = msg->member;
+
+    // drop what was posted to a member that already left
+    if(member->removed) {
+        member_unref(member);
+        free(msg);
+        return;
+    }
+
+    switch(msg->type) {
+    case MSG_ADD:
+        member->prev = NULL;
+        member->next = shard->members;
+
+        if(shard->members)
+            shard->members->prev = member;
+
+        shard->members = member;
+        mark_dirty(shard, member);
+        break;
+
+    case MSG_REMOVE:
+        // let the instance finish what it was asked to do before it leaves
+        flush_dirty(shard);
+
+        if(member->prev)
+            member->prev->next = member->next;
+        else
+            shard->members = member->next;
+
+        if(member->next)
+            member->next->prev = member->prev;
+
+        if(msg->fn)
+            msg->fn(member->utcp, msg->arg);
+
+        member->removed = true;
+        member_unref(member);
+        break;
+
+    case MSG_RECV:
+        utcp_recv(member->utcp, msg + 1, msg->len);
+        mark_dirty(shard, member);
+        break;
+
+    case MSG_CALL:
+        msg->fn(member->utcp, msg->arg);
+        mark_dirty(shard, member);
+        break;
+    }
+
+    member_unref(member);
+    free(msg);
+}
+
+// Run utcp_timeout() for all members whose deadline has passed, and find the next deadline.
+static void expire_timers(struct shard *shard) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    if(timercmp(&now, &shard->next, <))
+        return;
+
+    shard->next.tv_sec = now.tv_sec + IDLE_TIMEOUT;
+    shard->next.tv_usec = now.tv_usec;
+
+    for(struct utcp_group_member *member = shard->members; member; member = member->next) {
+        if(!timercmp(&now, &member->deadline, <))
+            run_timeout(shard, member, &now);
+        else if(timercmp(&member->deadline, &shard->next, <))
+            shard->next = member->deadline;
+    }
+}
+
+static void shard_sleep(struct shard *shard) {
+    struct timespec ts = {shard->next.tv_sec, shard->next.tv_usec * 1000};
+
+    pthread_mutex_lock(&shard->lock);
+    __atomic_store_n(&shard->sleeping, true, __ATOMIC_SEQ_CST);
+
+    if(inbox_empty(&shard->inbox) && !__atomic_load_n(&shard->group->stop, __ATOMIC_ACQUIRE))
+        pthread_cond_timedwait(&shard->cond, &shard->lock, &ts);
+
+    __atomic_store_n(&shard->sleeping, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void *shard_run(void *arg) {
+    struct shard *shard = arg;
+
+    for(;;) {
+        struct msg *msg;
+
+        while((msg = inbox_pop(&shard->inbox)))
+            handle_msg(shard, msg);
+
+        flush_dirty(shard);
+
+        if(__atomic_load_n(&shard->group->stop, __ATOMIC_ACQUIRE) && inbox_empty(&shard->inbox))
+            break;
+
+        expire_timers(shard);
+        shard_sleep(shard);
+    }
+
+    return NULL;
+}
+
+static void shard_exit(struct shard *shard) {
+    // drop what other shards posted while they were stopping
+    struct msg *msg;
+
+    while((msg = inbox_pop(&shard->inbox))) {
+        // the membership of a member that never joined ends here
+        if(msg->type == MSG_ADD)
+            member_unref(msg->member);
+
+        member_unref(msg->member);
+        free(msg);
+    }
+
+    while(shard->members) {
+        struct utcp_group_member *member = shard->members;
+        shard->members = member->next;
+        member_unref(member);
+    }
+
+    pthread_cond_destroy(&shard->cond);
+    pthread_mutex_destroy(&shard->lock);
+}
+
+static void stop_shards(struct utcp_group *group, unsigned int n) {
+    __atomic_store_n(&group->stop, true, __ATOMIC_RELEASE);
+
+    for(unsigned int i = 0; i < n; i++) {
+        struct shard *shard = &group->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // shards can still post to each other until all of them have stopped
+    for(unsigned int i = 0; i < n; i++)
+        pthread_join(group->shards[i].thread, NULL);
+
+    for(unsigned int i = 0; i < n; i++)
+        shard_exit(&group->shards[i]);
+}
+
+struct utcp_group *utcp_group_init(unsigned int nshards) {
+    if(!nshards) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct utcp_group *group = calloc(1, sizeof *group);
+
+    if(!group)
+        return NULL;
+
+    group->shards = calloc(nshards, sizeof *group->shards);
+
+    if(!group->shards) {
+        free(group);
+        return NULL;
+    }
+
+    for(unsigned int i = 0; i < nshards; i++) {
+        struct shard *shard = &group->shards[i];
+        shard->group = group;
+        shard->index = i;
+        inbox_init(&shard->inbox);
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+
+        if(pthread_create(&shard->thread, NULL, shard_run, shard)) {
+            pthread_cond_destroy(&shard->cond);
+            pthread_mutex_destroy(&shard->lock);
+            stop_shards(group, i);
+            free(group->shards);
+            free(group);
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    group->nshards = nshards;
+    return group;
+}
+
+void utcp_group_exit(struct utcp_group *group) {
+    if(!group)
+        return;
+
+    stop_shards(group, group->nshards);
+    free(group->shards);
+    free(group);
+}
+
+struct utcp_group_member *utcp_group_add(struct utcp_group *group, struct utcp *utcp) {
+    if(!group || !utcp) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct shard *shard = &group->shards[0];
+
+    for(unsigned int i = 1; i < group->nshards; i++)
+        if(__atomic_load_n(&group->shards[i].load, __ATOMIC_RELAXED) < __atomic_load_n(&shard->load, __ATOMIC_RELAXED))
+            shard = &group->shards[i];
+
+    struct utcp_group_member *member = calloc(1, sizeof *member);
+
+    if(!member)
+        return NULL;
+
+    member->utcp = utcp;
+    member->shard = shard;
+    member->refs = 1;
+
+    struct msg *msg = msg_alloc(member, MSG_ADD, 0);
+
+    if(!msg) {
+        free(member);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&shard->load, 1, __ATOMIC_RELAXED);
+    post(shard, msg);
+    return member;
+}
+
+bool utcp_group_remove(struct utcp_group_member *member, utcp_group_call_t done, void *arg) {
+    if(!member) {
+        errno = EFAULT;
+        return false;
+    }
+
+    struct msg *msg = msg_alloc(member, MSG_REMOVE, 0);
+
+    if(!msg)
+        return false;
+
+    msg->fn = done;
+    msg->arg = arg;
+    __atomic_sub_fetch(&member->shard->load, 1, __ATOMIC_RELAXED);
+    post(member->shard, msg);
+    return true;
+}
+
+bool utcp_group_recv(struct utcp_group_member *member, const void *data, size_t len) {
+    if(!member || (!data && len)) {
+        errno = EFAULT;
+        return false;
+    }
+
+    struct msg *msg = msg_alloc(member, MSG_RECV, len);
+
+    if(!msg)
+        return false;
+
+    if(len)
+        memcpy(msg + 1, data, len);
+
+    post(member->shard, msg);
+    return true;
+}
+
+bool utcp_group_call(struct utcp_group_member *member, utcp_group_call_t fn, void *arg) {
+    if(!member || !fn) {
+        errno = EFAULT;
+        return false;
+    }
+
+    struct msg *msg = msg_alloc(member, MSG_CALL, 0);
+
+    if(!msg)
+        return false;
+
+    msg->fn = fn;
+    msg->arg = arg;
+    post(member->shard, msg);
+    return true;
+}
+
+unsigned int utcp_group_get_shard(const struct utcp_group_member *member) {
+    return member->shard->index;
+}
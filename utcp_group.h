@@ -0,0 +1,61 @@
+/*
+    utcp_group.h -- Running UTCP instances on a set of worker threads
+    Copyright (C) 2014 Guus Sliepen <guus@tinc-vpn.org>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UTCP_GROUP_H
+#define UTCP_GROUP_H
+
+#include "utcp.h"
+
+/**
+ * A group spreads UTCP instances over a number of shards, each served by its own worker thread.
+ * A shard owns its instances: it feeds them incoming packets, runs utcp_timeout() when their
+ * timers expire, and runs any other code that touches them, so instances never need locking.
+ * All callbacks of an instance are therefore called from its shard's thread.
+ *
+ * Other threads talk to a shard through its inbox, a lock-free queue that any number of threads
+ * can post to. Posting only takes the shard's lock to wake it up when it is idle.
+ */
+struct utcp_group;
+struct utcp_group_member;
+
+typedef void (*utcp_group_call_t)(struct utcp *utcp, void *arg);
+
+// @return a group with nshards worker threads, or NULL on error
+extern struct utcp_group *utcp_group_init(unsigned int nshards);
+// Process all messages that were already posted, then stop the worker threads.
+// Packets that instances send to each other while the group stops are dropped.
+// Instances that are still members are not freed, they can be used by the calling thread afterwards.
+extern void utcp_group_exit(struct utcp_group *group);
+
+// Hand an instance over to the shard with the fewest members.
+// From now on it may only be used through utcp_group_recv() and utcp_group_call().
+// @return the membership, or NULL on error
+extern struct utcp_group_member *utcp_group_add(struct utcp_group *group, struct utcp *utcp);
+// Take an instance out of its shard. When done is not NULL, it is called from the shard's thread
+// once the instance has left, for example to call utcp_exit().
+// Packets and calls posted to the member from then on are dropped. The membership is freed with the last of them,
+// so no thread may start posting to it anymore once done has returned.
+extern bool utcp_group_remove(struct utcp_group_member *member, utcp_group_call_t done, void *arg);
+// Pass a copy of an incoming packet to utcp_recv() on the instance's shard.
+extern bool utcp_group_recv(struct utcp_group_member *member, const void *data, size_t len);
+// Call fn on the instance's shard, for example to open connections or send data.
+extern bool utcp_group_call(struct utcp_group_member *member, utcp_group_call_t fn, void *arg);
+extern unsigned int utcp_group_get_shard(const struct utcp_group_member *member);
+
+#endif
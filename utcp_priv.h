@@ -31,19 +31,40 @@
 #define FIN 0x08
 #define RST 0x10
 
-#define NSACKS 4
+#ifndef NSACKS
+#define NSACKS 4 // number of out-of-order ranges tracked, on both the receiving and sending side
+#endif
 #define DEFAULT_SNDBUFSIZE 4096
 #define DEFAULT_MAXSNDBUFSIZE 131072
 #define DEFAULT_RCVBUFSIZE 0
 #define DEFAULT_MAXRCVBUFSIZE 131072
+#define DEFAULT_AUTOTUNE_MAX 4194304 // how large buffers may grow automatically
+#define MAX_RCVBUFSIZE (1U << 30)
+#define MAX_SOURCE_LEN (1U << 30) // bytes utcp_send_source() adds at once
 
 #define DEFAULT_MTU 1000
+#define PKT_POOL_SIZE 64 // maximum number of free packet buffers kept per utcp
+#define DEFAULT_MAX_PENDING 64 // maximum number of packets queued per connection
+#define DEFAULT_PRIORITY 1 // share of transmit opportunities when utcp_timeout() serves connections
+#define MAX_PRIORITY 1024
+#define SEND_BATCH_SIZE 32 // maximum number of packets handed to the batch send callback at once
+#define NPORTS 0x8000 // number of local ports with the high bit set
 
 #define USEC_PER_SEC 1000000
 #define DEFAULT_USER_TIMEOUT 60 // sec
 #define CLOCK_GRANULARITY 1000 // usec
+#define DEFAULT_ACK_DELAY 40000 // usec
 #define START_RTO 1000000 // usec
 #define MAX_RTO  60000000 // usec
+#define DUPTHRESH 3 // duplicate ACKs that start fast retransmit while no reordering was seen
+#define MAX_REORDERING 128 // segments the duplicate ACK threshold grows to at most
+
+// Path MTU discovery, see RFC 8899
+#define PMTU_SEARCH_STEP 32 // bytes, stop searching once the range is this narrow
+#define PMTU_MAX_PROBES 3 // losses before a probe size is taken as too large
+#define PMTU_PROBE_FOLLOWERS 3 // segments that have to follow a probe, so its loss shows as triplicate ACK
+#define PMTU_RAISE_INTERVAL 600 // sec, after which a finished search is started again
+#define PMTU_BLACK_HOLE 2 // retransmit timeouts in a row at a raised mtu that make it fall back
 
 struct hdr {
     uint16_t src; // Source port
@@ -57,14 +78,59 @@ struct hdr {
     uint16_t aux; // other stuff
 };
 
+// Capabilities offered in hdr.aux of a SYN packet.
+// The SYN|ACK contains the ones both sides support.
+#define CAP_SACK 0x0001
+#define CAP_TS 0x0002
+#define CAP_COMPACT 0x0004
+#define DEFAULT_CAPS (CAP_SACK)
+
+// Once capabilities are negotiated, other packets can carry options between the header and the data.
+// hdr.aux then holds the length of the options in bytes.
+// Each option starts with a kind and a length byte, the length includes these two bytes.
+#define OPT_SACK 1 // pairs of uint32_t offset and length of received data, relative to hdr.ack
+#define MAX_SACK_BLOCKS 8 // maximum number of SACK blocks sent in one packet
+#define OPT_TS 2 // uint32_t timestamp of the sender in usec, and the last one received from the peer, first in every packet
+#define TS_OPTION_LEN (2 + 2 * sizeof(uint32_t))
+#define PAWS_IDLE 600 // sec, timestamps older than this can no longer be compared
+
+// With CAP_COMPACT, packets other than SYNs are sent with a compact header when that is shorter:
+//   uint16_t zero: where a full header has the source port, which is never 0
+//   uint8_t ctl: the flags, plus C_SEQ, C_TRS and C_AUX telling which of the optional fields follow
+//   uint16_t src, dst
+//   varint seq, relative to the sender's ISN, if C_SEQ; otherwise the receiver uses its rcv.nxt
+//   varint ack, relative to the receiver's ISN, if ACK is set
+//   varint wnd >> COMPACT_WND_SHIFT
+//   varint trs and tra, if C_TRS; otherwise both are 0
+//   varint aux, if C_AUX; otherwise it is 0
+// Varints hold 7 bits per byte, least significant first, with the high bit set on all but the last byte.
+// Being relative to the ISNs, seq and ack stay short on connections that carried little data,
+// and unlike deltas to earlier packets they can be decoded after loss and reordering.
+#define C_SEQ 0x20
+#define C_TRS 0x40
+#define C_AUX 0x80
+#define COMPACT_WND_SHIFT 8
+#define MAX_COMPACT_HDR 32
+
 struct pkt_t {
     struct hdr      hdr;
     char            data[];
 };
 
-struct pkt_entry_t {
-    struct pkt_t    *pkt;
-    uint32_t        len;
+// Packet buffers are allocated with this header in front of the packet.
+// It links buffers in the pool or in a connection's queue of packets to send.
+struct pkt_buf {
+    struct pkt_buf  *next;
+    uint32_t        size; // maximum payload size
+    uint32_t        len; // packet length while queued
+};
+
+// Intrusive queue of packets waiting for the datagram layer to accept them
+struct pkt_queue {
+    struct pkt_buf  *head;
+    struct pkt_buf  *tail;
+    uint32_t        count;
+    uint32_t        max; // maximum number of queued packets
 };
 
 enum state {
@@ -95,12 +161,19 @@ static const char *strstate[] __attribute__((unused)) = {
     [TIME_WAIT] = "TIME_WAIT"
 };
 
+// Memory used by all buffers and packets of a struct utcp
+struct mem_account {
+    size_t used; // bytes
+    size_t limit; // bytes, 0 for no limit
+};
+
 struct buffer {
     char *data; // is implemented as a ring buffer so use buffer_copy to get data before passing to application
     uint32_t start;
     uint32_t used;
     uint32_t size;
     uint32_t maxsize;
+    struct mem_account *mem; // charged for the allocated size, may be NULL
 };
 
 extern uint32_t buffer_free(const struct buffer *buf);
@@ -108,23 +181,175 @@ extern ssize_t buffer_put_at(struct buffer *buf, size_t offset, const void *data
 extern ssize_t buffer_put(struct buffer *buf, const void *data, size_t len);
 extern ssize_t buffer_get(struct buffer *buf, void *data, size_t len);
 extern ssize_t buffer_copy(struct buffer *buf, void *data, size_t offset, size_t len);
+extern size_t buffer_peek(const struct buffer *buf, struct iovec *iov, size_t offset, size_t len);
+extern ssize_t buffer_reserve(struct buffer *buf, struct iovec *iov, size_t len);
+extern size_t buffer_commit(struct buffer *buf, size_t len);
 extern bool buffer_init(struct buffer *buf, uint32_t len, uint32_t maxlen);
 extern void buffer_exit(struct buffer *buf);
+extern void buffer_account(struct buffer *buf, struct mem_account *mem);
+extern void buffer_release(struct buffer *buf);
+
+#define CHUNK_SIZE 4096 // bytes per block of a chunk_buffer
+
+// A buffer made of fixed-size blocks, so it grows without moving data, and blocks emptied at the front are reused.
+// The blocks form a ring in the chunks array, the data begins start bytes into the first one.
+struct chunk_buffer {
+    char **chunks;
+    uint32_t cap; // number of entries in chunks
+    uint32_t head; // index of the first block
+    uint32_t nchunks; // number of blocks allocated
+    uint32_t start;
+    uint32_t used;
+    uint32_t size; // nchunks * CHUNK_SIZE
+    uint32_t maxsize;
+    struct mem_account *mem; // charged for the blocks, may be NULL
+};
+
+extern uint32_t chunk_buffer_free(const struct chunk_buffer *buf);
+extern ssize_t chunk_buffer_put(struct chunk_buffer *buf, const void *data, size_t len);
+extern ssize_t chunk_buffer_get(struct chunk_buffer *buf, void *data, size_t len);
+extern ssize_t chunk_buffer_copy(const struct chunk_buffer *buf, void *data, size_t offset, size_t len);
+extern ssize_t chunk_buffer_reserve(struct chunk_buffer *buf, struct iovec *iov, size_t len);
+extern size_t chunk_buffer_commit(struct chunk_buffer *buf, size_t len);
+extern bool chunk_buffer_init(struct chunk_buffer *buf, uint32_t len, uint32_t maxlen);
+extern void chunk_buffer_exit(struct chunk_buffer *buf);
+extern void chunk_buffer_account(struct chunk_buffer *buf, struct mem_account *mem);
+extern void chunk_buffer_release(struct chunk_buffer *buf);
+
+extern struct pkt_t *pkt_pool_get(struct utcp *utcp);
+extern void pkt_pool_put(struct utcp *utcp, struct pkt_t *pkt);
+extern void pkt_pool_exit(struct utcp *utcp);
+
+struct deferred_recv {
+    struct utcp_connection *c;
+    const void *data;
+    size_t len;
+    int error; // errno to report with an end of stream notification
+};
 
 struct sack {
     uint32_t offset;
     uint32_t len;
 };
 
+// Range of sequence numbers the peer has SACKed
+struct sack_block {
+    uint32_t start;
+    uint32_t end;
+};
+
+#define MAX_OOO_RANGES 1024 // out-of-order ranges a receive buffer holds at most, later islands are dropped
+
+struct range_node {
+    struct sack_block range;
+    struct range_node *left;
+    struct range_node *right;
+    int height;
+};
+
+// Disjoint ranges of bytes at offsets from a base that only moves forward, like the out-of-order data in a receive buffer.
+// Ranges are stored as positions, offset + base, so moving the base only touches the ranges it passes.
+// Up to NSACKS ranges are kept in a sorted array, with more they move to an AVL tree ordered by start.
+struct range_set {
+    uint32_t base;
+    uint32_t count;
+    uint32_t bytes; // in all ranges together
+    struct sack_block ranges[NSACKS]; // used while root is NULL
+    struct range_node *root;
+    struct mem_account *mem; // charged for the tree nodes, may be NULL
+};
+
+extern void range_set_init(struct range_set *set, struct mem_account *mem);
+extern void range_set_exit(struct range_set *set);
+extern bool range_set_add(struct range_set *set, uint32_t offset, uint32_t len);
+extern void range_set_consume(struct range_set *set, uint32_t len);
+extern size_t range_set_get(const struct range_set *set, struct sack *ranges, size_t n);
+extern bool range_set_find(const struct range_set *set, uint32_t offset, struct sack *range);
+extern uint32_t range_set_end(const struct range_set *set);
+
+// Options parsed from an incoming packet
+struct options {
+    uint32_t nsacks;
+    struct sack sacks[MAX_SACK_BLOCKS];
+    bool ts; // ts_val and ts_ecr are valid
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+};
+
+// Congestion control algorithm, the implementations are in congestion.c.
+// The caller limits cwnd to the buffer sizes and cwnd_max afterwards.
+struct cc_ops {
+    const char *name;
+    // Reset the algorithm's state, when the connection starts to use it
+    void (*init)(struct utcp_connection *c);
+    // acked bytes of new data were acknowledged at now. rtt is the RTT sample taken from this ACK, or 0.
+    // recovery is true while the peer acknowledges older transmits than the current one.
+    void (*on_ack)(struct utcp_connection *c, uint32_t acked, uint32_t rtt, bool recovery, const struct timeval *now);
+    // Loss detected by duplicate ACKs, the missing data is sent again right away
+    void (*on_loss)(struct utcp_connection *c);
+    // The last on_loss() was for a segment that was only reordered, the caller restored cwnd and ssthresh already
+    void (*on_undo)(struct utcp_connection *c);
+    // The retransmit timer expired
+    void (*on_rto)(struct utcp_connection *c);
+    // @return the rate in bytes per second to pace packets at, or 0 to send as fast as cwnd allows
+    uint64_t (*pacing_rate)(const struct utcp_connection *c);
+};
+
+extern const struct cc_ops cc_reno;
+extern const struct cc_ops cc_cubic;
+extern const struct cc_ops cc_bbr;
+extern const struct cc_ops *cc_find(const char *name);
+
+struct cubic_state {
+    struct timeval epoch_start; // start of the current congestion avoidance epoch, zero if none
+    uint32_t w_max; // cwnd before the last reduction
+    uint32_t prior_w_max; // w_max before it, to go back to if the reduction is undone
+    uint32_t origin; // cwnd the cubic function grows back to
+    double k; // time in seconds to reach origin
+    double w_est; // cwnd Reno would have
+    double frac; // increments not applied to cwnd yet
+};
+
+#define BBR_BW_ROUNDS 10 // number of rounds the bandwidth estimate is the maximum of
+
+enum bbr_mode {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+};
+
+struct bbr_state {
+    enum bbr_mode mode;
+    uint64_t delivered; // the connection's delivered count at tlast
+    uint64_t bw[BBR_BW_ROUNDS]; // delivery rate samples of the last rounds
+    uint32_t round;
+    uint32_t min_rtt; // usec
+    struct timeval min_rtt_stamp;
+    uint64_t full_bw; // bandwidth at the last time it grew by 25% during startup
+    uint32_t full_bw_count; // rounds since then
+    uint32_t cycle; // position in the PROBE_BW gain cycle
+    uint64_t inflight_hi; // bytes in flight the path holds without loss, 0 until a loss was seen
+    uint64_t prior_inflight_hi; // inflight_hi before the last loss, to go back to if it is undone
+    uint32_t probe_up; // bytes inflight_hi grows by in the next round without loss
+    bool loss_in_round; // a loss was detected in the current round
+};
+
 struct utcp_connection {
     void *priv;
     struct utcp *utcp;
 
     bool reapable;
+    uint16_t caps; // capabilities negotiated with the peer
+    bool ephemeral; // src was picked by allocate_connection()
+    int index; // position in utcp->connections
+    bool ready; // on the ready list
+    struct utcp_connection *ready_prev;
+    struct utcp_connection *ready_next;
 
     // Callbacks
 
     utcp_recv_t recv;
+    utcp_recv_iov_t recv_iov;
     utcp_poll_t poll;
         utcp_ack_t ack;
 
@@ -142,6 +367,8 @@ struct utcp_connection {
         uint32_t iss;
 
         uint32_t last;
+        uint32_t max; // highest snd.nxt so far, snd.nxt goes back for retransmissions
+        uint32_t small; // end of the last segment sent that was smaller than the maximum
         uint32_t cwnd;
         uint32_t ssthresh;
     } snd;
@@ -156,32 +383,128 @@ struct utcp_connection {
 
     int dupack;
 
+    // Fast recovery
+
+    bool fast_recovery; // retransmitted snd.una after duplicate ACKs, until recover is acknowledged
+    uint32_t recover; // snd.nxt when fast recovery started
+    uint32_t recover_cwnd; // cwnd to continue with after fast recovery
+    uint32_t rtx_next; // with SACK, holes before this were sent again during fast recovery
+    struct timeval rtx_stamp; // when fast recovery sent snd.una again, zero once the ACK for it was checked
+    uint32_t undo_cwnd; // cwnd and ssthresh before fast recovery reduced them
+    uint32_t undo_ssthresh;
+    uint32_t reordering; // duplicate ACKs that start fast recovery, grows when a hole turns out to be reordered
+
+    // Receive batching
+
+    uint32_t delack_count; // full-sized segments received since the last packet we sent
+    bool ack_pending; // an ACK is sent at the end of the batch
+    bool ack_ahead; // a packet in the batch was ahead of the next sequence number
+    struct utcp_connection *ack_next;
+
     // Timers
 
     struct timeval conn_timeout;
     struct timeval rtrx_timeout;
+    struct timeval pace_timeout; // when the pacing rate allows sending the rest of cwnd
+    struct timeval pace_next; // earliest time the next burst of segments may be sent
+    struct timeval delack_timeout; // when to send an ACK that was held back
+    struct timeval cork_timeout; // when to send a small segment that was held back
+    uint32_t heap_pos; // position in utcp->timers plus one, 0 if no timer is running
     struct timeval rtt_start;
     uint32_t rtrx_tolerance; // usec
     uint32_t rtt_seq;
 
+    // Timestamps
+
+    uint32_t ts_recent; // timestamp to echo to the peer
+    struct timeval ts_recent_age; // when ts_recent was updated, zero if there is none
+    uint32_t ts_last_ack; // rcv.nxt in the last packet we sent
+
+    // Fast open
+
+    bool syn_queued; // our SYN waits for data to carry
+    bool syn_fin; // the FIN was queued before the connection was established
+    bool synack_unacked; // accepted on a fast open SYN, and our SYNACK was not acknowledged yet
+
+    // Path MTU discovery
+
+    uint16_t mtu; // maximum payload of the segments we send, at least utcp->mtu
+    uint16_t probe_size; // payload of the probe in flight, 0 if there is none
+    uint32_t probe_hi; // smallest payload known to be too large
+    uint8_t probe_losses; // times a probe of this size was lost
+    uint8_t timeouts; // retransmit timeouts in a row
+    uint32_t probe_seq; // sequence space of the last probe
+    uint32_t probe_end;
+    struct timeval probe_next; // when a finished search starts again
+
+    // Receive buffer auto-tuning
+
+    struct timeval rcv_rtt_time; // start of the current receive RTT measurement
+    uint32_t rcv_rtt_seq; // rcv.nxt that ends the measurement
+    uint32_t rcv_rtt; // usec, the time it takes to receive a window, 0 if unknown
+    struct timeval rcv_space_time; // start of the current delivered data count
+    uint32_t rcv_space_seq; // rcv.nxt at that time
+
+    // RTT variables
+
+    uint32_t srtt; // usec
+    uint32_t rttvar; // usec
+    uint32_t rto; // usec
+    uint32_t rtt_min; // usec, the smallest RTT sample, 0 if none
+
     // Buffers
 
-    struct buffer sndbuf;
+    struct chunk_buffer sndbuf;
+    size_t snd_reserved; // bytes of sndbuf handed out by utcp_send_reserve()
+    utcp_read_at_t read_at; // where the stream continues after sndbuf, see utcp_send_source()
+    uint64_t source_pos; // offset of the unacked source data in it
+    uint32_t source_left; // bytes of the source not acked yet
+    int source_error; // errno of the read that failed, the connection is reset
+    int source_fd; // for utcp_send_file()
     struct buffer rcvbuf;
-    struct sack sacks[NSACKS];
-    struct list_t *pending_to_send;
+    bool sndbuf_locked; // size set by the application, no auto-tuning
+    bool rcvbuf_locked;
+    struct range_set sacks; // out-of-order data in rcvbuf, at offsets from rcv.nxt
+    uint32_t rcv_recent; // where the last out-of-order data started, its range is reported first
+    uint32_t rcv_ready; // in-order data at the start of rcvbuf waiting for utcp_read(), rcv.nxt follows it
+    uint32_t rcv_adv; // rcv.nxt plus the window, in the last packet we sent
+    struct range_set scoreboard; // what the peer reported with SACK options, at offsets from snd.una
+    struct pkt_queue pending_to_send;
     bool sendatleastone;
 
     // Per-socket options
 
     bool nodelay;
+    bool pull; // received data waits in rcvbuf for utcp_read()
+    uint32_t cork_delay; // usec, 0 if autocork is off
+    bool uncork; // an ACK arrived or the cork timer expired, send the small segment
     bool keepalive;
+    bool pacing;
+    uint32_t ack_every; // acknowledge every this many full-sized segments
+    uint32_t ack_delay; // usec
     uint32_t cwnd_max;
+    uint32_t priority;
+
+    // Send scheduling, see utcp_timeout()
+
+    int32_t deficit; // bytes that may still be sent in this round, one segment may overshoot it
+    bool scheduled; // sending is limited by deficit
+    bool backlogged; // there was more to send than deficit allowed
+
+    // Statistics, only the counters are kept here, see utcp_get_connection_stats()
+
+    struct utcp_stats stats;
 
     // Congestion avoidance state
 
-    struct timeval tlast;
-    uint64_t bandwidth;
+    const struct cc_ops *cc;
+    struct timeval tlast; // start of the current delivery rate sample
+    uint64_t delivered; // bytes the peer has acknowledged, counted when they are SACKed if that is earlier
+    uint64_t bandwidth; // estimated bottleneck bandwidth in bytes per second, 0 if unknown
+    union {
+        struct cubic_state cubic;
+        struct bbr_state bbr;
+    } ccs;
 };
 
 struct utcp {
@@ -192,23 +515,66 @@ struct utcp {
     utcp_accept_t accept;
     utcp_pre_accept_t pre_accept;
     utcp_send_t send;
+    utcp_send_batch_t send_batch;
+    utcp_trace_t trace;
+    utcp_clock_t clock;
 
     // Global socket options
 
     uint16_t mtu;
+    uint16_t mtu_max; // largest mtu connections probe for, see utcp_set_mtu_probing()
     int timeout; // sec
+    uint16_t caps; // capabilities offered to and accepted from peers
+    bool fastopen; // carry data on SYNs and accept connections on them, see utcp_set_fastopen()
+    uint32_t sndbuf_max; // limits for buffer auto-tuning
+    uint32_t rcvbuf_max;
 
-    // RTT variables
+    uint64_t prng; // state of the generator for initial sequence numbers and ports
+
+    // RTT variables, the estimate new connections start with
 
     uint32_t srtt; // usec
     uint32_t rttvar; // usec
     uint32_t rto; // usec
 
+    // Memory accounting
+
+    struct mem_account mem;
+
+    // Counters of all connections and packets, see utcp_get_stats()
+
+    struct utcp_stats stats;
+
+    // Packet buffer pool
+
+    struct pkt_buf *pool;
+    int npool;
+
     // Connection management
 
-    struct utcp_connection **connections;
+    struct utcp_connection **connections; // dense array of all connections
     int nconnections;
     int nallocated;
+    struct utcp_connection **table; // hash table on src and dst, size is a power of two
+    uint32_t table_size;
+    uint32_t ports[NPORTS / 32]; // bitmap of local ports picked by allocate_connection()
+
+    // Timers
+
+    struct utcp_connection **timers; // min-heap of connections by earliest deadline
+    uint32_t ntimers;
+    struct utcp_connection *ready_head; // connections with work to do besides timers
+    struct utcp_connection *ready_tail;
+    uint32_t nready;
+    struct utcp_connection *last_conn; // last connection a packet was received for
+
+    // Receive batching
+
+    bool batching;
+    struct utcp_connection *ack_list; // connections that need an ACK at the end of the batch
+    struct deferred_recv *deferred; // data to pass to the application at the end of the batch
+    size_t ndeferred;
+    size_t ndeferred_allocated;
 };
 
 #endif